@@ -94,6 +94,10 @@ endif()
 find_package(FreeImage REQUIRED)
 include_directories(${FREEIMAGE_INCLUDE_DIRS})
 
+# zlib
+find_package(ZLIB REQUIRED)
+include_directories(${ZLIB_INCLUDE_DIRS})
+
 # yaml-cpp
 find_package(YamlCpp REQUIRED)
 include_directories(${YAMLCPP_INCLUDE_DIRS})
@@ -47,7 +47,7 @@ class Accel : public Configurable
 {
 public:
 
-    LM_INTERFACE_CLASS(Accel, Configurable, 2);
+    LM_INTERFACE_CLASS(Accel, Configurable, 5);
 
 public:
 
@@ -86,6 +86,60 @@ public:
     */
     LM_INTERFACE_F(1, Intersect, bool(const Scene* scene, const Ray& ray, Intersection& isect, Float minT, Float maxT));
 
+    /*!
+        \brief Intersection query with a packet of rays.
+
+        The function traces `n` rays at once and stores the information
+        on the hit points in `isects[0]` to `isects[n-1]`.
+        The rays are supposed to be coherent (e.g., primary rays of neighboring pixels)
+        so that the implementation can share the traversal among the rays.
+        The function is optional; callers must check `IntersectPacket.Implemented()`
+        and fall back to `Intersect` otherwise (see `Scene::IntersectPacket`).
+
+        \param scene  Scene.
+        \param rays   Array of `n` rays.
+        \param n      Number of rays (at most 32).
+        \param isects Array of `n` intersection data.
+        \param minT   Minimum range of the distance.
+        \param maxT   Maximum range of the distance.
+        \return Bit mask of the rays intersected with the scene (i-th bit for `rays[i]`).
+    */
+    LM_INTERFACE_F(2, IntersectPacket, unsigned int(const Scene* scene, const Ray* rays, int n, Intersection* isects, Float minT, Float maxT));
+
+    /*!
+        \brief Occlusion query.
+
+        The function checks if `ray` hits with any triangle
+        in the range of the distance between `minT` and `maxT`.
+        Unlike `Intersect`, the traversal terminates with the first hit found
+        and no information on the hit point is computed.
+        This function is supposed to be used for the visibility tests.
+
+        \param ray    Ray.
+        \param minT   Minimum range of the distance.
+        \param maxT   Maximum range of the distance.
+        \retval true  Occluded by the scene.
+        \retval false Not occluded by the scene.
+    */
+    LM_INTERFACE_F(3, Occluded, bool(const Ray& ray, Float minT, Float maxT));
+
+    /*!
+        \brief Refit the acceleration structure.
+
+        Updates the acceleration structure after the transforms of the primitives are changed
+        (see `Scene::SetPrimitiveTransform`). The bounds of the nodes are recomputed bottom-up
+        without changing the topology of the tree, which is much cheaper than `Build`
+        while the quality of the tree degrades as the primitives move far from the original positions.
+        The set of the primitives and the meshes must be the same as the one used for `Build`.
+        The function is optional; callers must check `Refit.Implemented()`
+        and fall back to `Build` otherwise (see `Scene::Refit`).
+
+        \param scene Scene.
+        \retval true  Succeeded to refit.
+        \retval false Failed to refit.
+    */
+    LM_INTERFACE_F(4, Refit, bool(const Scene* scene));
+
 };
 
 LM_NAMESPACE_END
@@ -0,0 +1,316 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/scene.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/trianglemesh.h>
+#include <lightmetrica/logger.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <string>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Hash function for the acceleration structure cache.
+
+    Computes 64-bit FNV-1a hash of the data fed with `Add` functions.
+    \ingroup accel
+*/
+class AccelCacheHash
+{
+public:
+
+    auto Add(const void* data, size_t size) -> void
+    {
+        const auto* p = reinterpret_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; i++)
+        {
+            hash_ ^= p[i];
+            hash_ *= 0x100000001b3ULL;
+        }
+    }
+
+    template <typename T>
+    auto Add(T v) -> void
+    {
+        Add(&v, sizeof(T));
+    }
+
+    auto Add(const std::string& s) -> void
+    {
+        Add(s.data(), s.size());
+    }
+
+    auto Value() const -> std::uint64_t { return hash_; }
+
+    /*!
+        \brief Hash of the scene geometry.
+        The hash is computed from the positions, faces, and transforms of the triangle meshes.
+    */
+    static auto SceneHash(const Scene* scene) -> AccelCacheHash
+    {
+        AccelCacheHash hash;
+        const int np = scene->NumPrimitives();
+        hash.Add(np);
+        for (int i = 0; i < np; i++)
+        {
+            const auto* prim = scene->PrimitiveAt(i);
+            const auto* mesh = prim->mesh;
+            if (!mesh)
+            {
+                hash.Add(-1);
+                continue;
+            }
+            hash.Add(prim->transform);
+            hash.Add(mesh->NumVertices());
+            hash.Add(mesh->NumFaces());
+            hash.Add(mesh->Positions(), sizeof(Float) * 3 * mesh->NumVertices());
+            hash.Add(mesh->Faces(), sizeof(unsigned int) * 3 * mesh->NumFaces());
+        }
+        return hash;
+    }
+
+private:
+
+    std::uint64_t hash_ = 0xcbf29ce484222325ULL;
+
+};
+
+/*!
+    \brief Acceleration structure cache.
+
+    Stores the arrays of the acceleration structure (nodes, triangles, etc.)
+    in a file keyed by the hash of the scene and the parameters of the accel.
+    The file is memory-mapped on loading so that the arrays can be used
+    directly by the traversal without copying.
+
+    The file consists of a header followed by the sections,
+    each of which is aligned to 64 bytes.
+    \ingroup accel
+*/
+class AccelCache
+{
+public:
+
+    //! Section of the cache file
+    struct Section
+    {
+        const void* data;
+        size_t size;
+    };
+
+private:
+
+    static const std::uint32_t Magic = 0x43414d4c;      // 'LMAC'
+    static const std::uint32_t Version = 1;
+    static const int MaxNumSections = 16;
+    static const size_t SectionAlignment = 64;
+
+    struct Header
+    {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint64_t hash;
+        std::uint32_t numSections;
+        std::uint32_t padding;
+        std::uint64_t offsets[MaxNumSections];
+        std::uint64_t sizes[MaxNumSections];
+    };
+
+public:
+
+    /*!
+        \brief Path to the cache file.
+        \param cacheDir Directory of the cache files.
+        \param name     Name of the accel.
+        \param hash     Hash of the scene and the parameters.
+    */
+    static auto CachePath(const std::string& cacheDir, const std::string& name, std::uint64_t hash) -> std::string
+    {
+        return (boost::filesystem::path(cacheDir) / boost::str(boost::format("%s_%016x.cache") % name % hash)).string();
+    }
+
+    /*!
+        \brief Save the sections to the cache file.
+        The file is first written to a temporary file and then renamed
+        so that the concurrent processes never read incomplete files.
+    */
+    static auto Save(const std::string& path, std::uint64_t hash, const std::vector<Section>& sections) -> bool
+    {
+        if (sections.size() > MaxNumSections)
+        {
+            LM_LOG_ERROR("Too many sections");
+            return false;
+        }
+
+        boost::system::error_code ec;
+        const boost::filesystem::path p(path);
+        if (p.has_parent_path())
+        {
+            boost::filesystem::create_directories(p.parent_path(), ec);
+        }
+
+        Header header;
+        std::memset(&header, 0, sizeof(Header));
+        header.magic = Magic;
+        header.version = Version;
+        header.hash = hash;
+        header.numSections = (std::uint32_t)(sections.size());
+        std::uint64_t offset = AlignOffset(sizeof(Header));
+        for (size_t i = 0; i < sections.size(); i++)
+        {
+            header.offsets[i] = offset;
+            header.sizes[i] = sections[i].size;
+            offset = AlignOffset(offset + sections[i].size);
+        }
+
+        const auto tempPath = boost::filesystem::unique_path(path + ".%%%%-%%%%.tmp").string();
+        {
+            std::ofstream out(tempPath, std::ios::binary);
+            if (!out)
+            {
+                LM_LOG_WARN("Failed to open the cache file '" + tempPath + "'");
+                return false;
+            }
+
+            const char zeros[SectionAlignment] = {};
+            out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            out.write(zeros, AlignOffset(sizeof(Header)) - sizeof(Header));
+            for (const auto& section : sections)
+            {
+                out.write(reinterpret_cast<const char*>(section.data), section.size);
+                out.write(zeros, AlignOffset(section.size) - section.size);
+            }
+            if (!out)
+            {
+                LM_LOG_WARN("Failed to write the cache file '" + tempPath + "'");
+                out.close();
+                boost::filesystem::remove(tempPath, ec);
+                return false;
+            }
+        }
+
+        boost::filesystem::rename(tempPath, path, ec);
+        if (ec)
+        {
+            LM_LOG_WARN("Failed to rename the cache file '" + tempPath + "'");
+            boost::filesystem::remove(tempPath, ec);
+            return false;
+        }
+
+        return true;
+    }
+
+    /*!
+        \brief Open and map the cache file.
+        \retval false The file does not exist or does not match the hash.
+    */
+    auto Load(const std::string& path, std::uint64_t hash) -> bool
+    {
+        // Invalidate the previously loaded cache before the region is remapped
+        header_ = nullptr;
+
+        boost::system::error_code ec;
+        if (!boost::filesystem::exists(path, ec))
+        {
+            return false;
+        }
+
+        try
+        {
+            file_ = boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+            region_ = boost::interprocess::mapped_region(file_, boost::interprocess::read_only);
+        }
+        catch (const boost::interprocess::interprocess_exception& e)
+        {
+            LM_LOG_WARN("Failed to map the cache file '" + path + "': " + e.what());
+            return false;
+        }
+
+        // Validate the header
+        if (region_.get_size() < sizeof(Header))
+        {
+            LM_LOG_WARN("Invalid cache file '" + path + "'");
+            return false;
+        }
+        const auto* header = reinterpret_cast<const Header*>(region_.get_address());
+        if (header->magic != Magic || header->version != Version || header->hash != hash || header->numSections > MaxNumSections)
+        {
+            LM_LOG_WARN("Invalid cache file '" + path + "'");
+            return false;
+        }
+        for (std::uint32_t i = 0; i < header->numSections; i++)
+        {
+            if (header->offsets[i] + header->sizes[i] > region_.get_size())
+            {
+                LM_LOG_WARN("Invalid cache file '" + path + "'");
+                return false;
+            }
+        }
+
+        header_ = header;
+        return true;
+    }
+
+    //! Number of sections in the loaded cache
+    auto NumSections() const -> int { return header_ ? (int)(header_->numSections) : 0; }
+
+    /*!
+        \brief Get the pointer to the section of the mapped file.
+        \param i     Index of the section.
+        \param count Number of elements in the section.
+    */
+    template <typename T>
+    auto Data(int i, size_t& count) const -> const T*
+    {
+        assert(header_ && i < NumSections());
+        count = (size_t)(header_->sizes[i] / sizeof(T));
+        return reinterpret_cast<const T*>(reinterpret_cast<const char*>(region_.get_address()) + header_->offsets[i]);
+    }
+
+private:
+
+    static auto AlignOffset(std::uint64_t offset) -> std::uint64_t
+    {
+        return (offset + SectionAlignment - 1) / SectionAlignment * SectionAlignment;
+    }
+
+private:
+
+    boost::interprocess::file_mapping file_;
+    boost::interprocess::mapped_region region_;
+    const Header* header_ = nullptr;
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,391 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <lightmetrica/bound.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/trianglemesh.h>
+#include <lightmetrica/scene.h>
+#include <tbb/tbb.h>
+#include <vector>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief BVH build utilities.
+
+    Utility functions shared by the SAH-based BVH builders.
+    The nodes with many triangles are processed in parallel with TBB:
+    binning near the root is parallelized over the triangles,
+    and the subtrees below are built as separate tasks.
+
+    \ingroup scene
+*/
+class BVHBuildUtils
+{
+public:
+
+    LM_DISABLE_CONSTRUCT(BVHBuildUtils);
+
+public:
+
+    //! Number of triangles in a node from which the binning is parallelized.
+    static const int ParallelBinningThreshold = 1 << 16;
+
+    //! Number of triangles in a node from which the child subtrees are built in parallel.
+    static const int ParallelBuildThreshold = 1 << 12;
+
+public:
+
+    //! Bins for the binned SAH.
+    template <int NumBins>
+    struct Bins
+    {
+        Bound bounds[NumBins];
+        int counts[NumBins] = {};
+
+        auto Merge(const Bins& o) -> void
+        {
+            for (int i = 0; i < NumBins; i++)
+            {
+                bounds[i] = Math::Union(bounds[i], o.bounds[i]);
+                counts[i] += o.counts[i];
+            }
+        }
+    };
+
+    /*!
+        \brief Stack for the traversal.
+        Uses the fixed-size array of `N` entries, or the heap if the required size exceeds it,
+        e.g., for the degenerate trees built from the triangles with the identical centroids.
+    */
+    template <int N>
+    class TraversalStack
+    {
+    public:
+
+        TraversalStack(int size)
+            : data_(fixed_)
+        {
+            if (size > N)
+            {
+                heap_.resize(size);
+                data_ = heap_.data();
+            }
+        }
+
+        auto operator[](int i) -> int& { return data_[i]; }
+
+    private:
+
+        int fixed_[N];
+        std::vector<int> heap_;
+        int* data_;
+
+    };
+
+    //! Statistics of the built tree.
+    struct BuildStats
+    {
+        int numNodes = 0;                   //!< Number of nodes
+        int numLeaves = 0;                  //!< Number of non-empty leaves
+        int maxDepth = 0;                   //!< Maximum depth of the leaves
+        long long numLeafTriangles = 0;     //!< Total number of triangles in the leaves
+    };
+
+public:
+
+    /*!
+        \brief Index of the bin.
+        \param c Centroid of the triangle along the split axis.
+        \param min Minimum of the centroid bound along the split axis.
+        \param max Maximum of the centroid bound along the split axis.
+    */
+    template <int NumBins>
+    static auto BinIndex(Float c, Float min, Float max) -> int
+    {
+        return std::min((int)((c - min) / (max - min) * NumBins), NumBins - 1);
+    }
+
+    /*!
+        \brief Compute the bound and the centroid bound.
+        Computes the bounds of the triangles `indices[begin]` to `indices[end - 1]`.
+    */
+    static auto ComputeBound(const std::vector<Bound>& bounds, const std::vector<int>& indices, int begin, int end, Bound& bound, Bound& centroidBound) -> void
+    {
+        using BoundPair = std::pair<Bound, Bound>;
+        const auto Reduce = [&](int b, int e, BoundPair result) -> BoundPair
+        {
+            for (int i = b; i < e; i++)
+            {
+                const auto& triBound = bounds[indices[i]];
+                result.first = Math::Union(result.first, triBound);
+                result.second = Math::Union(result.second, triBound.Centroid());
+            }
+            return result;
+        };
+
+        BoundPair result;
+        if (end - begin < ParallelBinningThreshold)
+        {
+            result = Reduce(begin, end, BoundPair());
+        }
+        else
+        {
+            result = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end), BoundPair(), [&](const tbb::blocked_range<int>& range, BoundPair r) -> BoundPair
+            {
+                return Reduce(range.begin(), range.end(), r);
+            }, [](const BoundPair& r1, const BoundPair& r2) -> BoundPair
+            {
+                return BoundPair(Math::Union(r1.first, r2.first), Math::Union(r1.second, r2.second));
+            });
+        }
+
+        bound = result.first;
+        centroidBound = result.second;
+    }
+
+    /*!
+        \brief Bin the triangles.
+        Distributes the triangles into the bins along `axis` according to their centroids.
+    */
+    template <int NumBins>
+    static auto Bin(const std::vector<Bound>& bounds, const std::vector<int>& indices, int begin, int end, int axis, const Bound& centroidBound) -> Bins<NumBins>
+    {
+        const auto Reduce = [&](int b, int e, Bins<NumBins>& result) -> void
+        {
+            const Float min = centroidBound.min[axis];
+            const Float max = centroidBound.max[axis];
+            for (int i = b; i < e; i++)
+            {
+                const auto& triBound = bounds[indices[i]];
+                const int idx = BinIndex<NumBins>(triBound.Centroid()[axis], min, max);
+                result.bounds[idx] = Math::Union(result.bounds[idx], triBound);
+                result.counts[idx]++;
+            }
+        };
+
+        Bins<NumBins> result;
+        if (end - begin < ParallelBinningThreshold)
+        {
+            Reduce(begin, end, result);
+        }
+        else
+        {
+            result = tbb::parallel_reduce(tbb::blocked_range<int>(begin, end), Bins<NumBins>(), [&](const tbb::blocked_range<int>& range, Bins<NumBins> r) -> Bins<NumBins>
+            {
+                Reduce(range.begin(), range.end(), r);
+                return r;
+            }, [](Bins<NumBins> r1, const Bins<NumBins>& r2) -> Bins<NumBins>
+            {
+                r1.Merge(r2);
+                return r1;
+            });
+        }
+
+        return result;
+    }
+
+    /*!
+        \brief Find the split with the minimum SAH cost.
+
+        The costs of all split positions between the bins are evaluated
+        in linear time with the prefix and suffix sweeps of the bins.
+        The split `i` separates the bins `[0, i]` and `[i + 1, NumBins - 1]`.
+
+        \param bins Bins.
+        \param bound Bound of the node.
+        \param minCost Minimum local SAH cost.
+        \return Index of the split with the minimum cost.
+    */
+    template <int NumBins>
+    static auto FindSplit(const Bins<NumBins>& bins, const Bound& bound, Float& minCost) -> int
+    {
+        const Float Cb = 0.125_f;
+
+        // Costs of the right parts
+        Float rightCosts[NumBins - 1];
+        {
+            Bound b;
+            int n = 0;
+            for (int i = NumBins - 1; i > 0; i--)
+            {
+                b = Math::Union(b, bins.bounds[i]);
+                n += bins.counts[i];
+                rightCosts[i - 1] = n > 0 ? b.SurfaceArea() * n : 0_f;
+            }
+        }
+
+        // Costs of the left parts and local SAH costs
+        int minSplit = 0;
+        minCost = Math::Inf();
+        {
+            Bound b;
+            int n = 0;
+            for (int split = 0; split < NumBins - 1; split++)
+            {
+                b = Math::Union(b, bins.bounds[split]);
+                n += bins.counts[split];
+                const Float leftCost = n > 0 ? b.SurfaceArea() * n : 0_f;
+                const Float cost = Cb + (leftCost + rightCosts[split]) / bound.SurfaceArea();
+                if (cost < minCost)
+                {
+                    minCost = cost;
+                    minSplit = split;
+                }
+            }
+        }
+
+        return minSplit;
+    }
+
+    /*!
+        \brief Process child subtrees.
+        Executes `func1` and `func2` in parallel if the node has enough triangles.
+    */
+    template <typename Func1, typename Func2>
+    static auto ProcessChildren(int numTriangles, const Func1& func1, const Func2& func2) -> void
+    {
+        if (numTriangles < ParallelBuildThreshold)
+        {
+            func1();
+            func2();
+        }
+        else
+        {
+            tbb::parallel_invoke(func1, func2);
+        }
+    }
+
+    /*!
+        \brief Compute the triangle in world coordinates.
+        \param prim Primitive containing the triangle.
+        \param face Face index of the triangle.
+        \return Bound of the triangle slightly enlarged in the same way as the builders.
+    */
+    static auto TransformedTriangle(const Primitive* prim, int face, Vec3& p1, Vec3& p2, Vec3& p3) -> Bound
+    {
+        const auto* faces = prim->mesh->Faces();
+        const unsigned int i1 = faces[3 * face];
+        const unsigned int i2 = faces[3 * face + 1];
+        const unsigned int i3 = faces[3 * face + 2];
+        if (prim->worldPositions)
+        {
+            // Use the precomputed world-space positions
+            const auto* ps = prim->worldPositions;
+            p1 = Vec3(ps[3 * i1], ps[3 * i1 + 1], ps[3 * i1 + 2]);
+            p2 = Vec3(ps[3 * i2], ps[3 * i2 + 1], ps[3 * i2 + 2]);
+            p3 = Vec3(ps[3 * i3], ps[3 * i3 + 1], ps[3 * i3 + 2]);
+        }
+        else
+        {
+            const auto* ps = prim->mesh->Positions();
+            p1 = Vec3(prim->transform * Vec4(ps[3 * i1], ps[3 * i1 + 1], ps[3 * i1 + 2], 1_f));
+            p2 = Vec3(prim->transform * Vec4(ps[3 * i2], ps[3 * i2 + 1], ps[3 * i2 + 2], 1_f));
+            p3 = Vec3(prim->transform * Vec4(ps[3 * i3], ps[3 * i3 + 1], ps[3 * i3 + 2], 1_f));
+        }
+
+        Bound bound;
+        bound = Math::Union(bound, p1);
+        bound = Math::Union(bound, p2);
+        bound = Math::Union(bound, p3);
+        bound.min -= Vec3(Math::Eps());
+        bound.max += Vec3(Math::Eps());
+        return bound;
+    }
+
+    /*!
+        \brief Reload the triaccels with the current transforms of the primitives.
+        Used by the refit of the BVHs. The bounds of the triangles are stored in `bounds`.
+    */
+    template <typename TriangleArray>
+    static auto RefitTriangles(const Scene* scene, TriangleArray& triangles, std::vector<Bound>& bounds) -> void
+    {
+        bounds.resize(triangles.size());
+        tbb::parallel_for(0, (int)(triangles.size()), [&](int i) -> void
+        {
+            auto& tri = triangles[i];
+            Vec3 p1, p2, p3;
+            bounds[i] = TransformedTriangle(scene->PrimitiveAt(tri.primIndex), tri.faceIndex, p1, p2, p3);
+            tri.Load(p1, p2, p3);
+        });
+    }
+
+    /*!
+        \brief Recompute the bounds of the binary BVH bottom-up.
+        The topology of the tree is unchanged.
+        The children must be placed after their parents in `nodes`,
+        which holds for all builders as the nodes are laid out in depth-first order.
+        \param leafBound Function to compute the bound of a leaf node.
+    */
+    template <typename NodeArray, typename LeafBoundFunc>
+    static auto RefitNodes(NodeArray& nodes, const LeafBoundFunc& leafBound) -> void
+    {
+        for (int i = (int)(nodes.size()) - 1; i >= 0; i--)
+        {
+            auto& node = nodes[i];
+            node.bound = node.isleaf
+                ? leafBound(node)
+                : Math::Union(nodes[node.internal.child1].bound, nodes[node.internal.child2].bound);
+        }
+    }
+
+    /*!
+        \brief Compute the maximum depth of the binary BVH.
+        The children must be placed after their parents in `nodes` (see `RefitNodes`).
+        The traversal with the stack needs `MaxDepth(nodes) + 1` entries at most.
+    */
+    template <typename NodeArray>
+    static auto MaxDepth(const NodeArray& nodes) -> int
+    {
+        int maxDepth = 0;
+        std::vector<int> depths(nodes.size(), 0);
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            const auto& node = nodes[i];
+            if (!node.isleaf)
+            {
+                depths[node.internal.child1] = depths[node.internal.child2] = depths[i] + 1;
+                maxDepth = std::max(maxDepth, depths[i] + 1);
+            }
+        }
+        return maxDepth;
+    }
+
+    //! Print statistics of the built tree.
+    static auto PrintStats(const BuildStats& stats, double elapsed) -> void
+    {
+        LM_LOG_INFO(boost::str(boost::format("Build time        : %.3fs") % elapsed));
+        LM_LOG_INFO(boost::str(boost::format("# of nodes        : %d") % stats.numNodes));
+        LM_LOG_INFO(boost::str(boost::format("# of leaves       : %d") % stats.numLeaves));
+        LM_LOG_INFO(boost::str(boost::format("Max depth         : %d") % stats.maxDepth));
+        LM_LOG_INFO(boost::str(boost::format("Avg. leaf size    : %.2f") % (stats.numLeaves > 0 ? (double)(stats.numLeafTriangles) / stats.numLeaves : 0.0)));
+    }
+
+};
+
+LM_NAMESPACE_END
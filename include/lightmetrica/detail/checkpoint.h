@@ -0,0 +1,114 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <string>
+#include <iostream>
+#include <functional>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Checkpoint of the rendering.
+
+    Holds the configuration of the checkpoints given by the application
+    (e.g., `lightmetrica render --checkpoint-interval`) and provides
+    the functions to read / write checkpoint files.
+    The components supporting the checkpoint (e.g., the default scheduler)
+    periodically save their states with `Save` and restore them with `Load`
+    if `GetResume` is true.
+
+    \ingroup detail
+*/
+class Checkpoint
+{
+public:
+
+    LM_DISABLE_CONSTRUCT(Checkpoint);
+
+public:
+
+    //! Set path to the checkpoint file
+    LM_PUBLIC_API static auto SetPath(const std::string& path) -> void;
+
+    //! Get path to the checkpoint file
+    LM_PUBLIC_API static auto GetPath() -> std::string;
+
+    //! Set interval of the checkpoints in seconds (disabled if not positive)
+    LM_PUBLIC_API static auto SetInterval(double interval) -> void;
+
+    //! Get interval of the checkpoints in seconds
+    LM_PUBLIC_API static auto GetInterval() -> double;
+
+    //! Set if the rendering is resumed from the checkpoint
+    LM_PUBLIC_API static auto SetResume(bool resume) -> void;
+
+    //! Check if the rendering is resumed from the checkpoint
+    LM_PUBLIC_API static auto GetResume() -> bool;
+
+    //! Check if the periodic checkpoints are enabled
+    static auto Enabled() -> bool { return !GetPath().empty() && GetInterval() > 0; }
+
+public:
+
+    /*!
+        \brief Save a checkpoint.
+
+        Writes the checkpoint to `GetPath()`. The content is written by `writeFunc`.
+        The file is written to a temporary file and replaced afterwards,
+        so that the previous checkpoint survives if the process is killed while writing.
+        `tag` identifies the component writing the checkpoint, which is validated in `Load`.
+    */
+    LM_PUBLIC_API static auto Save(const std::string& tag, const std::function<bool(std::ostream& out)>& writeFunc) -> bool;
+
+    /*!
+        \brief Load a checkpoint.
+
+        Reads the checkpoint from `GetPath()` and passes the content to `readFunc`.
+        Fails if the checkpoint was not written by the component specified by `tag`.
+    */
+    LM_PUBLIC_API static auto Load(const std::string& tag, const std::function<bool(std::istream& in)>& readFunc) -> bool;
+
+public:
+
+    //! Write a value in binary
+    template <typename T>
+    static auto Write(std::ostream& out, const T& v) -> void
+    {
+        out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    //! Read a value in binary
+    template <typename T>
+    static auto Read(std::istream& in, T& v) -> bool
+    {
+        in.read(reinterpret_cast<char*>(&v), sizeof(T));
+        return !in.fail();
+    }
+
+};
+
+LM_NAMESPACE_END
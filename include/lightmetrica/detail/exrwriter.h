@@ -0,0 +1,94 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/macros.h>
+#include <lightmetrica/enum.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Compression of OpenEXR images.
+
+    `ZIP` and `ZIPS` are the lossless zlib compressions of OpenEXR
+    over 16 scanlines and a single scanline per chunk respectively
+    (the tiles are compressed individually in the tiled images).
+
+    \ingroup detail
+*/
+enum class EXRCompression
+{
+    None,
+    ZIPS,
+    ZIP,
+};
+
+const std::string EXRCompression_String[] =
+{
+    "none",
+    "zips",
+    "zip",
+};
+
+LM_ENUM_TYPE_MAP(EXRCompression);
+
+/*!
+    \brief Minimal OpenEXR writer.
+
+    Writes a scanline or tiled OpenEXR image with an arbitrary number of
+    32-bit floating-point channels (e.g., `R`, `G`, `B`, `albedo.R`, `normal.X`, ...),
+    either uncompressed or with the ZIP compression.
+    The image is streamed to the file while the rows are requested from the caller,
+    so only a scanline (or a row of tiles) is kept in memory regardless of the image size.
+
+    \ingroup detail
+*/
+class EXRWriter
+{
+public:
+
+    LM_DISABLE_CONSTRUCT(EXRWriter);
+
+public:
+
+    /*!
+        \brief Save an image.
+
+        The channels are stored in the alphabetical order of the names as required by the format.
+        `rowFunc(y, channel, row)` fills `row` (`width` elements) with the values of
+        the channel (the index in `channelNames`) of the scanline `y`,
+        where `y = 0` is the top of the image.
+        If `tileSize` is positive, the image is written as a tiled image
+        with the tiles of `tileSize` * `tileSize` pixels.
+        The chunks not reduced by the compression are stored uncompressed.
+    */
+    LM_PUBLIC_API static auto Save(const std::string& path, int width, int height, const std::vector<std::string>& channelNames, const std::function<void(int y, int channel, float* row)>& rowFunc, int tileSize = 0, EXRCompression compression = EXRCompression::ZIP) -> bool;
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,226 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <lightmetrica/math.h>
+#include <string>
+#include <vector>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Pixel storage of the films.
+
+    Stores the RGB values of the pixels with the representation chosen at load time,
+    independent of the precision of `Float` used by the rest of the renderer.
+    
+    - `native` stores `Vec3` per pixel (with the padding of the SIMD types).
+    - `float` stores three 32-bit floating-point values per pixel.
+    - `kahan` stores three 32-bit values and their compensation terms,
+      reducing the rounding error of the long summations (Kahan summation).
+
+    The compact storages reduce the memory of the films cloned per thread
+    and the bandwidth of `Film::Accumulate`.
+
+    \ingroup detail
+*/
+class FilmStorage
+{
+public:
+
+    enum class Type
+    {
+        Native,
+        Float,
+        Kahan,
+    };
+
+public:
+
+    /*!
+        \brief Initialize the storage.
+        Allocates `numPixels` pixels initialized with zero.
+        \retval false Unknown storage type.
+    */
+    auto Initialize(const std::string& type, int numPixels) -> bool
+    {
+        if (type == "native")
+        {
+            type_ = Type::Native;
+        }
+        else if (type == "float")
+        {
+            type_ = Type::Float;
+        }
+        else if (type == "kahan")
+        {
+            type_ = Type::Kahan;
+        }
+        else
+        {
+            return false;
+        }
+
+        typeName_ = type;
+        numPixels_ = numPixels;
+        Clear();
+        return true;
+    }
+
+    //! Name of the storage type
+    auto TypeName() const -> std::string { return typeName_; }
+
+    //! Reset the pixels to zero
+    auto Clear() -> void
+    {
+        native_.clear();
+        data_.clear();
+        comp_.clear();
+        if (type_ == Type::Native)
+        {
+            native_.assign(numPixels_, Vec3());
+        }
+        else
+        {
+            data_.assign(3 * numPixels_, 0.0f);
+            if (type_ == Type::Kahan)
+            {
+                comp_.assign(3 * numPixels_, 0.0f);
+            }
+        }
+    }
+
+    //! Add a value to the pixel `i`
+    LM_INLINE auto Add(int i, const Vec3& v) -> void
+    {
+        if (type_ == Type::Native)
+        {
+            native_[i] += v;
+        }
+        else if (type_ == Type::Float)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                data_[3 * i + j] += (float)(v[j]);
+            }
+        }
+        else
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                AddKahan(3 * i + j, (float)(v[j]));
+            }
+        }
+    }
+
+    //! Value of the pixel `i`
+    LM_INLINE auto Get(int i) const -> Vec3
+    {
+        if (type_ == Type::Native)
+        {
+            return native_[i];
+        }
+        if (type_ == Type::Float)
+        {
+            return Vec3(Float(data_[3 * i]), Float(data_[3 * i + 1]), Float(data_[3 * i + 2]));
+        }
+        return Vec3(
+            Float(data_[3 * i]) - Float(comp_[3 * i]),
+            Float(data_[3 * i + 1]) - Float(comp_[3 * i + 1]),
+            Float(data_[3 * i + 2]) - Float(comp_[3 * i + 2]));
+    }
+
+    //! Overwrite the value of the pixel `i`
+    auto Set(int i, const Vec3& v) -> void
+    {
+        if (type_ == Type::Native)
+        {
+            native_[i] = v;
+            return;
+        }
+        for (int j = 0; j < 3; j++)
+        {
+            data_[3 * i + j] = (float)(v[j]);
+            if (type_ == Type::Kahan)
+            {
+                comp_[3 * i + j] = 0.0f;
+            }
+        }
+    }
+
+    //! Scale the values of all pixels
+    auto Scale(Float w) -> void
+    {
+        for (auto& v : native_) { v *= w; }
+        for (auto& v : data_) { v *= (float)(w); }
+        for (auto& v : comp_) { v *= (float)(w); }
+    }
+
+    //! Add the values of the storage of the same type and size
+    auto Accumulate(const FilmStorage& o) -> void
+    {
+        assert(type_ == o.type_ && numPixels_ == o.numPixels_);
+        if (type_ == Type::Native)
+        {
+            std::transform(native_.begin(), native_.end(), o.native_.begin(), native_.begin(), std::plus<Vec3>());
+        }
+        else if (type_ == Type::Float)
+        {
+            std::transform(data_.begin(), data_.end(), o.data_.begin(), data_.begin(), std::plus<float>());
+        }
+        else
+        {
+            for (size_t i = 0; i < data_.size(); i++)
+            {
+                AddKahan(i, o.data_[i] - o.comp_[i]);
+            }
+        }
+    }
+
+private:
+
+    // Kahan summation of the component `i`.
+    // `comp_` keeps the negated low-order part lost in the sum.
+    LM_INLINE auto AddKahan(size_t i, float v) -> void
+    {
+        const float y = v - comp_[i];
+        const float t = data_[i] + y;
+        comp_[i] = (t - data_[i]) - y;
+        data_[i] = t;
+    }
+
+private:
+
+    Type type_ = Type::Native;
+    std::string typeName_ = "native";
+    int numPixels_ = 0;
+    std::vector<Vec3> native_;      // Pixels of the `native` storage
+    std::vector<float> data_;       // Components of the `float` and `kahan` storages
+    std::vector<float> comp_;       // Compensation terms of the `kahan` storage
+
+};
+
+LM_NAMESPACE_END
@@ -0,0 +1,274 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#pragma once
+
+#include <lightmetrica/math.h>
+#include <string>
+#include <vector>
+#include <functional>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Precomputed table of a reconstruction filter.
+
+    A separable reconstruction filter used by the films to splat the contributions
+    to the pixels around the raster position.
+    The 1D filter is quantized into a table of `TableSize` entries over [0, radius),
+    and the table is normalized so that the 2D filter integrates to one (in the unit of pixels).
+    Thus the films keep the same normalization as the box filter, that is,
+    the splatted contributions are rescaled by (#pixels / #samples) and both the sensor
+    and light subpaths (e.g., LT, BDPT) are supported without per-pixel weight sums.
+
+    The supported filters are `box` (a pixel-sized box, i.e., no filtering),
+    `gaussian`, `mitchell` (B = C = 1/3), and `blackmanharris`.
+
+    \ingroup detail
+*/
+class FilterTable
+{
+public:
+
+    static const int TableSize = 64;
+
+    //! Maximum radius of the filters in pixels
+    static auto MaxRadius() -> Float { return 4_f; }
+
+public:
+
+    /*!
+        \brief Initialize the table.
+        If `radius` is not positive, the default radius of the filter is used.
+        \retval false Unknown filter type.
+    */
+    auto Initialize(const std::string& type, Float radius) -> bool
+    {
+        type_ = type;
+        if (type == "box")
+        {
+            radius_ = 0.5_f;
+            table_.clear();
+            return true;
+        }
+
+        // Filter function and default radius
+        std::function<Float(Float d)> filterFunc;
+        Float defaultRadius;
+        if (type == "gaussian")
+        {
+            defaultRadius = 1.5_f;
+            filterFunc = [&](Float d) -> Float
+            {
+                const Float Alpha = 2_f;
+                return Math::Max(0_f, std::exp(-Alpha * d * d) - std::exp(-Alpha * radius_ * radius_));
+            };
+        }
+        else if (type == "mitchell")
+        {
+            defaultRadius = 2_f;
+            filterFunc = [&](Float d) -> Float
+            {
+                const Float B = 1_f / 3_f;
+                const Float C = 1_f / 3_f;
+                const Float x = 2_f * d / radius_;
+                if (x < 1_f)
+                {
+                    return ((12_f - 9_f * B - 6_f * C) * x * x * x + (-18_f + 12_f * B + 6_f * C) * x * x + (6_f - 2_f * B)) / 6_f;
+                }
+                return ((-B - 6_f * C) * x * x * x + (6_f * B + 30_f * C) * x * x + (-12_f * B - 48_f * C) * x + (8_f * B + 24_f * C)) / 6_f;
+            };
+        }
+        else if (type == "blackmanharris")
+        {
+            defaultRadius = 2_f;
+            filterFunc = [&](Float d) -> Float
+            {
+                const Float A0 = 0.35875_f, A1 = 0.48829_f, A2 = 0.14128_f, A3 = 0.01168_f;
+                const Float t = 2_f * Math::Pi() * (0.5_f + 0.5_f * d / radius_);
+                return A0 - A1 * Math::Cos(t) + A2 * Math::Cos(2_f * t) - A3 * Math::Cos(3_f * t);
+            };
+        }
+        else
+        {
+            return false;
+        }
+
+        radius_ = Math::Clamp(radius > 0_f ? radius : defaultRadius, 0.5_f, MaxRadius());
+
+        // Evaluate the filter at the centers of the bins and normalize the table
+        // so that the integral over [-radius, radius] (the sum of the piecewise constant function) is one
+        table_.resize(TableSize);
+        Float sum = 0_f;
+        for (int i = 0; i < TableSize; i++)
+        {
+            table_[i] = filterFunc((Float(i) + 0.5_f) / TableSize * radius_);
+            sum += table_[i];
+        }
+        const Float norm = 1_f / (2_f * sum * radius_ / TableSize);
+        for (auto& w : table_) { w *= norm; }
+
+        return true;
+    }
+
+    //! Type of the filter
+    auto Type() const -> std::string { return type_; }
+
+    //! Radius of the filter in pixels
+    auto Radius() const -> Float { return radius_; }
+
+    //! Check if the filter is the box filter of the pixel size
+    auto IsBox() const -> bool { return table_.empty(); }
+
+    //! Weight of the 1D filter at the distance `d` (in pixels) from the center
+    auto Weight(Float d) const -> Float
+    {
+        const int i = (int)(Math::Abs(d) * (TableSize / radius_));
+        return i < TableSize ? table_[i] : 0_f;
+    }
+
+    /*!
+        \brief Compute the pixels and weights in the footprint of the filter.
+        Calls `func(pixelIndex, weight)` for each pixel of the image of `width` * `height` pixels
+        inside of the footprint of the filter centered at `rasterPos` ([0,1]^2).
+        The weights of the pixels outside of the image are folded back to the image
+        by mirroring at the borders, so that the footprint truncated by the borders
+        keeps the total weight and the pixels near the borders are not darkened.
+        Not applicable to the box filter.
+    */
+    template <typename Func>
+    auto Footprint(const Vec2& rasterPos, int width, int height, const Func& func) const -> void
+    {
+        FootprintXY(rasterPos, width, height, [&](int x, int y, Float w) -> void
+        {
+            func(y * width + x, w);
+        });
+    }
+
+    /*!
+        \brief Compute the bound of the pixels in the footprint of the filter.
+        Returns the pixels [x0, x1] * [y0, y1] touched by `Footprint`
+        (or the pixel containing `rasterPos` for the box filter).
+    */
+    auto FootprintBound(const Vec2& rasterPos, int width, int height, int& x0, int& y0, int& x1, int& y1) const -> void
+    {
+        if (IsBox())
+        {
+            x0 = x1 = Math::Clamp((int)(rasterPos.x * Float(width)), 0, width - 1);
+            y0 = y1 = Math::Clamp((int)(rasterPos.y * Float(height)), 0, height - 1);
+            return;
+        }
+        FoldedRange(rasterPos.x * Float(width), width, x0, x1);
+        FoldedRange(rasterPos.y * Float(height), height, y0, y1);
+    }
+
+    /*!
+        \brief Splat a contribution to a block of pixels.
+        Accumulates `rgb` weighted by the filter to the block of pixels [bx, bx + bw) * [by, by + bh)
+        of the image of `width` * `height` pixels, where `block` is the `bw` * `bh` pixel values of the block.
+        Returns false without modifying `block` if the footprint is not contained in the block.
+    */
+    auto SplatBlock(const Vec2& rasterPos, const Vec3& rgb, int width, int height, int bx, int by, int bw, int bh, Vec3* block) const -> bool
+    {
+        int x0, y0, x1, y1;
+        FootprintBound(rasterPos, width, height, x0, y0, x1, y1);
+        if (x0 < bx || y0 < by || x1 >= bx + bw || y1 >= by + bh)
+        {
+            return false;
+        }
+
+        if (IsBox())
+        {
+            block[(y0 - by) * bw + (x0 - bx)] += rgb;
+            return true;
+        }
+
+        FootprintXY(rasterPos, width, height, [&](int x, int y, Float w) -> void
+        {
+            block[(y - by) * bw + (x - bx)] += rgb * w;
+        });
+        return true;
+    }
+
+private:
+
+    // Calls `func(x, y, weight)` for each pixel in the footprint
+    template <typename Func>
+    auto FootprintXY(const Vec2& rasterPos, int width, int height, const Func& func) const -> void
+    {
+        // Weights of the rows and columns
+        const int MaxFootprint = 10;     // 2 * MaxRadius() + 2
+        Float wx[MaxFootprint];
+        Float wy[MaxFootprint];
+        int x0, x1, y0, y1;
+        FoldedWeights(rasterPos.x * Float(width), width, x0, x1, wx);
+        FoldedWeights(rasterPos.y * Float(height), height, y0, y1, wy);
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                const Float w = wx[x - x0] * wy[y - y0];
+                if (w != 0_f)
+                {
+                    func(x, y, w);
+                }
+            }
+        }
+    }
+
+    // Computes the range [begin, end] of the pixels around the position `p` (in pixels)
+    // in the image of `size` pixels after mirroring at the borders
+    auto FoldedRange(Float p, int size, int& begin, int& end) const -> void
+    {
+        const int b = (int)(std::ceil(p - 0.5_f - radius_));
+        const int e = (int)(std::floor(p - 0.5_f + radius_));
+        begin = Math::Max(0, Math::Min(b, 2 * size - 1 - e));
+        end = Math::Min(size - 1, Math::Max(e, -1 - b));
+    }
+
+    // Computes the 1D weights of the pixels in [begin, end] around the position `p` (in pixels)
+    // in the image of `size` pixels, where the weights outside of the image are mirrored at the borders
+    auto FoldedWeights(Float p, int size, int& begin, int& end, Float* w) const -> void
+    {
+        const int b = (int)(std::ceil(p - 0.5_f - radius_));
+        const int e = (int)(std::floor(p - 0.5_f + radius_));
+        FoldedRange(p, size, begin, end);
+        for (int i = begin; i <= end; i++) w[i - begin] = 0_f;
+        for (int i = b; i <= e; i++)
+        {
+            const int m = i < 0 ? -1 - i : i >= size ? 2 * size - 1 - i : i;
+            w[Math::Clamp(m, begin, end) - begin] += Weight(Float(i) + 0.5_f - p);
+        }
+    }
+
+private:
+
+    std::string type_ = "box";
+    Float radius_ = 0.5_f;
+    std::vector<Float> table_;
+
+};
+
+LM_NAMESPACE_END
@@ -40,12 +40,77 @@ public:
         Set number of threads utilized in the parallized functions by `Parallel::For`.
         If the given `numThreads` is not greater than zero, the number of threads is set to
         `(number of detected cores) - numThreads`.
+        Must not be called while the parallel loops are running.
     */
     LM_PUBLIC_API static auto SetNumThreads(int numThreads) -> void;
 
     ///! Get current number of threads
     LM_PUBLIC_API static auto GetNumThreads() -> int;
 
+    /*!
+        \brief Set worker process information.
+
+        Configures the process as one of `numWorkers` processes rendering the same image
+        (e.g., `lightmetrica render --worker-index`). The scheduler renders the share of the samples
+        assigned to the worker with independent random number streams,
+        and the partial results are combined afterwards (`lightmetrica merge`).
+    */
+    LM_PUBLIC_API static auto SetWorkerProcess(int workerIndex, int numWorkers) -> void;
+
+    ///! Get index of the worker process
+    LM_PUBLIC_API static auto GetWorkerIndex() -> int;
+
+    ///! Get number of the worker processes (1 if not running as a worker)
+    LM_PUBLIC_API static auto GetNumWorkers() -> int;
+
+    /*!
+        \brief Enable pinning of the threads to the CPUs.
+
+        If enabled, the worker threads of the parallel loops are pinned to the CPUs
+        according to their slots in the task arena. Disabled by default.
+    */
+    LM_PUBLIC_API static auto SetPinThreads(bool pinThreads) -> void;
+
+    ///! Check if the threads are pinned to the CPUs
+    LM_PUBLIC_API static auto GetPinThreads() -> bool;
+
+    /*!
+        \brief Enable NUMA-aware thread placement.
+
+        If enabled, the worker threads of the parallel loops are pinned to the CPUs
+        of the NUMA nodes in the round-robin manner, so that the per-thread data
+        allocated by the threads resides in the memory local to the node.
+        The components may replicate their read-only data per node (see `GetNumaNode`).
+        Disabled by default.
+    */
+    LM_PUBLIC_API static auto SetNumaAware(bool numaAware) -> void;
+
+    ///! Check if NUMA-aware thread placement is enabled
+    LM_PUBLIC_API static auto GetNumaAware() -> bool;
+
+    ///! Get number of detected NUMA nodes (1 if the topology is not available)
+    LM_PUBLIC_API static auto GetNumNumaNodes() -> int;
+
+    ///! Get index of NUMA node where the current thread is pinned (0 if the thread is not pinned)
+    LM_PUBLIC_API static auto GetNumaNode() -> int;
+
+    /*!
+        \brief Execute a function on a NUMA node.
+
+        Executes `func` in a thread pinned to the CPUs of the given NUMA node and waits for its completion.
+        The memory first touched by `func` is allocated on the node.
+    */
+    LM_PUBLIC_API static auto ExecuteOnNumaNode(int node, const std::function<void()>& func) -> void;
+
+    /*!
+        \brief Execute a function in the task arena.
+
+        All parallel loops share a process-wide task arena with the number of threads
+        set by `SetNumThreads`, so that the threads are not created on each loop.
+        The parallel algorithms of TBB called inside `func` are processed by the threads of the arena.
+    */
+    LM_PUBLIC_API static auto Execute(const std::function<void()>& func) -> void;
+
     /*!
         \brief Parallized for-loop.
         
@@ -53,13 +118,41 @@ public:
         The number of threads set by `SetNumThreads` function is used for this process.
         
         The `processFunc` function takes three parameters:
-        `index` for the current index of the loop, `threadid` for the 0-indexed thread index,
-        and `init` for specifying the initialization flag.
+        `index` for the current index of the loop, `threadid` for the 0-indexed thread index
+        in [0, `GetNumThreads()`), and `init` for specifying the initialization flag.
         The `init` flag turns `true` if the function is called
         only after the thread specified by `threadid` is initially created.     
     */
     LM_PUBLIC_API static auto For(long long numSamples, const std::function<void(long long index, int threadid, bool init)>& processFunc) -> void;
 
+    /*!
+        \brief Parallized for-loop processed in batches.
+
+        Same as `For` except that `processFunc` is called once per range of indices
+        [`begin`, `end`) assigned to the thread. The `init` flag is `true` only for
+        the first range processed by the thread.
+    */
+    LM_PUBLIC_API static auto ForBatch(long long numSamples, const std::function<void(long long begin, long long end, int threadid, bool init)>& processFunc) -> void;
+
+    /*!
+        \brief Parallized for-loop with an inlinable function.
+
+        Same as `For` but the loop over the indices is instantiated in the caller,
+        so that the compiler can inline `processFunc` into the loop.
+        This overload is selected when a lambda expression is directly passed.
+    */
+    template <typename ProcessFunc>
+    static auto For(long long numSamples, const ProcessFunc& processFunc) -> void
+    {
+        ForBatch(numSamples, [&processFunc](long long begin, long long end, int threadid, bool init) -> void
+        {
+            for (long long i = begin; i != end; i++)
+            {
+                processFunc(i, threadid, init && i == begin);
+            }
+        });
+    }
+
 };
 
 LM_NAMESPACE_END
@@ -0,0 +1,170 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#pragma once
+
+#include <lightmetrica/math.h>
+#include <string>
+#include <vector>
+#include <limits>
+
+LM_NAMESPACE_BEGIN
+
+/*!
+    \brief Tone mapping and gamma encoding to 8-bit images.
+
+    Maps the HDR pixel values to the 8-bit values in three stages:
+    scaling by `exposure`, the tone mapping operator (`none` for clamping, or `reinhard` for v / (1 + v)),
+    and the gamma encoding v^(1/gamma) quantized to [0, 255].
+    The gamma encoding is replaced by the table lookup instead of evaluating `pow` per pixel.
+    Since the encoded value is monotonic, the table of the thresholds of the linear values
+    for the 256 levels gives the exact results equivalent to floor(255 * v^(1/gamma)).
+    The search is started from the level precomputed for the bin of the uniformly quantized value
+    so that only a few comparisons are needed per channel.
+
+    \ingroup detail
+*/
+class ToneMapper
+{
+public:
+
+    static const int TableSize = 1024;
+
+public:
+
+    /*!
+        \brief Initialize the tables.
+        \retval false Unknown tone mapping operator.
+    */
+    auto Initialize(const std::string& type, Float exposure, Float gamma) -> bool
+    {
+        if (type == "none")
+        {
+            reinhard_ = false;
+        }
+        else if (type == "reinhard")
+        {
+            reinhard_ = true;
+        }
+        else
+        {
+            return false;
+        }
+
+        type_ = type;
+        exposure_ = exposure;
+        gamma_ = gamma;
+
+        // Smallest linear value encoded to the level `k`.
+        // The threshold is refined to the adjacent floating-point numbers
+        // so that it agrees with the direct evaluation.
+        thresholds_.resize(257);
+        thresholds_[0] = -std::numeric_limits<float>::max();
+        thresholds_[256] = std::numeric_limits<float>::max();
+        for (int k = 1; k < 256; k++)
+        {
+            auto t = (float)(std::pow((double)k / 255.0, (double)gamma));
+            while (EncodeDirect(t) < k) { t = std::nextafter(t, std::numeric_limits<float>::max()); }
+            while (EncodeDirect(std::nextafter(t, 0.0f)) >= k) { t = std::nextafter(t, 0.0f); }
+            thresholds_[k] = t;
+        }
+
+        // Initial level of the search for each bin
+        levels_.resize(TableSize + 1);
+        for (int i = 0; i <= TableSize; i++)
+        {
+            levels_[i] = (unsigned char)(EncodeDirect((float)i / TableSize));
+        }
+
+        return true;
+    }
+
+    //! Type of the tone mapping operator
+    auto Type() const -> std::string { return type_; }
+
+    /*!
+        \brief Encode a pixel value.
+        Writes the 8-bit RGB values of the HDR value `v` to `rgb`.
+    */
+    LM_INLINE auto Encode(const Vec3& v, unsigned char* rgb) const -> void
+    {
+        int bins[4];
+
+        #if LM_SINGLE_PRECISION && LM_SSE
+        // Tone mapping of the three channels at once
+        __m128 c = _mm_mul_ps(v.v_, _mm_set1_ps(exposure_));
+        if (reinhard_)
+        {
+            c = _mm_div_ps(c, _mm_add_ps(_mm_set1_ps(1.0f), c));
+        }
+
+        // Clamp to [0,1]. NaN is mapped to zero as `_mm_max_ps` returns the second operand.
+        c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bins), _mm_cvttps_epi32(_mm_mul_ps(c, _mm_set1_ps((float)TableSize))));
+        LM_ALIGN_16 float cs[4];
+        _mm_store_ps(cs, c);
+        #else
+        float cs[3];
+        for (int i = 0; i < 3; i++)
+        {
+            Float t = v[i] * exposure_;
+            if (reinhard_)
+            {
+                t = t / (1_f + t);
+            }
+            cs[i] = t > 0_f ? (float)(Math::Min(t, 1_f)) : 0.0f;
+            bins[i] = (int)(cs[i] * TableSize);
+        }
+        #endif
+
+        for (int i = 0; i < 3; i++)
+        {
+            int k = levels_[bins[i]];
+            while (cs[i] >= thresholds_[k + 1]) { k++; }
+            while (cs[i] < thresholds_[k]) { k--; }
+            rgb[i] = (unsigned char)(k);
+        }
+    }
+
+private:
+
+    // Direct evaluation of the gamma encoding
+    auto EncodeDirect(float v) const -> int
+    {
+        return Math::Clamp((int)(std::pow((double)v, 1.0 / (double)gamma_) * 255.0), 0, 255);
+    }
+
+private:
+
+    std::string type_ = "none";
+    bool reinhard_ = false;
+    Float exposure_ = 1_f;
+    Float gamma_ = 2.2_f;
+    std::vector<float> thresholds_;         // Smallest linear value of each level (+ sentinels)
+    std::vector<unsigned char> levels_;     // Initial level of the search for each bin
+
+};
+
+LM_NAMESPACE_END
@@ -26,6 +26,7 @@
 
 #include <lightmetrica/asset.h>
 #include <lightmetrica/spectrum.h>
+#include <iosfwd>
 
 LM_NAMESPACE_BEGIN
 
@@ -35,6 +36,26 @@ LM_NAMESPACE_BEGIN
     \ingroup asset
 */
 
+/*!
+    \brief Auxiliary layers of the film.
+
+    The layers recorded by `Film::SplatLayer` in addition to the rendered image
+    (e.g., for compositing or denoising).
+
+    \ingroup film
+*/
+namespace FilmLayer
+{
+    enum Type
+    {
+        Albedo,         //!< Reflectance of the BSDF at the first hit
+        Normal,         //!< Shading normal at the first hit
+        Depth,          //!< Distance to the first hit (stored in x)
+        PrimitiveID,    //!< Index of the primitive at the first hit plus one (stored in x, 0 if no hit)
+        NumLayers
+    };
+}
+
 /*!
     \brief Film.
 
@@ -47,7 +68,7 @@ class Film : public Asset
 {
 public:
 
-    LM_INTERFACE_CLASS(Film, Asset, 9);
+    LM_INTERFACE_CLASS(Film, Asset, 15);
 
 public:
 
@@ -117,6 +138,53 @@ public:
     ///! Computes pixel index from the raster position.
     LM_INTERFACE_F(8, PixelIndex, int(const Vec2& rasterPos));
 
+    /*!
+        \brief Check if the film supports concurrent splats.
+        If true, `Splat` can be called from multiple threads at the same time,
+        so that the threads can share the film without cloning it.
+        The function is optional; the film is not thread-safe if not implemented.
+    */
+    LM_INTERFACE_F(9, SupportsConcurrentSplat, bool());
+
+    /*!
+        \brief Serialize the film.
+        Writes the accumulated (not rescaled) pixel values to the stream in binary.
+        Used for checkpoints of the rendering. The function is optional.
+    */
+    LM_INTERFACE_F(10, Serialize, bool(std::ostream& stream));
+
+    /*!
+        \brief Deserialize the film.
+        Restores the pixel values written by `Serialize`.
+        Fails if the size of the film does not match.
+    */
+    LM_INTERFACE_F(11, Deserialize, bool(std::istream& stream));
+
+    /*!
+        \brief Accumulate the value to an auxiliary layer.
+        Records the value `v` of the layer (`FilmLayer::Type`) at the raster position.
+        The values are averaged over the samples recorded in each pixel and not affected by `Rescale`,
+        except for `FilmLayer::PrimitiveID` which overwrites the value.
+        The function is optional; the renderers skip the layers if not implemented.
+    */
+    LM_INTERFACE_F(12, SplatLayer, void(int layer, const Vec2& rasterPos, const Vec3& v));
+
+    /*!
+        \brief Accumulate the contribution to a block of pixels.
+        Same as `Splat` but accumulates the contribution to the caller-owned block
+        of the pixels [x, x + w) * [y, y + h), where `block` is the `w` * `h` RGB values of the block.
+        The film itself is not modified, so the function can be called from multiple threads.
+        Returns false without modifying `block` if the footprint of the filter is not contained in the block.
+        The function is optional; use with `AccumulateBlock`.
+    */
+    LM_INTERFACE_F(13, SplatBlock, bool(int x, int y, int w, int h, Vec3* block, const Vec2& rasterPos, const SPD& v));
+
+    /*!
+        \brief Accumulate the block of pixels to the film.
+        Adds the pixel values of the block recorded by `SplatBlock` to the film.
+    */
+    LM_INTERFACE_F(14, AccumulateBlock, void(int x, int y, int w, int h, const Vec3* block));
+
 };
 
 LM_NAMESPACE_END
@@ -77,20 +77,39 @@ public:
         int v3 = fs[3 * faceindex + 2];
 
         // Geometry normal
-        const auto* ps = mesh->Positions();
-        Vec3 p1(primitive->transform * Vec4(ps[3 * v1], ps[3 * v1 + 1], ps[3 * v1 + 2], 1_f));
-        Vec3 p2(primitive->transform * Vec4(ps[3 * v2], ps[3 * v2 + 1], ps[3 * v2 + 2], 1_f));
-        Vec3 p3(primitive->transform * Vec4(ps[3 * v3], ps[3 * v3 + 1], ps[3 * v3 + 2], 1_f));
-        isect.geom.gn = Math::Normalize(Math::Cross(p2 - p1, p3 - p1));
+        // Use the precomputed world-space face normal if available
+        if (primitive->worldFaceNormals)
+        {
+            const auto* gn = &primitive->worldFaceNormals[3 * faceindex];
+            isect.geom.gn = Vec3(gn[0], gn[1], gn[2]);
+        }
+        else
+        {
+            const auto* ps = mesh->Positions();
+            Vec3 p1(primitive->transform * Vec4(ps[3 * v1], ps[3 * v1 + 1], ps[3 * v1 + 2], 1_f));
+            Vec3 p2(primitive->transform * Vec4(ps[3 * v2], ps[3 * v2 + 1], ps[3 * v2 + 2], 1_f));
+            Vec3 p3(primitive->transform * Vec4(ps[3 * v3], ps[3 * v3 + 1], ps[3 * v3 + 2], 1_f));
+            isect.geom.gn = Math::Normalize(Math::Cross(p2 - p1, p3 - p1));
+        }
 
         // Shading normal
         Vec3 n1, n2, n3;
         const auto* ns = mesh->Normals();
         if (ns)
         {
-            n1 = primitive->normalTransform * Vec3(ns[3 * v1], ns[3 * v1 + 1], ns[3 * v1 + 2]);
-            n2 = primitive->normalTransform * Vec3(ns[3 * v2], ns[3 * v2 + 1], ns[3 * v2 + 2]);
-            n3 = primitive->normalTransform * Vec3(ns[3 * v3], ns[3 * v3 + 1], ns[3 * v3 + 2]);
+            if (primitive->worldNormals)
+            {
+                const auto* wns = primitive->worldNormals;
+                n1 = Vec3(wns[3 * v1], wns[3 * v1 + 1], wns[3 * v1 + 2]);
+                n2 = Vec3(wns[3 * v2], wns[3 * v2 + 1], wns[3 * v2 + 2]);
+                n3 = Vec3(wns[3 * v3], wns[3 * v3 + 1], wns[3 * v3 + 2]);
+            }
+            else
+            {
+                n1 = primitive->normalTransform * Vec3(ns[3 * v1], ns[3 * v1 + 1], ns[3 * v1 + 2]);
+                n2 = primitive->normalTransform * Vec3(ns[3 * v2], ns[3 * v2 + 1], ns[3 * v2 + 2]);
+                n3 = primitive->normalTransform * Vec3(ns[3 * v3], ns[3 * v3 + 1], ns[3 * v3 + 2]);
+            }
             isect.geom.sn = Math::Normalize(n1 * (1_f - b[0] - b[1]) + n2 * b[0] + n3 * b[1]);
             if (std::isnan(isect.geom.sn.x) || std::isnan(isect.geom.sn.y) || std::isnan(isect.geom.sn.z))
             {
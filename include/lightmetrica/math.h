@@ -1545,7 +1545,7 @@ namespace Math
     }
     #endif
 
-    #if LM_AVX
+    #if LM_SSE
     template <>
     LM_INLINE auto Length<float, SIMD::SSE, TVec4>(const TVec4<float, SIMD::SSE>& v) -> float
     {
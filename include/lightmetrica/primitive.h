@@ -69,6 +69,14 @@ struct Primitive : public SIMDAlignedType
     // Triangle mesh
     const TriangleMesh* mesh = nullptr;
 
+    // World-space geometry of the triangle mesh (optional).
+    // Precomputed by the scene so that the hit points can be constructed
+    // only by the interpolation without transforming the vertices.
+    // nullptr if not available (e.g., the mesh shared by multiple primitives).
+    const Float* worldPositions = nullptr;      // 3 elements per vertex
+    const Float* worldNormals = nullptr;        // 3 elements per vertex (not normalized), nullptr if the mesh has no normals
+    const Float* worldFaceNormals = nullptr;    // 3 elements per face (normalized)
+
     // Surface interactions
     const BSDF* bsdf       = nullptr;
     const Emitter* emitter = nullptr;
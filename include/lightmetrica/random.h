@@ -66,6 +66,21 @@ public:
     //! Generate an uniform random number in [0,1].
     auto Next() -> Float { return Float(LM_EXPORTED_F(Random_Next, this)); }
 
+    /*!
+        \brief Derive a seed from a seed and an index.
+        Counter-based hash (SplitMix64 finalizer) used to seed independent streams,
+        e.g., per block of samples or per tile, independent of the thread processing it.
+    */
+    static auto DeriveSeed(unsigned int seed, long long index) -> unsigned int
+    {
+        auto z = ((unsigned long long)seed << 32) ^ (unsigned long long)index;
+        z += 0x9e3779b97f4a7c15ULL;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z = z ^ (z >> 31);
+        return (unsigned int)(z ^ (z >> 32));
+    }
+
     //! Generate uniform random numbers in [0,1]^2.
     LM_INLINE auto Next2D() -> Vec2
     {
@@ -30,6 +30,10 @@
 
 LM_NAMESPACE_BEGIN
 
+class Film;
+struct Ray;
+struct Intersection;
+
 /*!
     \brief Utility functions for rendering.
     \ingroup core.
@@ -55,6 +59,15 @@ public:
         return t / p1p2L2;
     }
 
+    /*!
+        \brief Record the auxiliary layers of the film.
+        Records the albedo, normal, depth, and primitive ID at the first intersection `isect`
+        of the ray `ray` from the sensor (see `Film::SplatLayer`).
+        `isect` is nullptr if the ray escapes the scene, in which case zeros are recorded.
+        Does nothing if the film does not support the layers.
+    */
+    LM_PUBLIC_API static auto SplatLayers(Film* film, const Vec2& rasterPos, const Ray& ray, const Intersection* isect) -> void;
+
 };
 
 LM_NAMESPACE_END
@@ -53,7 +53,7 @@ class Scene : public Component
 {
 public:
 
-    LM_INTERFACE_CLASS(Scene, Component, 11);
+    LM_INTERFACE_CLASS(Scene, Component, 15);
 
 public:
 
@@ -116,6 +116,60 @@ public:
     LM_INTERFACE_F(9,  GetBound, Bound());
     LM_INTERFACE_F(10, GetSphereBound, SphereBound());
 
+    /*!
+        \brief Intersection query with a packet of rays.
+
+        Traces `n` coherent rays at once.
+        If the acceleration structure does not support packet traversal,
+        the rays are traced one by one.
+
+        \param rays   Array of `n` rays.
+        \param n      Number of rays (at most 32).
+        \param isects Array of `n` intersection data.
+        \return Bit mask of the rays intersected with the scene (i-th bit for `rays[i]`).
+    */
+    LM_INTERFACE_F(11, IntersectPacket, unsigned int(const Ray* rays, int n, Intersection* isects));
+
+    /*!
+        \brief Occlusion query.
+
+        The function checks if `ray` is occluded by the geometries
+        in the range of the distance between `minT` and `maxT`.
+        The query is cheaper than `IntersectWithRange`
+        because the traversal terminates with the first hit found.
+
+        \param ray  Ray.
+        \param minT Minimum range of the distance.
+        \param maxT Maximum range of the distance.
+        \retval true  Occluded.
+        \retval false Not occluded.
+    */
+    LM_INTERFACE_F(12, Occluded, bool(const Ray& ray, Float minT, Float maxT));
+
+    /*!
+        \brief Update the transform of a primitive.
+
+        The transform and the normal transform of the primitive are updated in place.
+        The changes are not reflected to the intersection queries until `Refit` is called,
+        so that the transforms of multiple primitives can be updated at once.
+
+        \param index     Index of the primitive.
+        \param transform New transform.
+    */
+    LM_INTERFACE_F(13, SetPrimitiveTransform, void(int index, const Mat4& transform));
+
+    /*!
+        \brief Update the scene after the transforms are changed.
+
+        Refits the acceleration structure and recomputes the scene bound.
+        If the acceleration structure does not support the refit,
+        it is rebuilt from scratch.
+
+        \retval true  Succeeded to update.
+        \retval false Failed to update.
+    */
+    LM_INTERFACE_F(14, Refit, bool());
+
 public:
 
     auto Visible(const Vec3& p1, const Vec3& p2) const -> bool
@@ -125,8 +179,7 @@ public:
         const auto p1p2L = Math::Length(p1p2);
         shadowRay.d = p1p2 / p1p2L;
         shadowRay.o = p1;
-        Intersection _;
-        return !IntersectWithRange(shadowRay, _, Math::EpsIsect(), p1p2L * (1_f - Math::EpsIsect()));
+        return !Occluded(shadowRay, Math::EpsIsect(), p1p2L * (1_f - Math::EpsIsect()));
     }
 
 };
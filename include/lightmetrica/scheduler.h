@@ -25,6 +25,7 @@
 #pragma once
 
 #include <lightmetrica/component.h>
+#include <lightmetrica/math.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -44,7 +45,7 @@ class Scheduler : public Component
 {
 public:
 
-    LM_INTERFACE_CLASS(Scheduler, Component, 3);
+    LM_INTERFACE_CLASS(Scheduler, Component, 5);
 
 public:
 
@@ -57,6 +58,58 @@ public:
     LM_INTERFACE_F(1, Process, long long(const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*)>& processSampleFunc));
     LM_INTERFACE_F(2, GetNumSamples, long long());
 
+    /*!
+        \brief Process samples in the image space.
+
+        Unlike `Process`, the scheduler determines the raster position of each sample
+        and passes it to `processSampleFunc` (in [0,1]^2).
+        This is utilized by the renderers which start the paths from the sensor (e.g., PT)
+        so that the scheduler can process the screen by tiles.
+        The contributions must be splatted to the raster position given to the function
+        for the efficient processing, although the other positions are also allowed.
+        The function is optional; callers must check `ProcessRaster.Implemented()`
+        and fall back to `Process` otherwise.
+    */
+    LM_INTERFACE_F(3, ProcessRaster, long long(const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, const Vec2& rasterPos)>& processSampleFunc));
+
+    /*!
+        \brief Process samples in batches.
+
+        Same as `Process` except that `processBatchFunc` is responsible for
+        processing `numSamples` samples with the given film and RNG.
+        The function is called once per batch instead of once per sample,
+        which avoids the indirect call per sample. Use `ProcessKernel` instead of calling it directly.
+        The function is optional; callers must check `ProcessBatch.Implemented()`.
+    */
+    LM_INTERFACE_F(4, ProcessBatch, long long(const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, long long numSamples)>& processBatchFunc));
+
+public:
+
+    /*!
+        \brief Process samples with an inlinable kernel.
+
+        Processes the samples with `processSampleFunc` of the signature `void(Film*, Random*)`
+        as `Process` does. The sample loop is instantiated in the caller
+        so that the compiler can inline the function into the loop.
+        Falls back to `Process` if the scheduler does not implement `ProcessBatch`.
+    */
+    template <typename ProcessSampleFunc>
+    auto ProcessKernel(const Scene* scene, Film* film, Random* initRng, const ProcessSampleFunc& processSampleFunc) -> long long
+    {
+        if (!ProcessBatch.Implemented())
+        {
+            return Process(scene, film, initRng, processSampleFunc);
+        }
+
+        return ProcessBatch(scene, film, initRng, [&processSampleFunc](Film* film, Random* rng, long long numSamples) -> void
+        {
+            for (long long i = 0; i < numSamples; i++)
+            {
+                processSampleFunc(film, rng);
+            }
+        });
+    }
+
 };
 
 LM_NAMESPACE_END
@@ -88,6 +88,8 @@ public:
     LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
     {
         // Create scene
+        if (RtcScene) rtcDeleteScene(RtcScene);
+        RtcGeomIDToPrimitiveIndexMap.clear();
         RtcScene = rtcDeviceNewScene(device, RTC_SCENE_STATIC | RTC_SCENE_INCOHERENT, RTC_INTERSECT1);
 
         // Add meshes to the scene
@@ -187,6 +189,37 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        if (minT > maxT)
+        {
+            return false;
+        }
+
+        // Create RTCRay
+        RTCRay rtcRay;
+        rtcRay.org[0] = (float)(ray.o[0]);
+        rtcRay.org[1] = (float)(ray.o[1]);
+        rtcRay.org[2] = (float)(ray.o[2]);
+        rtcRay.dir[0] = (float)(ray.d[0]);
+        rtcRay.dir[1] = (float)(ray.d[1]);
+        rtcRay.dir[2] = (float)(ray.d[2]);
+        rtcRay.tnear  = (float)(minT);
+        rtcRay.tfar   = (float)(maxT);
+        rtcRay.geomID = RTC_INVALID_GEOMETRY_ID;
+        rtcRay.primID = RTC_INVALID_GEOMETRY_ID;
+        rtcRay.instID = RTC_INVALID_GEOMETRY_ID;
+        rtcRay.mask = 0xFFFFFFFF;
+        rtcRay.time = 0;
+
+        // Occlusion query
+        // geomID is set to 0 if any hit is found
+        FPUtils::DisableFPControl();     // TODO: push
+        rtcOccluded(RtcScene, rtcRay);
+        FPUtils::EnableFPControl();      // TODO: pop
+        return (unsigned int)(rtcRay.geomID) != RTC_INVALID_GEOMETRY_ID;
+    };
+
 private:
 
     RTCDevice device = nullptr;
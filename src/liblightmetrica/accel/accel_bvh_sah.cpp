@@ -30,13 +30,20 @@
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/bound.h>
 #include <lightmetrica/intersectionutils.h>
+#include <lightmetrica/align.h>
+#include <lightmetrica/bvhbuildutils.h>
 
 LM_NAMESPACE_BEGIN
 
-struct BVHNode
+/*
+    Node of BVH.
+    The nodes are stored in a flat array aligned to the cache lines,
+    where two children of a node are placed next to each other.
+*/
+struct LM_ALIGN(64) BVHNode
 {
-    bool isleaf;
     Bound bound;
+    bool isleaf;
 
     union
     {
@@ -69,12 +76,14 @@ public:
 
     LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
     {
+        const auto buildStartTime = std::chrono::high_resolution_clock::now();
         std::vector<Bound> bounds_;
 
         // --------------------------------------------------------------------------------
 
         #pragma region Create triaccels
 
+        triangles_.clear();
         int np = scene->NumPrimitives();
         for (int i = 0; i < np; i++)
         {
@@ -116,18 +125,16 @@ public:
 
         #pragma region Build BVH
 
-        const std::function<int(int, int)> Build_ = [&](int begin, int end) -> int
+        // Nodes are allocated concurrently by the build tasks
+        tbb::concurrent_vector<BVHNode> buildNodes;
+
+        const std::function<void(int, int, int)> Build_ = [&](int idx, int begin, int end) -> void
         {
-            int idx = (int)(nodes_.size());
-            nodes_.emplace_back(new BVHNode);
-            auto* node = nodes_[idx].get();
+            auto* node = &buildNodes[idx];
 
             // Current bound
-            node->bound = Bound();
-            for (int i = begin; i < end; i++)
-            {
-                node->bound = Math::Union(node->bound, bounds_[indices_[i]]);
-            }
+            Bound centroidBound;
+            BVHBuildUtils::ComputeBound(bounds_, indices_, begin, end, node->bound, centroidBound);
 
             // Leaf node
             const int LeafNumNodes = 10;
@@ -136,7 +143,7 @@ public:
                 node->isleaf = true;
                 node->leaf.begin = begin;
                 node->leaf.end = end;
-                return idx;
+                return;
             }
 
             // Determine split index
@@ -146,39 +153,68 @@ public:
             int axis = node->bound.LongestAxis();
 
             // Sort along the longest axis
-            std::sort(indices_.begin() + begin, indices_.begin() + end, [&](int v1, int v2) -> bool
+            const auto Compare = [&](int v1, int v2) -> bool
             {
                 return bounds_[v1].Centroid()[axis] < bounds_[v2].Centroid()[axis];
-            });
+            };
+            if (end - begin < BVHBuildUtils::ParallelBinningThreshold)
+            {
+                std::sort(indices_.begin() + begin, indices_.begin() + end, Compare);
+            }
+            else
+            {
+                tbb::parallel_sort(indices_.begin() + begin, indices_.begin() + end, Compare);
+            }
 
-            // Compute local SAH costs
+            // Object split index of the split candidates
             const int NumSplitCandidates = std::min(100, end - begin - 2);
-            std::vector<Float> costs(NumSplitCandidates);
-            for (int split = 0; split < NumSplitCandidates; split++)
+            const auto ObjSplitIndex = [&](int split) -> int
             {
-                // Object split index
-                const int objSplitIndex = begin + 1 + split * (end - begin - 2) / NumSplitCandidates;
+                return begin + 1 + split * (end - begin - 2) / NumSplitCandidates;
+            };
 
-                // Compute bounds of split parts
-                Bound bound1;
-                Bound bound2;
-                for (int i = begin; i < end; i++)
+            // Compute bounds of split parts with the sweeps from the both ends
+            std::vector<Bound> bounds1(NumSplitCandidates);
+            std::vector<Bound> bounds2(NumSplitCandidates);
+            {
+                Bound b;
+                int i = begin;
+                for (int split = 0; split < NumSplitCandidates; split++)
                 {
-                    const auto b = bounds_[indices_[i]];
-                    if (i < objSplitIndex) bound1 = Math::Union(bound1, b);
-                    else bound2 = Math::Union(bound2, b);
+                    for (; i < ObjSplitIndex(split); i++)
+                    {
+                        b = Math::Union(b, bounds_[indices_[i]]);
+                    }
+                    bounds1[split] = b;
                 }
+            }
+            {
+                Bound b;
+                int i = end - 1;
+                for (int split = NumSplitCandidates - 1; split >= 0; split--)
+                {
+                    for (; i >= ObjSplitIndex(split); i--)
+                    {
+                        b = Math::Union(b, bounds_[indices_[i]]);
+                    }
+                    bounds2[split] = b;
+                }
+            }
 
-                // Compute local SAH cost
+            // Compute local SAH costs
+            std::vector<Float> costs(NumSplitCandidates);
+            for (int split = 0; split < NumSplitCandidates; split++)
+            {
                 const Float Cb = 0.125_f;
+                const int objSplitIndex = ObjSplitIndex(split);
                 const int n1 = objSplitIndex - begin;
                 const int n2 = end - objSplitIndex;
-                costs[split] = Cb + (bound1.SurfaceArea() * n1 + bound2.SurfaceArea() * n2) / node->bound.SurfaceArea();
+                costs[split] = Cb + (bounds1[split].SurfaceArea() * n1 + bounds2[split].SurfaceArea() * n2) / node->bound.SurfaceArea();
             }
 
             // Select split position with minimum local cost
             const int split = (int)(std::distance(costs.begin(), std::min_element(costs.begin(), costs.end())));
-            mid = begin + 1 + split * (end - begin - 2) / NumSplitCandidates;
+            mid = ObjSplitIndex(split);
 
             // If minimum cost is beyond the cost with leaf node (i.e. end - begin) create a leaf node
             if (costs[split] > (Float)(end - begin))
@@ -186,25 +222,82 @@ public:
                 node->isleaf = true;
                 node->leaf.begin = begin;
                 node->leaf.end = end;
-                return idx;
+                return;
             }
 
-            // Intermediate node
+            // Intermediate node, whose children are allocated next to each other
+            const int child1 = (int)(std::distance(buildNodes.begin(), buildNodes.grow_by(2)));
+            const int child2 = child1 + 1;
             node->isleaf = false;
-            node->internal.child1 = Build_(begin, mid);
-            node->internal.child2 = Build_(mid, end);
-            return idx;
+            node->internal.child1 = child1;
+            node->internal.child2 = child2;
+            BVHBuildUtils::ProcessChildren(end - begin,
+                [&]() { Build_(child1, begin, mid); },
+                [&]() { Build_(child2, mid, end); });
         };
 
-        nodes_.clear();
+        buildNodes.grow_by(1);
         indices_.assign(triangles_.size(), 0);
         std::iota(indices_.begin(), indices_.end(), 0);
-        Build_(0, (int)(triangles_.size()));
+        Build_(0, 0, (int)(triangles_.size()));
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Relayout nodes
+
+        // Copy the nodes into the flat array in depth-first order
+        BVHBuildUtils::BuildStats stats;
+        const std::function<void(int, int)> Relayout_ = [&](int idx, int depth) -> void
+        {
+            stats.numNodes++;
+            if (nodes_[idx].isleaf)
+            {
+                stats.numLeaves++;
+                stats.maxDepth = std::max(stats.maxDepth, depth);
+                stats.numLeafTriangles += nodes_[idx].leaf.end - nodes_[idx].leaf.begin;
+                return;
+            }
+
+            const int child1 = (int)(nodes_.size());
+            nodes_.push_back(buildNodes[nodes_[idx].internal.child1]);
+            nodes_.push_back(buildNodes[nodes_[idx].internal.child2]);
+            nodes_[idx].internal.child1 = child1;
+            nodes_[idx].internal.child2 = child1 + 1;
+            Relayout_(child1, depth + 1);
+            Relayout_(child1 + 1, depth + 1);
+        };
+
+        nodes_.clear();
+        nodes_.reserve(buildNodes.size());
+        nodes_.push_back(buildNodes[0]);
+        Relayout_(0, 0);
+        maxDepth_ = stats.maxDepth;
 
         #pragma endregion
 
         // --------------------------------------------------------------------------------
 
+        const auto buildEndTime = std::chrono::high_resolution_clock::now();
+        BVHBuildUtils::PrintStats(stats, (double)(std::chrono::duration_cast<std::chrono::milliseconds>(buildEndTime - buildStartTime).count()) / 1000.0);
+
+        return true;
+    };
+
+    LM_IMPL_F(Refit) = [this](const Scene* scene) -> bool
+    {
+        std::vector<Bound> bounds;
+        BVHBuildUtils::RefitTriangles(scene, triangles_, bounds);
+        BVHBuildUtils::RefitNodes(nodes_, [&](const BVHNode& node) -> Bound
+        {
+            Bound bound;
+            for (int i = node.leaf.begin; i < node.leaf.end; i++)
+            {
+                bound = Math::Union(bound, bounds[indices_[i]]);
+            }
+            return bound;
+        });
         return true;
     };
 
@@ -213,21 +306,28 @@ public:
         int minIndex;
         Vec2 minB;
 
-        const std::function<bool(int)> Intersect_ = [&](int idx) -> bool
+        // Stack for traversal, which needs (max depth + 1) entries at most
+        BVHBuildUtils::TraversalStack<256> stack(maxDepth_ + 1);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        bool hit = false;
+        while (stackIndex >= 0)
         {
-            const auto* node = nodes_.at(idx).get();
+            const auto& node = nodes_[stack[stackIndex--]];
 
             // Check intersection with bound
-            if (!node->bound.Intersect(ray, minT, maxT))
+            if (!node.bound.Intersect(ray, minT, maxT))
             {
-                return false;
+                continue;
             }
 
             // Check intersection with objects in the leaf
-            if (node->isleaf)
+            if (node.isleaf)
             {
-                bool hit = false;
-                for (int i = node->leaf.begin; i < node->leaf.end; i++)
+                for (int i = node.leaf.begin; i < node.leaf.end; i++)
                 {
                     Float t;
                     Vec2 b;
@@ -239,17 +339,15 @@ public:
                         minB = b;
                     }
                 }
-                return hit;
+                continue;
             }
 
             // Check intersection with child nodes
-            bool hit = false;
-            hit |= Intersect_(node->internal.child1);
-            hit |= Intersect_(node->internal.child2);
-            return hit;
-        };
+            stack[++stackIndex] = node.internal.child2;
+            stack[++stackIndex] = node.internal.child1;
+        }
 
-        if (!Intersect_(0))
+        if (!hit)
         {
             return false;
         }
@@ -263,10 +361,54 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        // Stack for traversal, which needs (max depth + 1) entries at most
+        BVHBuildUtils::TraversalStack<256> stack(maxDepth_ + 1);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        while (stackIndex >= 0)
+        {
+            const auto& node = nodes_[stack[stackIndex--]];
+
+            // Check intersection with bound
+            if (!node.bound.Intersect(ray, minT, maxT))
+            {
+                continue;
+            }
+
+            // Check intersection with objects in the leaf.
+            // Any hit in the range is enough, so terminate immediately.
+            if (node.isleaf)
+            {
+                for (int i = node.leaf.begin; i < node.leaf.end; i++)
+                {
+                    Float t;
+                    Vec2 b;
+                    if (triangles_[indices_[i]].Intersect(ray, minT, maxT, b[0], b[1], t))
+                    {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            // Check intersection with child nodes
+            stack[++stackIndex] = node.internal.child2;
+            stack[++stackIndex] = node.internal.child1;
+        }
+
+        return false;
+    };
+
 private:
 
     std::vector<TriAccelTriangle> triangles_;
-    std::vector<std::unique_ptr<BVHNode>> nodes_;
+    std::vector<BVHNode, aligned_allocator<BVHNode, 64>> nodes_;
+    int maxDepth_ = 0;                  // Maximum depth of the tree, which bounds the traversal stack
     std::vector<int> indices_;                      // Triangle indices
 
 };
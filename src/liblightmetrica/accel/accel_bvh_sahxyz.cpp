@@ -30,13 +30,20 @@
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/bound.h>
 #include <lightmetrica/intersectionutils.h>
+#include <lightmetrica/align.h>
+#include <lightmetrica/bvhbuildutils.h>
 
 LM_NAMESPACE_BEGIN
 
-struct BVHNode
+/*
+    Node of BVH.
+    The nodes are stored in a flat array aligned to the cache lines,
+    where two children of a node are placed next to each other.
+*/
+struct LM_ALIGN(64) BVHNode
 {
-    bool isleaf;
     Bound bound;
+    bool isleaf;
 
     union
     {
@@ -75,6 +82,7 @@ public:
 
         #pragma region Create triaccels
 
+        triangles_.clear();
         int np = scene->NumPrimitives();
         for (int i = 0; i < np; i++)
         {
@@ -116,11 +124,9 @@ public:
 
         #pragma region Build BVH
 
-        const std::function<int(int, int)> Build_ = [&](int begin, int end) -> int
+        const std::function<void(int, int, int)> Build_ = [&](int idx, int begin, int end) -> void
         {
-            int idx = (int)(nodes_.size());
-            nodes_.emplace_back(new BVHNode);
-            auto* node = nodes_[idx].get();
+            auto* node = &nodes_[idx];
 
             // Current bound
             node->bound = Bound();
@@ -136,7 +142,7 @@ public:
                 node->isleaf = true;
                 node->leaf.begin = begin;
                 node->leaf.end = end;
-                return idx;
+                return;
             }
 
             // Determine split index
@@ -202,17 +208,24 @@ public:
                 mid = begin + split + 1;
             }
 
-            // Intermediate node
+            // Intermediate node, whose children are allocated next to each other
+            const int child1 = (int)(nodes_.size());
+            const int child2 = child1 + 1;
             node->isleaf = false;
-            node->internal.child1 = Build_(begin, mid);
-            node->internal.child2 = Build_(mid, end);
-            return idx;
+            node->internal.child1 = child1;
+            node->internal.child2 = child2;
+            nodes_.emplace_back();
+            nodes_.emplace_back();
+            Build_(child1, begin, mid);
+            Build_(child2, mid, end);
         };
 
         nodes_.clear();
+        nodes_.emplace_back();
         indices_.assign(triangles_.size(), 0);
         std::iota(indices_.begin(), indices_.end(), 0);
-        Build_(0, (int)(triangles_.size()));
+        Build_(0, 0, (int)(triangles_.size()));
+        maxDepth_ = BVHBuildUtils::MaxDepth(nodes_);
 
         #pragma endregion
 
@@ -221,26 +234,49 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Refit) = [this](const Scene* scene) -> bool
+    {
+        std::vector<Bound> bounds;
+        BVHBuildUtils::RefitTriangles(scene, triangles_, bounds);
+        BVHBuildUtils::RefitNodes(nodes_, [&](const BVHNode& node) -> Bound
+        {
+            Bound bound;
+            for (int i = node.leaf.begin; i < node.leaf.end; i++)
+            {
+                bound = Math::Union(bound, bounds[indices_[i]]);
+            }
+            return bound;
+        });
+        return true;
+    };
+
     LM_IMPL_F(Intersect) = [this](const Scene* scene, const Ray& ray, Intersection& isect, Float minT, Float maxT) -> bool
     {
         int minIndex;
         Vec2 minB;
 
-        const std::function<bool(int)> Intersect_ = [&](int idx) -> bool
+        // Stack for traversal, which needs (max depth + 1) entries at most
+        BVHBuildUtils::TraversalStack<256> stack(maxDepth_ + 1);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        bool hit = false;
+        while (stackIndex >= 0)
         {
-            const auto* node = nodes_.at(idx).get();
+            const auto& node = nodes_[stack[stackIndex--]];
 
             // Check intersection with bound
-            if (!node->bound.Intersect(ray, minT, maxT))
+            if (!node.bound.Intersect(ray, minT, maxT))
             {
-                return false;
+                continue;
             }
 
             // Check intersection with objects in the leaf
-            if (node->isleaf)
+            if (node.isleaf)
             {
-                bool hit = false;
-                for (int i = node->leaf.begin; i < node->leaf.end; i++)
+                for (int i = node.leaf.begin; i < node.leaf.end; i++)
                 {
                     Float t;
                     Vec2 b;
@@ -252,17 +288,15 @@ public:
                         minB = b;
                     }
                 }
-                return hit;
+                continue;
             }
 
             // Check intersection with child nodes
-            bool hit = false;
-            hit |= Intersect_(node->internal.child1);
-            hit |= Intersect_(node->internal.child2);
-            return hit;
-        };
+            stack[++stackIndex] = node.internal.child2;
+            stack[++stackIndex] = node.internal.child1;
+        }
 
-        if (!Intersect_(0))
+        if (!hit)
         {
             return false;
         }
@@ -276,10 +310,54 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        // Stack for traversal, which needs (max depth + 1) entries at most
+        BVHBuildUtils::TraversalStack<256> stack(maxDepth_ + 1);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        while (stackIndex >= 0)
+        {
+            const auto& node = nodes_[stack[stackIndex--]];
+
+            // Check intersection with bound
+            if (!node.bound.Intersect(ray, minT, maxT))
+            {
+                continue;
+            }
+
+            // Check intersection with objects in the leaf.
+            // Any hit in the range is enough, so terminate immediately.
+            if (node.isleaf)
+            {
+                for (int i = node.leaf.begin; i < node.leaf.end; i++)
+                {
+                    Float t;
+                    Vec2 b;
+                    if (triangles_[indices_[i]].Intersect(ray, minT, maxT, b[0], b[1], t))
+                    {
+                        return true;
+                    }
+                }
+                continue;
+            }
+
+            // Check intersection with child nodes
+            stack[++stackIndex] = node.internal.child2;
+            stack[++stackIndex] = node.internal.child1;
+        }
+
+        return false;
+    };
+
 private:
 
     std::vector<TriAccelTriangle> triangles_;
-    std::vector<std::unique_ptr<BVHNode>> nodes_;
+    std::vector<BVHNode, aligned_allocator<BVHNode, 64>> nodes_;
+    int maxDepth_ = 0;                  // Maximum depth of the tree, which bounds the traversal stack
     std::vector<int> indices_;                      // Triangle indices
 
 };
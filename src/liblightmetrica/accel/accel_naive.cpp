@@ -58,6 +58,7 @@ public:
 
     LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
     {
+        triangles_.clear();
         int np = scene->NumPrimitives();
         for (int i = 0; i < np; i++)
         {
@@ -121,6 +122,21 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        for (size_t i = 0; i < triangles_.size(); i++)
+        {
+            Float t;
+            Vec2 b;
+            if (triangles_[i].Intersect(ray, minT, maxT, b[0], b[1], t))
+            {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
 private:
 
     std::vector<TriAccelTriangle> triangles_;
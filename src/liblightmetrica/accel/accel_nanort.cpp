@@ -82,6 +82,10 @@ public:
     LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
     {
         // Convert a set of primitives to one large mesh
+        ps_.clear();
+        fs_.clear();
+        faceIDToPrimitive_.clear();
+        fsCDF_.clear();
         fsCDF_.push_back(0);
         for (int i = 0; i < scene->NumPrimitives(); i++)
         {
@@ -166,6 +170,25 @@ public:
         return true;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        // nanort does not provide any-hit traversal,
+        // so we use the closest hit traversal without computing the hit point information.
+        nanort::Ray rayRT;
+        rayRT.org[0] = (float)(ray.o[0]);
+        rayRT.org[1] = (float)(ray.o[1]);
+        rayRT.org[2] = (float)(ray.o[2]);
+        rayRT.dir[0] = (float)(ray.d[0]);
+        rayRT.dir[1] = (float)(ray.d[1]);
+        rayRT.dir[2] = (float)(ray.d[2]);
+
+        nanort::Intersection isectRT;
+        isectRT.t = (float)(maxT);
+
+        nanort::BVHTraceOptions traceOptions;
+        return accel_.Traverse(isectRT, ps_.data(), fs_.data(), rayRT, traceOptions);
+    };
+
 private:
 
     nanort::BVHAccel accel_;
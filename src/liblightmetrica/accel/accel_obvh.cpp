@@ -0,0 +1,614 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#include <pch.h>
+#include <lightmetrica/accel.h>
+#include <lightmetrica/scene.h>
+#include <lightmetrica/trianglemesh.h>
+#include <lightmetrica/triaccel.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/bound.h>
+#include <lightmetrica/intersectionutils.h>
+#include <lightmetrica/align.h>
+#include <lightmetrica/bvhbuildutils.h>
+#include <lightmetrica/detail/parallel.h>
+
+// OBVH requires AVX instructions.
+// Unlike QBVH, the node bounds are always stored in single precision
+// so that the accel is also available with double precision configuration.
+#if LM_AVX || defined(__AVX__)
+
+#include <immintrin.h>
+
+LM_NAMESPACE_BEGIN
+
+struct Ray8
+{
+    __m256 ox, oy, oz;
+    __m256 invd[3];
+    int dirSign[3];
+
+    Ray8(const Ray& ray)
+    {
+        ox = _mm256_set1_ps((float)(ray.o.x));
+        oy = _mm256_set1_ps((float)(ray.o.y));
+        oz = _mm256_set1_ps((float)(ray.o.z));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float d = (float)(ray.d[axis]);
+            invd[axis] = _mm256_set1_ps(d == 0.0f ? std::numeric_limits<float>::max() : 1.0f / d);
+            dirSign[axis] = d < 0.0f;
+        }
+    }
+};
+
+/*
+    Node of OBVH (8-ary BVH).
+    The nodes are stored in a flat array aligned to the cache lines.
+*/
+struct LM_ALIGN(64) OBVHNode
+{
+    // Constant which indicates a empty leaf node
+    static const int EmptyLeafNode = 0xffffffff;
+
+    // Bounds for 8 nodes in SOA format
+    __m256 bounds[2][3];
+
+    /*
+        Child nodes
+        If the node is a leaf, the reference to the primitive is encoded to
+            [31:31] : 1
+            [30:27] : # of triangles in the leaf
+            [26: 0] : An index of the first triangle
+        If the node is a intermediate node,
+            [31:31] : 0
+            [30: 0] : An index of the child node
+    */
+    int children[8];
+
+public:
+
+    OBVHNode()
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            bounds[0][i] = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+            bounds[1][i] = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            children[i] = EmptyLeafNode;
+        }
+    }
+
+    auto SetBound(int childIndex, const Bound& bound) -> void
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // Round the bounds outward for double precision
+            float min = (float)(bound.min[axis]);
+            float max = (float)(bound.max[axis]);
+            if ((Float)(min) > bound.min[axis]) min = std::nextafter(min, -std::numeric_limits<float>::infinity());
+            if ((Float)(max) < bound.max[axis]) max = std::nextafter(max, std::numeric_limits<float>::infinity());
+            reinterpret_cast<float*>(&(bounds[0][axis]))[childIndex] = min;
+            reinterpret_cast<float*>(&(bounds[1][axis]))[childIndex] = max;
+        }
+    }
+
+    auto CreateLeaf(int childIndex, unsigned int size, unsigned int offset) -> void
+    {
+        if (size == 0)
+        {
+            children[childIndex] = EmptyLeafNode;
+        }
+        else
+        {
+            children[childIndex] = 0x80000000;
+            children[childIndex] |= ((static_cast<int>(size) - 1) & 0xf) << 27;
+            children[childIndex] |= static_cast<int>(offset) & 0x07ffffff;
+        }
+    }
+
+    auto CreateIntermediateNode(int childIndex, unsigned int index) -> void
+    {
+        children[childIndex] = static_cast<int>(index);
+    }
+
+    static auto ExtractLeafData(int data, unsigned int& size, unsigned int& offset) -> void
+    {
+        size = static_cast<unsigned int>(((data >> 27) & 0xf) + 1);
+        offset = data & 0x07ffffff;
+    }
+
+    auto Intersect(const Ray8& ray8, float _minT, float _maxT) const -> int
+    {
+        __m256 minT = _mm256_set1_ps(_minT);
+        __m256 maxT = _mm256_set1_ps(_maxT);
+        minT = _mm256_max_ps(minT, _mm256_mul_ps(_mm256_sub_ps(bounds[ray8.dirSign[0]][0], ray8.ox), ray8.invd[0]));
+        maxT = _mm256_min_ps(maxT, _mm256_mul_ps(_mm256_sub_ps(bounds[1 - ray8.dirSign[0]][0], ray8.ox), ray8.invd[0]));
+        minT = _mm256_max_ps(minT, _mm256_mul_ps(_mm256_sub_ps(bounds[ray8.dirSign[1]][1], ray8.oy), ray8.invd[1]));
+        maxT = _mm256_min_ps(maxT, _mm256_mul_ps(_mm256_sub_ps(bounds[1 - ray8.dirSign[1]][1], ray8.oy), ray8.invd[1]));
+        minT = _mm256_max_ps(minT, _mm256_mul_ps(_mm256_sub_ps(bounds[ray8.dirSign[2]][2], ray8.oz), ray8.invd[2]));
+        maxT = _mm256_min_ps(maxT, _mm256_mul_ps(_mm256_sub_ps(bounds[1 - ray8.dirSign[2]][2], ray8.oz), ray8.invd[2]));
+        return _mm256_movemask_ps(_mm256_cmp_ps(maxT, minT, _CMP_GE_OQ));
+    }
+};
+
+/*!
+    \brief OBVH (8-ary BVH).
+
+    Acceleration structure with 8-wide nodes tested with AVX instructions.
+    The tree is built by collapsing three levels of the binary BVH
+    constructed with the binned SAH into a node.
+    The triangles are intersected with TriAccel in `Float` precision,
+    so that the accel works both in single and double precision.
+*/
+class Accel_OBVH final : public Accel
+{
+public:
+
+    LM_IMPL_CLASS(Accel_OBVH, Accel);
+
+public:
+
+    LM_IMPL_F(Initialize) = [this](const PropertyNode*) -> bool
+    {
+        return true;
+    };
+
+    LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
+    {
+        const auto buildStartTime = std::chrono::high_resolution_clock::now();
+        std::vector<Bound> bounds_;
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Create triaccels
+
+        triangles_.clear();
+        int np = scene->NumPrimitives();
+        for (int i = 0; i < np; i++)
+        {
+            const auto* prim = scene->PrimitiveAt(i);
+            const auto* mesh = prim->mesh;
+            if (mesh)
+            {
+                // Enumerate all triangles and create triaccels
+                const auto* ps = mesh->Positions();
+                const auto* faces = mesh->Faces();
+                for (int j = 0; j < mesh->NumFaces(); j++)
+                {
+                    // Create a triaccel
+                    triangles_.push_back(TriAccelTriangle());
+                    triangles_.back().faceIndex = j;
+                    triangles_.back().primIndex = i;
+                    unsigned int i1 = faces[3 * j];
+                    unsigned int i2 = faces[3 * j + 1];
+                    unsigned int i3 = faces[3 * j + 2];
+                    Vec3 p1(prim->transform * Vec4(ps[3 * i1], ps[3 * i1 + 1], ps[3 * i1 + 2], 1_f));
+                    Vec3 p2(prim->transform * Vec4(ps[3 * i2], ps[3 * i2 + 1], ps[3 * i2 + 2], 1_f));
+                    Vec3 p3(prim->transform * Vec4(ps[3 * i3], ps[3 * i3 + 1], ps[3 * i3 + 2], 1_f));
+                    triangles_.back().Load(p1, p2, p3);
+
+                    Bound bound;
+                    bound = Math::Union(bound, p1);
+                    bound = Math::Union(bound, p2);
+                    bound = Math::Union(bound, p3);
+                    bound.min -= Vec3(Math::Eps());
+                    bound.max += Vec3(Math::Eps());
+                    bounds_.push_back(bound);
+                }
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Build BVH
+
+        // Nodes are allocated concurrently by the build tasks
+        tbb::concurrent_vector<OBVHNode> buildNodes;
+
+        /*
+            A node of OBVH corresponds to three levels of the binary BVH.
+            The children of the binary splits are assigned to the child slots as
+                depth % 3 == 0 : 0 and 4 (new node)
+                depth % 3 == 1 : child and child + 2
+                depth % 3 == 2 : child and child + 1
+        */
+        const std::function<void(int, int, int, int, int)> Build_ = [&](int begin, int end, int parent, int child, int depth) -> void
+        {
+            #pragma region Compute current bound & centroid bound
+
+            Bound bound;
+            Bound centroidBound;
+            BVHBuildUtils::ComputeBound(bounds_, indices_, begin, end, bound, centroidBound);
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Create leaf node
+
+            const int LeafNumNodes = 10;
+            if (end - begin < LeafNumNodes)
+            {
+                auto& node = buildNodes[parent];
+                node.SetBound(child, bound);
+                node.CreateLeaf(child, end - begin, begin);
+                return;
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Determine split position & Partition
+
+            int mid = -1;
+            {
+                // Select longest axis
+                int axis = centroidBound.LongestAxis();
+
+                // Sort along the longest axis with bin sort
+                const int NumBins = 100;
+                const auto bins = BVHBuildUtils::Bin<NumBins>(bounds_, indices_, begin, end, axis, centroidBound);
+
+                // Find minimum partition with minimum local cost
+                Float minCost;
+                const int minSplitIdx = BVHBuildUtils::FindSplit<NumBins>(bins, bound, minCost);
+
+                // Partition
+                mid = begin + (int)(std::distance(indices_.begin() + begin, std::partition(indices_.begin() + begin, indices_.begin() + end, [&](int i) -> bool
+                {
+                    const auto c = bounds_[i].Centroid()[axis];
+                    return BVHBuildUtils::BinIndex<NumBins>(c, centroidBound.min[axis], centroidBound.max[axis]) <= minSplitIdx;
+                })));
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Process child nodes
+
+            {
+                int current;
+                int child1;
+                int child2;
+
+                if (depth % 3 == 0)
+                {
+                    // Create a new node
+                    current = (int)(std::distance(buildNodes.begin(), buildNodes.grow_by(1)));
+
+                    // Set information to parent node
+                    buildNodes[parent].CreateIntermediateNode(child, current);
+                    buildNodes[parent].SetBound(child, bound);
+
+                    // Child indices
+                    child1 = 0;
+                    child2 = 4;
+                }
+                else
+                {
+                    // Process sibling children
+                    const int offset = depth % 3 == 1 ? 2 : 1;
+                    current = parent;
+                    child1 = child;
+                    child2 = child + offset;
+                }
+
+                assert(begin != mid && mid != end);
+                BVHBuildUtils::ProcessChildren(end - begin,
+                    [&]() { Build_(begin, mid, current, child1, depth + 1); },
+                    [&]() { Build_(mid, end, current, child2, depth + 1); });
+            }
+
+            #pragma endregion
+        };
+
+        indices_.assign(triangles_.size(), 0);
+        std::iota(indices_.begin(), indices_.end(), 0);
+        buildNodes.grow_by(1);
+        Build_(0, (int)(triangles_.size()), 0, 0, 0);
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Relayout nodes
+
+        // Copy the nodes into the flat array in depth-first order
+        // where the intermediate children of a node are placed next to each other.
+        BVHBuildUtils::BuildStats stats;
+        {
+            nodes_.clear();
+            nodes_.reserve(buildNodes.size());
+            nodes_.push_back(buildNodes[0]);
+
+            maxDepth_ = 0;
+            const std::function<void(int, int)> Relayout_ = [&](int index, int depth) -> void
+            {
+                stats.numNodes++;
+                maxDepth_ = std::max(maxDepth_, depth);
+
+                int childIndices[8];
+                for (int child = 0; child < 8; child++)
+                {
+                    const int data = nodes_[index].children[child];
+                    childIndices[child] = -1;
+                    if (data >= 0)
+                    {
+                        childIndices[child] = (int)(nodes_.size());
+                        nodes_.push_back(buildNodes[data]);
+                        nodes_[index].CreateIntermediateNode(child, childIndices[child]);
+                    }
+                    else if (data != OBVHNode::EmptyLeafNode)
+                    {
+                        unsigned int size, offset;
+                        OBVHNode::ExtractLeafData(data, size, offset);
+                        stats.numLeaves++;
+                        stats.numLeafTriangles += size;
+                        stats.maxDepth = std::max(stats.maxDepth, depth + 1);
+                    }
+                }
+                for (int child = 0; child < 8; child++)
+                {
+                    if (childIndices[child] >= 0)
+                    {
+                        Relayout_(childIndices[child], depth + 1);
+                    }
+                }
+            };
+            Relayout_(0, 0);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        const auto buildEndTime = std::chrono::high_resolution_clock::now();
+        BVHBuildUtils::PrintStats(stats, (double)(std::chrono::duration_cast<std::chrono::milliseconds>(buildEndTime - buildStartTime).count()) / 1000.0);
+
+        ReplicatePerNumaNode();
+
+        return true;
+    };
+
+    LM_IMPL_F(Intersect) = [this](const Scene* scene, const Ray& ray, Intersection& isect, Float minT, Float maxT) -> bool
+    {
+        const auto arrays = TraversalData();
+        bool hit = false;
+        int minIndex = 0;
+        Vec2 minB;
+
+        const Ray8 ray8(ray);
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Traverse BVH
+
+        // Stack for traversal.
+        // Popping an intermediate node at depth d leaves at most 7 entries per ancestor and pushes at most 8.
+        BVHBuildUtils::TraversalStack<256> stack(7 * maxDepth_ + 8);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        while (stackIndex >= 0)
+        {
+            int data = stack[stackIndex--];
+            if (data < 0)
+            {
+                #pragma region Leaf node
+
+                // If the node is empty, ignore it
+                if (data == OBVHNode::EmptyLeafNode)
+                {
+                    continue;
+                }
+
+                // Intersection with objects
+                unsigned int size, offset;
+                OBVHNode::ExtractLeafData(data, size, offset);
+                for (unsigned int i = offset; i < offset + size; i++)
+                {
+                    Float t;
+                    Vec2 b;
+                    if (arrays.triangles[arrays.indices[i]].Intersect(ray, minT, maxT, b[0], b[1], t))
+                    {
+                        hit = true;
+                        maxT = t;
+                        minIndex = arrays.indices[i];
+                        minB = b;
+                    }
+                }
+
+                #pragma endregion
+            }
+            else
+            {
+                #pragma region Intermediate node
+
+                const auto& node = arrays.nodes[data];
+                int mask = node.Intersect(ray8, (float)(minT), (float)(std::min(maxT, (Float)(std::numeric_limits<float>::max()))));
+                for (int child = 0; child < 8; child++)
+                {
+                    if (mask & (1 << child))
+                    {
+                        stack[++stackIndex] = node.children[child];
+                    }
+                }
+
+                #pragma endregion
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        if (hit)
+        {
+            isect = IntersectionUtils::CreateTriangleIntersection(
+                scene->PrimitiveAt(arrays.triangles[minIndex].primIndex),
+                ray.o + ray.d * maxT,
+                minB,
+                arrays.triangles[minIndex].faceIndex);
+        }
+
+        return hit;
+    };
+
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        const auto arrays = TraversalData();
+        const Ray8 ray8(ray);
+
+        // Stack for traversal.
+        // Popping an intermediate node at depth d leaves at most 7 entries per ancestor and pushes at most 8.
+        BVHBuildUtils::TraversalStack<256> stack(7 * maxDepth_ + 8);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        while (stackIndex >= 0)
+        {
+            int data = stack[stackIndex--];
+            if (data < 0)
+            {
+                // If the node is empty, ignore it
+                if (data == OBVHNode::EmptyLeafNode)
+                {
+                    continue;
+                }
+
+                // Any hit in the range terminates the traversal
+                unsigned int size, offset;
+                OBVHNode::ExtractLeafData(data, size, offset);
+                for (unsigned int i = offset; i < offset + size; i++)
+                {
+                    Float t;
+                    Vec2 b;
+                    if (arrays.triangles[arrays.indices[i]].Intersect(ray, minT, maxT, b[0], b[1], t))
+                    {
+                        return true;
+                    }
+                }
+            }
+            else
+            {
+                const auto& node = arrays.nodes[data];
+                int mask = node.Intersect(ray8, (float)(minT), (float)(std::min(maxT, (Float)(std::numeric_limits<float>::max()))));
+                for (int child = 0; child < 8; child++)
+                {
+                    if (mask & (1 << child))
+                    {
+                        stack[++stackIndex] = node.children[child];
+                    }
+                }
+            }
+        }
+
+        return false;
+    };
+
+private:
+
+    std::vector<TriAccelTriangle> triangles_;
+    std::vector<OBVHNode, aligned_allocator<OBVHNode, 64>> nodes_;
+    std::vector<int> indices_;
+    int maxDepth_ = 0;                  // Maximum depth of the intermediate nodes, which bounds the traversal stack
+
+    // Copies of the arrays allocated on each NUMA node (empty if disabled)
+    struct NumaReplica
+    {
+        std::vector<TriAccelTriangle> triangles;
+        std::vector<OBVHNode, aligned_allocator<OBVHNode, 64>> nodes;
+        std::vector<int> indices;
+    };
+    std::vector<NumaReplica> numaReplicas_;
+
+private:
+
+    // Pointers to the arrays used by the traversal
+    struct TraversalArrays
+    {
+        const TriAccelTriangle* triangles;
+        const OBVHNode* nodes;
+        const int* indices;
+    };
+
+    // Returns the arrays local to the NUMA node of the current thread if replicated
+    auto TraversalData() const -> TraversalArrays
+    {
+        if (numaReplicas_.empty())
+        {
+            return TraversalArrays{ triangles_.data(), nodes_.data(), indices_.data() };
+        }
+
+        const auto& replica = numaReplicas_[Parallel::GetNumaNode()];
+        return TraversalArrays{ replica.triangles.data(), replica.nodes.data(), replica.indices.data() };
+    }
+
+    /*
+        Replicates the arrays used by the traversal to each NUMA node
+        if NUMA-aware thread placement is enabled (see Accel_QBVH).
+    */
+    auto ReplicatePerNumaNode() -> void
+    {
+        numaReplicas_.clear();
+        const int numNumaNodes = Parallel::GetNumNumaNodes();
+        if (!Parallel::GetNumaAware() || numNumaNodes <= 1)
+        {
+            return;
+        }
+
+        numaReplicas_.resize(numNumaNodes);
+        for (int node = 0; node < numNumaNodes; node++)
+        {
+            Parallel::ExecuteOnNumaNode(node, [&]() -> void
+            {
+                auto& replica = numaReplicas_[node];
+                replica.triangles.assign(triangles_.begin(), triangles_.end());
+                replica.nodes.assign(nodes_.begin(), nodes_.end());
+                replica.indices.assign(indices_.begin(), indices_.end());
+            });
+        }
+
+        LM_LOG_INFO(boost::str(boost::format("Replicated to %d NUMA nodes") % numNumaNodes));
+    }
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Accel_OBVH, "accel::obvh");
+
+LM_NAMESPACE_END
+
+#endif
@@ -26,14 +26,18 @@
 #include <lightmetrica/accel.h>
 #include <lightmetrica/scene.h>
 #include <lightmetrica/trianglemesh.h>
-#include <lightmetrica/triaccel.h>
+#include <lightmetrica/align.h>
+#include <lightmetrica/bvhbuildutils.h>
+#include <lightmetrica/accelcache.h>
+#include <lightmetrica/property.h>
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/bound.h>
 #include <lightmetrica/intersectionutils.h>
+#include <lightmetrica/detail/parallel.h>
 
-#if !LM_SSE || !LM_SINGLE_PRECISION
-    #error "accel_qbvh: Unsupported configuration"
-#endif
+// QBVH is only available with SSE and single precision configuration.
+// Use accel::obvh for double precision.
+#if LM_SSE && LM_SINGLE_PRECISION
 
 LM_NAMESPACE_BEGIN
 
@@ -53,7 +57,43 @@ struct Ray4
     }
 };
 
-struct QBVHNode : public SIMDAlignedType
+/*
+    Packet of four rays in SOA format.
+    Each lane holds one ray of the packet,
+    which is utilized for the packet traversal of the QBVH.
+*/
+struct RayPacket4
+{
+    __m128 ox, oy, oz;
+    __m128 invdx, invdy, invdz;
+
+    RayPacket4(const Ray* rays, int n)
+    {
+        float o[3][4], invd[3][4];
+        for (int i = 0; i < 4; i++)
+        {
+            // Inactive lanes are filled with the first ray
+            const auto& ray = rays[i < n ? i : 0];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                o[axis][i] = ray.o[axis];
+                invd[axis][i] = ray.d[axis] == 0.0f ? std::numeric_limits<float>::max() : 1.0f / ray.d[axis];
+            }
+        }
+        ox = _mm_loadu_ps(o[0]);
+        oy = _mm_loadu_ps(o[1]);
+        oz = _mm_loadu_ps(o[2]);
+        invdx = _mm_loadu_ps(invd[0]);
+        invdy = _mm_loadu_ps(invd[1]);
+        invdz = _mm_loadu_ps(invd[2]);
+    }
+};
+
+/*
+    Node of QBVH.
+    The nodes are stored in a flat array aligned to the cache lines.
+*/
+struct LM_ALIGN(64) QBVHNode
 {
     // Constant which indicates a empty leaf node
     static const int EmptyLeafNode = 0xffffffff;
@@ -97,6 +137,17 @@ public:
         }
     }
 
+    auto GetBound(int childIndex) const -> Bound
+    {
+        Bound bound;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            bound.min[axis] = reinterpret_cast<const float*>(&(bounds[0][axis]))[childIndex];
+            bound.max[axis] = reinterpret_cast<const float*>(&(bounds[1][axis]))[childIndex];
+        }
+        return bound;
+    }
+
     auto CreateLeaf(int childIndex, unsigned int size, unsigned int offset) -> void
     {
         if (size == 0)
@@ -122,7 +173,7 @@ public:
         offset = data & 0x07ffffff;
     }
 
-    auto Intersect(const Ray4& ray4, const __m128 invRayDirMinT[3], const __m128 invRayDirMaxT[3], const int rayDirSign[3], float _minT, float _maxT) -> int
+    auto Intersect(const Ray4& ray4, const __m128 invRayDirMinT[3], const __m128 invRayDirMaxT[3], const int rayDirSign[3], float _minT, float _maxT) const -> int
     {
         __m128 minT = _mm_set1_ps(_minT);
         __m128 maxT = _mm_set1_ps(_maxT);
@@ -136,6 +187,128 @@ public:
         maxT = _mm_min_ps(maxT, _mm_mul_ps(_mm_sub_ps(bounds[1 - rayDirSign[2]][2], ray4.oz), invRayDirMaxT[2]));
         return _mm_movemask_ps(_mm_cmpge_ps(maxT, minT));
     }
+
+    // Intersection of the packet of rays with the bound of the child specified by `childIndex`.
+    // Returns the mask of the rays hitting the bound.
+    auto IntersectPacket(const RayPacket4& packet, int childIndex, __m128 minT, __m128 maxT) const -> int
+    {
+        const auto Slab = [&](int axis, __m128 o, __m128 invd) -> void
+        {
+            const auto bmin = _mm_set1_ps(reinterpret_cast<const float*>(&bounds[0][axis])[childIndex]);
+            const auto bmax = _mm_set1_ps(reinterpret_cast<const float*>(&bounds[1][axis])[childIndex]);
+            const auto t1 = _mm_mul_ps(_mm_sub_ps(bmin, o), invd);
+            const auto t2 = _mm_mul_ps(_mm_sub_ps(bmax, o), invd);
+            minT = _mm_max_ps(minT, _mm_min_ps(t1, t2));
+            maxT = _mm_min_ps(maxT, _mm_max_ps(t1, t2));
+        };
+        Slab(0, packet.ox, packet.invdx);
+        Slab(1, packet.oy, packet.invdy);
+        Slab(2, packet.oz, packet.invdz);
+        return _mm_movemask_ps(_mm_cmple_ps(minT, maxT));
+    }
+};
+
+/*
+    Block of four triangles in SOA format.
+    The leaves of the QBVH refer to the blocks, which are intersected
+    with a ray at once with the Moller-Trumbore algorithm.
+    The lanes without triangles are filled with degenerated triangles.
+*/
+struct QBVHTriangle4
+{
+    // Vertex positions and edges for 4 triangles
+    __m128 p1[3];
+    __m128 e1[3];
+    __m128 e2[3];
+
+public:
+
+    QBVHTriangle4()
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            p1[i] = _mm_setzero_ps();
+            e1[i] = _mm_setzero_ps();
+            e2[i] = _mm_setzero_ps();
+        }
+    }
+
+    auto Load(int lane, const Vec3& p1_, const Vec3& p2_, const Vec3& p3_) -> void
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            reinterpret_cast<float*>(&p1[axis])[lane] = p1_[axis];
+            reinterpret_cast<float*>(&e1[axis])[lane] = p2_[axis] - p1_[axis];
+            reinterpret_cast<float*>(&e2[axis])[lane] = p3_[axis] - p1_[axis];
+        }
+    }
+
+    /*
+        Intersection with 4 triangles.
+        Returns the lane of the closest hit triangle or -1 if the ray does not hit any triangle.
+        If `anyHit` is true, the function returns with the first lane found.
+    */
+    auto Intersect(const Ray4& ray4, float minT, float maxT, float& t, float& u, float& v, bool anyHit = false) const -> int
+    {
+        // P = d x e2
+        const auto px = _mm_sub_ps(_mm_mul_ps(ray4.dy, e2[2]), _mm_mul_ps(ray4.dz, e2[1]));
+        const auto py = _mm_sub_ps(_mm_mul_ps(ray4.dz, e2[0]), _mm_mul_ps(ray4.dx, e2[2]));
+        const auto pz = _mm_sub_ps(_mm_mul_ps(ray4.dx, e2[1]), _mm_mul_ps(ray4.dy, e2[0]));
+
+        // Determinant
+        const auto det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1[0], px), _mm_mul_ps(e1[1], py)), _mm_mul_ps(e1[2], pz));
+        const auto invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+        // First barycentric coordinate
+        const auto tx = _mm_sub_ps(ray4.ox, p1[0]);
+        const auto ty = _mm_sub_ps(ray4.oy, p1[1]);
+        const auto tz = _mm_sub_ps(ray4.oz, p1[2]);
+        const auto u4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+
+        // Q = T x e1
+        const auto qx = _mm_sub_ps(_mm_mul_ps(ty, e1[2]), _mm_mul_ps(tz, e1[1]));
+        const auto qy = _mm_sub_ps(_mm_mul_ps(tz, e1[0]), _mm_mul_ps(tx, e1[2]));
+        const auto qz = _mm_sub_ps(_mm_mul_ps(tx, e1[1]), _mm_mul_ps(ty, e1[0]));
+
+        // Second barycentric coordinate and distance
+        const auto v4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ray4.dx, qx), _mm_mul_ps(ray4.dy, qy)), _mm_mul_ps(ray4.dz, qz)), invDet);
+        const auto t4 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2[0], qx), _mm_mul_ps(e2[1], qy)), _mm_mul_ps(e2[2], qz)), invDet);
+
+        // Check validity of hits
+        const auto zero = _mm_setzero_ps();
+        auto valid = _mm_cmpneq_ps(det, zero);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(u4, zero));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(v4, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u4, v4), _mm_set1_ps(1.0f)));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(t4, _mm_set1_ps(minT)));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(t4, _mm_set1_ps(maxT)));
+        int mask = _mm_movemask_ps(valid);
+        if (mask == 0)
+        {
+            return -1;
+        }
+
+        // Select the closest hit
+        LM_ALIGN_16 float ts[4];
+        _mm_store_ps(ts, t4);
+        int lane = -1;
+        for (int i = 0; i < 4; i++)
+        {
+            if ((mask & (1 << i)) && (lane < 0 || ts[i] < ts[lane]))
+            {
+                lane = i;
+                if (anyHit)
+                {
+                    break;
+                }
+            }
+        }
+
+        t = ts[lane];
+        u = reinterpret_cast<const float*>(&u4)[lane];
+        v = reinterpret_cast<const float*>(&v4)[lane];
+        return lane;
+    }
 };
 
 class Accel_QBVH final : public Accel
@@ -146,19 +319,65 @@ public:
 
 public:
 
-    LM_IMPL_F(Initialize) = [this](const PropertyNode*) -> bool
+    LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        if (prop)
+        {
+            cacheDir_ = prop->ChildAs<std::string>("cache_dir", "");
+        }
         return true;
     };
 
     LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
     {
+        const auto buildStartTime = std::chrono::high_resolution_clock::now();
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Load from cache
+
+        std::uint64_t cacheHash = 0;
+        if (!cacheDir_.empty())
+        {
+            auto hash = AccelCacheHash::SceneHash(scene);
+            hash.Add(std::string("accel::qbvh"));
+            hash.Add(LeafNumNodes);
+            hash.Add(NumBins);
+            hash.Add(sizeof(QBVHNode));
+            hash.Add(sizeof(QBVHTriangle4));
+            cacheHash = hash.Value();
+
+            const auto path = AccelCache::CachePath(cacheDir_, "qbvh", cacheHash);
+            if (cache_.Load(path, cacheHash) && cache_.NumSections() == 4)
+            {
+                size_t numNodes, numBlocks, numBlockIndices, numTriangles;
+                nodeData_ = cache_.Data<QBVHNode>(0, numNodes);
+                blockData_ = cache_.Data<QBVHTriangle4>(1, numBlocks);
+                blockIndexData_ = cache_.Data<int>(2, numBlockIndices);
+                triangleData_ = cache_.Data<TriangleRef>(3, numTriangles);
+                if (numNodes > 0 && numBlockIndices == 4 * numBlocks)
+                {
+                    nodes_.clear();
+                    blocks_.clear();
+                    blockIndices_.clear();
+                    triangles_.clear();
+                    LM_LOG_INFO("Loaded from cache '" + path + "'");
+                    LM_LOG_INFO(boost::str(boost::format("# of nodes        : %d") % numNodes));
+                    ReplicatePerNumaNode(numNodes, numBlocks, numTriangles);
+                    return true;
+                }
+            }
+        }
+
+        #pragma endregion
         std::vector<Bound> bounds_;
+        std::vector<Vec3> positions;
 
         // --------------------------------------------------------------------------------
 
-        #pragma region Create triaccels
+        #pragma region Create triangles
 
+        triangles_.clear();
         int np = scene->NumPrimitives();
         for (int i = 0; i < np; i++)
         {
@@ -166,22 +385,22 @@ public:
             const auto* mesh = prim->mesh;
             if (mesh)
             {
-                // Enumerate all triangles and create triaccels
+                // Enumerate all triangles
                 const auto* ps = mesh->Positions();
                 const auto* faces = mesh->Faces();
                 for (int j = 0; j < mesh->NumFaces(); j++)
                 {
-                    // Create a triaccel
-                    triangles_.push_back(TriAccelTriangle());
-                    triangles_.back().faceIndex = j;
-                    triangles_.back().primIndex = i;
+                    // Store the triangle
                     unsigned int i1 = faces[3 * j];
                     unsigned int i2 = faces[3 * j + 1];
                     unsigned int i3 = faces[3 * j + 2];
                     Vec3 p1(prim->transform * Vec4(ps[3 * i1], ps[3 * i1 + 1], ps[3 * i1 + 2], 1_f));
                     Vec3 p2(prim->transform * Vec4(ps[3 * i2], ps[3 * i2 + 1], ps[3 * i2 + 2], 1_f));
                     Vec3 p3(prim->transform * Vec4(ps[3 * i3], ps[3 * i3 + 1], ps[3 * i3 + 2], 1_f));
-                    triangles_.back().Load(p1, p2, p3);
+                    triangles_.push_back(TriangleRef{ i, j });
+                    positions.push_back(p1);
+                    positions.push_back(p2);
+                    positions.push_back(p3);
 
                     Bound bound;
                     bound = Math::Union(bound, p1);
@@ -200,15 +419,16 @@ public:
 
         #pragma region Build BVH
 
+        // Nodes are allocated concurrently by the build tasks
+        tbb::concurrent_vector<QBVHNode> buildNodes;
+
         const std::function<void(int, int, int, int, int)> Build_ = [&](int begin, int end, int parent, int child, int depth) -> void
         {
-            #pragma region Compute current bound
+            #pragma region Compute current bound & centroid bound
 
             Bound bound;
-            for (int i = begin; i < end; i++)
-            {
-                bound = Math::Union(bound, bounds_[indices_[i]]);
-            }
+            Bound centroidBound;
+            BVHBuildUtils::ComputeBound(bounds_, indices_, begin, end, bound, centroidBound);
 
             #pragma endregion
 
@@ -216,12 +436,11 @@ public:
 
             #pragma region Create leaf node
 
-            const int LeafNumNodes = 10;
             if (end - begin < LeafNumNodes)
             {
-                const auto& node = nodes_[parent];
-                node->SetBound(child, bound);
-                node->CreateLeaf(child, end - begin, begin);
+                auto& node = buildNodes[parent];
+                node.SetBound(child, bound);
+                node.CreateLeaf(child, end - begin, begin);
                 return;
             }
 
@@ -233,79 +452,17 @@ public:
 
             int mid = -1;
             {
-                #pragma region Centroid bound
-
-                Bound centroidBound;
-                for (int i = begin; i < end; i++)
-                {
-                    centroidBound = Math::Union(centroidBound, bounds_[indices_[i]].Centroid());
-                }
-
-                #pragma endregion
-        
-                // --------------------------------------------------------------------------------
-
-                #pragma region Create bins and compute SAH costs
+                #pragma region Create bins and find the split with minimum local SAH cost
 
                 // Select longest axis
                 int axis = centroidBound.LongestAxis();
 
                 // Sort along the longest axis with bin sort
-                const int NumBins = 100;
-                Bound bounds[NumBins];
-                int counts[NumBins] = {0};
-                for (int i = begin; i < end; i++)
-                {
-                    const auto b = bounds_[indices_[i]];
-                    const float min = centroidBound.min[axis];
-                    const float max = centroidBound.max[axis];
-                    int idx = std::min((int)((b.Centroid()[axis] - min) / (max - min) * NumBins), NumBins - 1);
-                    bounds[idx] = Math::Union(bounds[idx], b);
-                    counts[idx]++;
-                }
-
-                // Compute local SAH costs
-                float costs[NumBins - 1];
-                for (int split = 0; split < NumBins - 1; split++)
-                {
-                    #pragma region Compute bounds of split parts
-
-                    Bound bound1;
-                    Bound bound2;
-                    int n1 = 0;
-                    int n2 = 0;
-
-                    for (int i = 0; i <= split; i++)
-                    {
-                        bound1 = Math::Union(bound1, bounds[i]);
-                        n1 += counts[i];
-                    }
-
-                    for (int i = split + 1; i < NumBins; i++)
-                    {
-                        bound2 = Math::Union(bound2, bounds[i]);
-                        n2 += counts[i];
-                    }
-
-                    #pragma endregion
-
-                    #pragma region Compute local SAH cost
-
-                    const float Cb = 0.125f;
-                    const float C1 = n1 > 0 ? bound1.SurfaceArea() * n1 : 0.0f;
-                    const float C2 = n2 > 0 ? bound2.SurfaceArea() * n2 : 0.0f;
-                    costs[split] = Cb + (C1 + C2) / bound.SurfaceArea();
-
-                    #pragma endregion
-                }
-
-                #pragma endregion
-
-                // --------------------------------------------------------------------------------
+                const auto bins = BVHBuildUtils::Bin<NumBins>(bounds_, indices_, begin, end, axis, centroidBound);
 
-                #pragma region Find minimum partition with minimum local cost
-
-                const int minSplitIdx = (int)(std::distance(costs, std::min_element(costs, costs + NumBins - 1)));
+                // Find minimum partition with minimum local cost
+                Float minCost;
+                const int minSplitIdx = BVHBuildUtils::FindSplit<NumBins>(bins, bound, minCost);
 
                 #pragma endregion
 
@@ -315,11 +472,8 @@ public:
 
                 mid = begin + (int)(std::distance(indices_.begin() + begin, std::partition(indices_.begin() + begin, indices_.begin() + end, [&](int i) -> bool
                 {
-                    const auto c =  bounds_[i].Centroid()[axis];
-                    const float min = centroidBound.min[axis];
-                    const float max = centroidBound.max[axis];
-                    int idx = std::min((int)((c - min) / (max - min) * NumBins), NumBins - 1);
-                    return idx <= minSplitIdx;
+                    const auto c = bounds_[i].Centroid()[axis];
+                    return BVHBuildUtils::BinIndex<NumBins>(c, centroidBound.min[axis], centroidBound.max[axis]) <= minSplitIdx;
                 })));
 
                 #pragma endregion
@@ -353,12 +507,11 @@ public:
                     #pragma region Create a new intermediate node
 
                     // Create a new node
-                    current = (int)(nodes_.size());
-                    nodes_.emplace_back(new QBVHNode, [](QBVHNode* p){ delete p; });
+                    current = (int)(std::distance(buildNodes.begin(), buildNodes.grow_by(1)));
 
                     // Set information to parent node
-                    nodes_[parent]->CreateIntermediateNode(child, current);
-                    nodes_[parent]->SetBound(child, bound);
+                    buildNodes[parent].CreateIntermediateNode(child, current);
+                    buildNodes[parent].SetBound(child, bound);
 
                     // Child indices
                     child1 = 0;
@@ -374,8 +527,9 @@ public:
                 #pragma region Process nodes recursively
 
                 assert(begin != mid && mid != end);
-                Build_(begin, mid, current, child1, depth + 1);
-                Build_(mid, end, current, child2, depth + 1);
+                BVHBuildUtils::ProcessChildren(end - begin,
+                    [&]() { Build_(begin, mid, current, child1, depth + 1); },
+                    [&]() { Build_(mid, end, current, child2, depth + 1); });
 
                 #pragma endregion
             }
@@ -383,16 +537,233 @@ public:
             #pragma endregion
         };
 
-        nodes_.clear();
         indices_.assign(triangles_.size(), 0);
         std::iota(indices_.begin(), indices_.end(), 0);
-        nodes_.emplace_back(new QBVHNode, [](QBVHNode* p) { delete p; });
+        buildNodes.grow_by(1);
         Build_(0, (int)(triangles_.size()), 0, 0, 0);
 
         #pragma endregion
 
         // --------------------------------------------------------------------------------
 
+        #pragma region Relayout nodes
+
+        // Copy the nodes into the flat array in depth-first order
+        // where the intermediate children of a node are placed next to each other.
+        BVHBuildUtils::BuildStats stats;
+        {
+            nodes_.clear();
+            nodes_.reserve(buildNodes.size());
+            nodes_.push_back(buildNodes[0]);
+
+            const std::function<void(int, int)> Relayout_ = [&](int index, int depth) -> void
+            {
+                stats.numNodes++;
+
+                int childIndices[4];
+                for (int child = 0; child < 4; child++)
+                {
+                    const int data = nodes_[index].children[child];
+                    childIndices[child] = -1;
+                    if (data >= 0)
+                    {
+                        childIndices[child] = (int)(nodes_.size());
+                        nodes_.push_back(buildNodes[data]);
+                        nodes_[index].CreateIntermediateNode(child, childIndices[child]);
+                    }
+                    else if (data != QBVHNode::EmptyLeafNode)
+                    {
+                        unsigned int size, offset;
+                        QBVHNode::ExtractLeafData(data, size, offset);
+                        stats.numLeaves++;
+                        stats.numLeafTriangles += size;
+                        stats.maxDepth = std::max(stats.maxDepth, depth + 1);
+                    }
+                }
+                for (int child = 0; child < 4; child++)
+                {
+                    if (childIndices[child] >= 0)
+                    {
+                        Relayout_(childIndices[child], depth + 1);
+                    }
+                }
+            };
+            Relayout_(0, 0);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Create triangle blocks
+
+        // Pack the triangles in the leaves into the blocks of four triangles
+        // and replace the references of the leaves with the blocks.
+        blocks_.clear();
+        blockIndices_.clear();
+        for (auto& node : nodes_)
+        {
+            for (int child = 0; child < 4; child++)
+            {
+                const int data = node.children[child];
+                if (data >= 0 || data == QBVHNode::EmptyLeafNode)
+                {
+                    continue;
+                }
+
+                unsigned int size, offset;
+                QBVHNode::ExtractLeafData(data, size, offset);
+                const auto blockOffset = (unsigned int)(blocks_.size());
+                for (unsigned int i = 0; i < size; i++)
+                {
+                    const int lane = i % 4;
+                    if (lane == 0)
+                    {
+                        blocks_.emplace_back();
+                        blockIndices_.insert(blockIndices_.end(), 4, -1);
+                    }
+
+                    const int index = indices_[offset + i];
+                    blocks_.back().Load(lane, positions[3 * index], positions[3 * index + 1], positions[3 * index + 2]);
+                    blockIndices_[4 * (blocks_.size() - 1) + lane] = index;
+                }
+
+                node.CreateLeaf(child, (unsigned int)(blocks_.size()) - blockOffset, blockOffset);
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        nodeData_ = nodes_.data();
+        blockData_ = blocks_.data();
+        blockIndexData_ = blockIndices_.data();
+        triangleData_ = triangles_.data();
+
+        const auto buildEndTime = std::chrono::high_resolution_clock::now();
+        BVHBuildUtils::PrintStats(stats, (double)(std::chrono::duration_cast<std::chrono::milliseconds>(buildEndTime - buildStartTime).count()) / 1000.0);
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save to cache
+
+        if (!cacheDir_.empty())
+        {
+            const auto path = AccelCache::CachePath(cacheDir_, "qbvh", cacheHash);
+            if (AccelCache::Save(path, cacheHash, {
+                { nodes_.data(), sizeof(QBVHNode) * nodes_.size() },
+                { blocks_.data(), sizeof(QBVHTriangle4) * blocks_.size() },
+                { blockIndices_.data(), sizeof(int) * blockIndices_.size() },
+                { triangles_.data(), sizeof(TriangleRef) * triangles_.size() } }))
+            {
+                LM_LOG_INFO("Saved to cache '" + path + "'");
+            }
+        }
+
+        #pragma endregion
+
+        ReplicatePerNumaNode(nodes_.size(), blocks_.size(), triangles_.size());
+
+        return true;
+    };
+
+    LM_IMPL_F(Refit) = [this](const Scene* scene) -> bool
+    {
+        #pragma region Copy the arrays loaded from the cache
+
+        // The memory-mapped arrays are read-only
+        if (nodeData_ != nodes_.data())
+        {
+            size_t numNodes, numBlocks, numBlockIndices, numTriangles;
+            const auto* nodes = cache_.Data<QBVHNode>(0, numNodes);
+            const auto* blocks = cache_.Data<QBVHTriangle4>(1, numBlocks);
+            const auto* blockIndices = cache_.Data<int>(2, numBlockIndices);
+            const auto* triangles = cache_.Data<TriangleRef>(3, numTriangles);
+            nodes_.assign(nodes, nodes + numNodes);
+            blocks_.assign(blocks, blocks + numBlocks);
+            blockIndices_.assign(blockIndices, blockIndices + numBlockIndices);
+            triangles_.assign(triangles, triangles + numTriangles);
+            nodeData_ = nodes_.data();
+            blockData_ = blocks_.data();
+            blockIndexData_ = blockIndices_.data();
+            triangleData_ = triangles_.data();
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Update triangle blocks
+
+        std::vector<Bound> bounds(triangles_.size());
+        tbb::parallel_for(0, (int)(blocks_.size()), [&](int i) -> void
+        {
+            for (int lane = 0; lane < 4; lane++)
+            {
+                const int index = blockIndices_[4 * i + lane];
+                if (index < 0)
+                {
+                    continue;
+                }
+
+                Vec3 p1, p2, p3;
+                const auto& tri = triangles_[index];
+                bounds[index] = BVHBuildUtils::TransformedTriangle(scene->PrimitiveAt(tri.primIndex), tri.faceIndex, p1, p2, p3);
+                blocks_[i].Load(lane, p1, p2, p3);
+            }
+        });
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Update bounds bottom-up
+
+        // The child nodes are placed after their parents
+        for (int i = (int)(nodes_.size()) - 1; i >= 0; i--)
+        {
+            auto& node = nodes_[i];
+            for (int child = 0; child < 4; child++)
+            {
+                const int data = node.children[child];
+                if (data == QBVHNode::EmptyLeafNode)
+                {
+                    continue;
+                }
+
+                Bound bound;
+                if (data >= 0)
+                {
+                    const auto& childNode = nodes_[data];
+                    for (int j = 0; j < 4; j++)
+                    {
+                        if (childNode.children[j] != QBVHNode::EmptyLeafNode)
+                        {
+                            bound = Math::Union(bound, childNode.GetBound(j));
+                        }
+                    }
+                }
+                else
+                {
+                    unsigned int size, offset;
+                    QBVHNode::ExtractLeafData(data, size, offset);
+                    for (unsigned int j = 4 * offset; j < 4 * (offset + size); j++)
+                    {
+                        if (blockIndices_[j] >= 0)
+                        {
+                            bound = Math::Union(bound, bounds[blockIndices_[j]]);
+                        }
+                    }
+                }
+                node.SetBound(child, bound);
+            }
+        }
+
+        #pragma endregion
+
+        ReplicatePerNumaNode(nodes_.size(), blocks_.size(), triangles_.size());
+
         return true;
     };
 
@@ -400,6 +771,7 @@ public:
     {
         #pragma region Prepare some required data
 
+        const auto arrays = TraversalData();
         bool hit = false;
         int minIndex;
         Vec2 minB;
@@ -454,11 +826,12 @@ public:
                 {
                     Float t;
                     Vec2 b;
-                    if (triangles_[indices_[i]].Intersect(ray, minT, maxT, b[0], b[1], t))
+                    const int lane = arrays.blocks[i].Intersect(ray4, minT, maxT, t, b[0], b[1]);
+                    if (lane >= 0)
                     {
                         hit = true;
                         maxT = t;
-                        minIndex = indices_[i];
+                        minIndex = arrays.blockIndices[4 * i + lane];
                         minB = b;
                     }
                 }
@@ -469,12 +842,12 @@ public:
             {
                 #pragma region Intermediate node
 
-                const auto& node = nodes_[data];
-                int mask = node->Intersect(ray4, invRayDirMinT, invRayDirMaxT, rayDirSign, minT, maxT);
-                if (mask & 0x1) stack[++stackIndex] = node->children[0];
-                if (mask & 0x2) stack[++stackIndex] = node->children[1];
-                if (mask & 0x4) stack[++stackIndex] = node->children[2];
-                if (mask & 0x8) stack[++stackIndex] = node->children[3];
+                const auto& node = arrays.nodes[data];
+                int mask = node.Intersect(ray4, invRayDirMinT, invRayDirMaxT, rayDirSign, minT, maxT);
+                if (mask & 0x1) stack[++stackIndex] = node.children[0];
+                if (mask & 0x2) stack[++stackIndex] = node.children[1];
+                if (mask & 0x4) stack[++stackIndex] = node.children[2];
+                if (mask & 0x8) stack[++stackIndex] = node.children[3];
 
                 #pragma endregion
             }
@@ -487,23 +860,334 @@ public:
         if (hit)
         {
             isect = IntersectionUtils::CreateTriangleIntersection(
-                scene->PrimitiveAt(triangles_[minIndex].primIndex),
+                scene->PrimitiveAt(arrays.triangles[minIndex].primIndex),
                 ray.o + ray.d * maxT,
                 minB,
-                triangles_[minIndex].faceIndex);
+                arrays.triangles[minIndex].faceIndex);
         }
 
         return hit;
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        #pragma region Prepare some required data
+
+        const auto arrays = TraversalData();
+        Ray4 ray4(ray);
+        __m128 invRayDirMinT[3];
+        __m128 invRayDirMaxT[3];
+        int rayDirSign[3];
+
+        invRayDirMinT[0] = _mm_set1_ps(ray.d.x == 0.0f ? Math::EpsLarge() : 1.0f / ray.d.x);
+        invRayDirMinT[1] = _mm_set1_ps(ray.d.y == 0.0f ? Math::EpsLarge() : 1.0f / ray.d.y);
+        invRayDirMinT[2] = _mm_set1_ps(ray.d.z == 0.0f ? Math::EpsLarge() : 1.0f / ray.d.z);
+        invRayDirMaxT[0] = _mm_set1_ps(ray.d.x == 0.0f ? Math::Inf()      : 1.0f / ray.d.x);
+        invRayDirMaxT[1] = _mm_set1_ps(ray.d.y == 0.0f ? Math::Inf()      : 1.0f / ray.d.y);
+        invRayDirMaxT[2] = _mm_set1_ps(ray.d.z == 0.0f ? Math::Inf()      : 1.0f / ray.d.z);
+
+        rayDirSign[0] = ray.d.x < 0.0f;
+        rayDirSign[1] = ray.d.y < 0.0f;
+        rayDirSign[2] = ray.d.z < 0.0f;
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Traverse BVH
+
+        // Stack for traversal
+        const int StackSize = 64;
+        int stack[StackSize];
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        while (stackIndex >= 0)
+        {
+            int data = stack[stackIndex--];
+            if (data < 0)
+            {
+                #pragma region Leaf node
+
+                // If the node is empty, ignore it
+                if (data == QBVHNode::EmptyLeafNode)
+                {
+                    continue;
+                }
+
+                // Intersection with objects.
+                // Unlike `Intersect`, any hit in the range terminates the traversal.
+                unsigned int size, offset;
+                QBVHNode::ExtractLeafData(data, size, offset);
+                for (unsigned int i = offset; i < offset + size; i++)
+                {
+                    Float t;
+                    Vec2 b;
+                    if (arrays.blocks[i].Intersect(ray4, minT, maxT, t, b[0], b[1], true) >= 0)
+                    {
+                        return true;
+                    }
+                }
+
+                #pragma endregion
+            }
+            else
+            {
+                #pragma region Intermediate node
+
+                const auto& node = arrays.nodes[data];
+                int mask = node.Intersect(ray4, invRayDirMinT, invRayDirMaxT, rayDirSign, minT, maxT);
+                if (mask & 0x1) stack[++stackIndex] = node.children[0];
+                if (mask & 0x2) stack[++stackIndex] = node.children[1];
+                if (mask & 0x4) stack[++stackIndex] = node.children[2];
+                if (mask & 0x8) stack[++stackIndex] = node.children[3];
+
+                #pragma endregion
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return false;
+    };
+
+    LM_IMPL_F(IntersectPacket) = [this](const Scene* scene, const Ray* rays, int n, Intersection* isects, Float minT, Float maxT) -> unsigned int
+    {
+        assert(0 <= n && n <= 32);
+
+        const auto arrays = TraversalData();
+        unsigned int hits = 0;
+        for (int base = 0; base < n; base += 4)
+        {
+            #pragma region Prepare packet
+
+            // Process the rays by the packets of four rays.
+            // The lanes outside of the range are disabled by setting negative maximum distances.
+            const int m = std::min(4, n - base);
+            const auto* rs = rays + base;
+            RayPacket4 packet(rs, m);
+            const Ray4 laneRays[4] = { Ray4(rs[0]), Ray4(rs[std::min(1, m - 1)]), Ray4(rs[std::min(2, m - 1)]), Ray4(rs[std::min(3, m - 1)]) };
+
+            LM_ALIGN_16 float packetMaxT[4];
+            for (int i = 0; i < 4; i++)
+            {
+                packetMaxT[i] = i < m ? maxT : -std::numeric_limits<float>::infinity();
+            }
+            const auto packetMinT = _mm_set1_ps(minT);
+
+            int minIndex[4];
+            Vec2 minB[4];
+            int packetHits = 0;
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Traverse BVH
+
+            // Stack for traversal.
+            // Each entry holds the node and the mask of the rays hitting the node.
+            const int StackSize = 64;
+            int stack[StackSize];
+            int stackMask[StackSize];
+            int stackIndex = 0;
+
+            // Initial state
+            stack[0] = 0;
+            stackMask[0] = (1 << m) - 1;
+
+            while (stackIndex >= 0)
+            {
+                const int data = stack[stackIndex];
+                const int mask = stackMask[stackIndex];
+                stackIndex--;
+
+                if (data < 0)
+                {
+                    #pragma region Leaf node
+
+                    if (data == QBVHNode::EmptyLeafNode)
+                    {
+                        continue;
+                    }
+
+                    // Intersection with objects for the active rays
+                    unsigned int size, offset;
+                    QBVHNode::ExtractLeafData(data, size, offset);
+                    for (unsigned int i = offset; i < offset + size; i++)
+                    {
+                        for (int lane = 0; lane < m; lane++)
+                        {
+                            if ((mask & (1 << lane)) == 0)
+                            {
+                                continue;
+                            }
+
+                            Float t;
+                            Vec2 b;
+                            const int hitLane = arrays.blocks[i].Intersect(laneRays[lane], minT, packetMaxT[lane], t, b[0], b[1]);
+                            if (hitLane >= 0)
+                            {
+                                packetHits |= 1 << lane;
+                                packetMaxT[lane] = t;
+                                minIndex[lane] = arrays.blockIndices[4 * i + hitLane];
+                                minB[lane] = b;
+                            }
+                        }
+                    }
+
+                    #pragma endregion
+                }
+                else
+                {
+                    #pragma region Intermediate node
+
+                    const auto& node = arrays.nodes[data];
+                    const auto currentMaxT = _mm_load_ps(packetMaxT);
+                    for (int child = 0; child < 4; child++)
+                    {
+                        const int childMask = node.IntersectPacket(packet, child, packetMinT, currentMaxT) & mask;
+                        if (childMask)
+                        {
+                            stackIndex++;
+                            stack[stackIndex] = node.children[child];
+                            stackMask[stackIndex] = childMask;
+                        }
+                    }
+
+                    #pragma endregion
+                }
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Create intersections
+
+            for (int lane = 0; lane < m; lane++)
+            {
+                if ((packetHits & (1 << lane)) == 0)
+                {
+                    continue;
+                }
+
+                isects[base + lane] = IntersectionUtils::CreateTriangleIntersection(
+                    scene->PrimitiveAt(arrays.triangles[minIndex[lane]].primIndex),
+                    rs[lane].o + rs[lane].d * packetMaxT[lane],
+                    minB[lane],
+                    arrays.triangles[minIndex[lane]].faceIndex);
+                hits |= 1u << (base + lane);
+            }
+
+            #pragma endregion
+        }
+
+        return hits;
+    };
+
 private:
 
-    std::vector<TriAccelTriangle> triangles_;
-    std::vector<std::unique_ptr<QBVHNode, std::function<void(QBVHNode*)>>> nodes_;
+    // Reference to the triangle in the scene
+    struct TriangleRef
+    {
+        int primIndex;
+        int faceIndex;
+    };
+
+    // Build parameters
+    static const int LeafNumNodes = 10;
+    static const int NumBins = 100;
+
+    std::vector<TriangleRef> triangles_;
+    std::vector<QBVHTriangle4, aligned_allocator<QBVHTriangle4, 16>> blocks_;
+    std::vector<int> blockIndices_;
+    std::vector<QBVHNode, aligned_allocator<QBVHNode, 64>> nodes_;
     std::vector<int> indices_;
 
+    // Arrays used by the traversal.
+    // These point either to the arrays above or to the memory-mapped cache file.
+    const TriangleRef* triangleData_ = nullptr;
+    const QBVHTriangle4* blockData_ = nullptr;
+    const int* blockIndexData_ = nullptr;
+    const QBVHNode* nodeData_ = nullptr;
+
+    // Cache
+    std::string cacheDir_;
+    AccelCache cache_;
+
+    // Copies of the arrays allocated on each NUMA node (empty if disabled)
+    struct NumaReplica
+    {
+        std::vector<TriangleRef> triangles;
+        std::vector<QBVHTriangle4, aligned_allocator<QBVHTriangle4, 16>> blocks;
+        std::vector<int> blockIndices;
+        std::vector<QBVHNode, aligned_allocator<QBVHNode, 64>> nodes;
+    };
+    std::vector<NumaReplica> numaReplicas_;
+
+private:
+
+    // Pointers to the arrays used by the traversal
+    struct TraversalArrays
+    {
+        const TriangleRef* triangles;
+        const QBVHTriangle4* blocks;
+        const int* blockIndices;
+        const QBVHNode* nodes;
+    };
+
+    // Returns the arrays local to the NUMA node of the current thread if replicated
+    auto TraversalData() const -> TraversalArrays
+    {
+        if (numaReplicas_.empty())
+        {
+            return TraversalArrays{ triangleData_, blockData_, blockIndexData_, nodeData_ };
+        }
+
+        const auto& replica = numaReplicas_[Parallel::GetNumaNode()];
+        return TraversalArrays{ replica.triangles.data(), replica.blocks.data(), replica.blockIndices.data(), replica.nodes.data() };
+    }
+
+    /*
+        Replicates the arrays used by the traversal to each NUMA node
+        if NUMA-aware thread placement is enabled.
+        Each replica is copied by a thread pinned to the node,
+        so that the pages are allocated on the node by the first-touch policy.
+    */
+    auto ReplicatePerNumaNode(size_t numNodes, size_t numBlocks, size_t numTriangles) -> void
+    {
+        numaReplicas_.clear();
+        const int numNumaNodes = Parallel::GetNumNumaNodes();
+        if (!Parallel::GetNumaAware() || numNumaNodes <= 1)
+        {
+            return;
+        }
+
+        numaReplicas_.resize(numNumaNodes);
+        for (int node = 0; node < numNumaNodes; node++)
+        {
+            Parallel::ExecuteOnNumaNode(node, [&]() -> void
+            {
+                auto& replica = numaReplicas_[node];
+                replica.triangles.assign(triangleData_, triangleData_ + numTriangles);
+                replica.blocks.assign(blockData_, blockData_ + numBlocks);
+                replica.blockIndices.assign(blockIndexData_, blockIndexData_ + 4 * numBlocks);
+                replica.nodes.assign(nodeData_, nodeData_ + numNodes);
+            });
+        }
+
+        LM_LOG_INFO(boost::str(boost::format("Replicated to %d NUMA nodes") % numNumaNodes));
+    }
+
 };
 
 LM_COMPONENT_REGISTER_IMPL(Accel_QBVH, "accel::qbvh");
 
 LM_NAMESPACE_END
+
+#endif
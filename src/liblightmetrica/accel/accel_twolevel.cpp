@@ -0,0 +1,439 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#include <pch.h>
+#include <lightmetrica/accel.h>
+#include <lightmetrica/scene.h>
+#include <lightmetrica/trianglemesh.h>
+#include <lightmetrica/triaccel.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/bound.h>
+#include <lightmetrica/intersectionutils.h>
+#include <lightmetrica/align.h>
+#include <lightmetrica/bvhbuildutils.h>
+
+LM_NAMESPACE_BEGIN
+
+/*
+    Node of the BVHs in the two-level BVH.
+    The nodes are stored in a flat array aligned to the cache lines,
+    where two children of a node are placed next to each other.
+*/
+struct LM_ALIGN(64) TwoLevelBVHNode
+{
+    Bound bound;
+    bool isleaf;
+
+    union
+    {
+        struct
+        {
+            int begin;
+            int end;
+        } leaf;
+
+        struct
+        {
+            int child1;
+            int child2;
+        } internal;
+    };
+};
+
+/*
+    Binary BVH over the bounds of arbitrary objects.
+    The same structure is utilized for the both levels:
+    the objects are the instances in the top level
+    and the triangles in the bottom level.
+*/
+class TwoLevelBVH
+{
+public:
+
+    auto Build(const std::vector<Bound>& bounds, int leafNumNodes) -> void
+    {
+        const std::function<void(int, int, int)> Build_ = [&](int idx, int begin, int end) -> void
+        {
+            auto* node = &nodes_[idx];
+
+            // Current bound & centroid bound
+            Bound centroidBound;
+            BVHBuildUtils::ComputeBound(bounds, indices_, begin, end, node->bound, centroidBound);
+
+            // Leaf node
+            if (end - begin <= leafNumNodes)
+            {
+                node->isleaf = true;
+                node->leaf.begin = begin;
+                node->leaf.end = end;
+                return;
+            }
+
+            // Select longest axis
+            const int axis = centroidBound.LongestAxis();
+
+            int mid;
+            if (centroidBound.max[axis] <= centroidBound.min[axis])
+            {
+                // All centroids are at the same position (e.g., overlapping instances).
+                // Split the objects into halves.
+                mid = (begin + end) / 2;
+            }
+            else
+            {
+                // Find the split with the binned SAH
+                const int NumBins = 32;
+                const auto bins = BVHBuildUtils::Bin<NumBins>(bounds, indices_, begin, end, axis, centroidBound);
+                Float minCost;
+                const int minSplitIdx = BVHBuildUtils::FindSplit<NumBins>(bins, node->bound, minCost);
+                mid = begin + (int)(std::distance(indices_.begin() + begin, std::partition(indices_.begin() + begin, indices_.begin() + end, [&](int i) -> bool
+                {
+                    const auto c = bounds[i].Centroid()[axis];
+                    return BVHBuildUtils::BinIndex<NumBins>(c, centroidBound.min[axis], centroidBound.max[axis]) <= minSplitIdx;
+                })));
+            }
+
+            // Intermediate node, whose children are allocated next to each other
+            const int child1 = (int)(nodes_.size());
+            const int child2 = child1 + 1;
+            node->isleaf = false;
+            node->internal.child1 = child1;
+            node->internal.child2 = child2;
+            nodes_.emplace_back();
+            nodes_.emplace_back();
+            Build_(child1, begin, mid);
+            Build_(child2, mid, end);
+        };
+
+        nodes_.clear();
+        nodes_.emplace_back();
+        indices_.assign(bounds.size(), 0);
+        std::iota(indices_.begin(), indices_.end(), 0);
+        Build_(0, 0, (int)(bounds.size()));
+        maxDepth_ = BVHBuildUtils::MaxDepth(nodes_);
+    }
+
+    /*
+        Traverse the BVH.
+        `leafFunc(index, maxT)` is called for the objects in the leaves intersecting with the ray,
+        which returns true if the ray hits the object and then updates `maxT`.
+        If `AnyHit` is true, the traversal terminates with the first hit.
+    */
+    template <bool AnyHit, typename LeafFunc>
+    auto Traverse(const Ray& ray, Float minT, Float& maxT, const LeafFunc& leafFunc) const -> bool
+    {
+        // Stack for traversal, which needs (max depth + 1) entries at most
+        BVHBuildUtils::TraversalStack<256> stack(maxDepth_ + 1);
+        int stackIndex = 0;
+
+        // Initial state
+        stack[0] = 0;
+
+        bool hit = false;
+        while (stackIndex >= 0)
+        {
+            const auto& node = nodes_[stack[stackIndex--]];
+
+            // Check intersection with bound
+            if (!node.bound.Intersect(ray, minT, maxT))
+            {
+                continue;
+            }
+
+            // Check intersection with objects in the leaf
+            if (node.isleaf)
+            {
+                for (int i = node.leaf.begin; i < node.leaf.end; i++)
+                {
+                    if (leafFunc(indices_[i], maxT))
+                    {
+                        hit = true;
+                        if (AnyHit)
+                        {
+                            return true;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // Check intersection with child nodes
+            stack[++stackIndex] = node.internal.child2;
+            stack[++stackIndex] = node.internal.child1;
+        }
+
+        return hit;
+    }
+
+    auto RootBound() const -> Bound
+    {
+        return nodes_.empty() ? Bound() : nodes_[0].bound;
+    }
+
+private:
+
+    std::vector<TwoLevelBVHNode, aligned_allocator<TwoLevelBVHNode, 64>> nodes_;
+    std::vector<int> indices_;
+    int maxDepth_ = 0;                  // Maximum depth of the tree, which bounds the traversal stack
+
+};
+
+/*!
+    \brief Two-level BVH.
+
+    Acceleration structure supporting instancing of triangle meshes.
+    A bottom-level BVH is built once for each triangle mesh in the object space
+    and shared by all primitives referring to the mesh.
+    The top-level BVH is built over the primitives,
+    and the rays are transformed into the object space at the instance boundary.
+    Suitable for the scenes where the same meshes are reused many times.
+*/
+class Accel_TwoLevel final : public Accel
+{
+public:
+
+    LM_IMPL_CLASS(Accel_TwoLevel, Accel);
+
+public:
+
+    LM_IMPL_F(Initialize) = [this](const PropertyNode*) -> bool
+    {
+        return true;
+    };
+
+    LM_IMPL_F(Build) = [this](const Scene* scene) -> bool
+    {
+        const auto buildStartTime = std::chrono::high_resolution_clock::now();
+
+        blases_.clear();
+        instances_.clear();
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Create instances
+
+        std::unordered_map<const TriangleMesh*, int> meshToBLAS;
+        std::vector<const TriangleMesh*> meshes;
+        for (int i = 0; i < scene->NumPrimitives(); i++)
+        {
+            const auto* prim = scene->PrimitiveAt(i);
+            const auto* mesh = prim->mesh;
+            if (!mesh || mesh->NumFaces() == 0)
+            {
+                continue;
+            }
+
+            // Find or register the bottom-level BVH for the mesh
+            auto it = meshToBLAS.find(mesh);
+            if (it == meshToBLAS.end())
+            {
+                it = meshToBLAS.emplace(mesh, (int)(meshes.size())).first;
+                meshes.push_back(mesh);
+            }
+
+            // Copy-constructed from the inverse since the assignment of Mat4 is deprecated
+            instances_.push_back(Instance{ Math::Inverse(prim->transform), i, it->second });
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Build bottom-level BVHs
+
+        // Bottom-level BVHs are independent, so we build them in parallel
+        blases_.resize(meshes.size());
+        tbb::parallel_for(0, (int)(meshes.size()), [&](int i) -> void
+        {
+            const auto* mesh = meshes[i];
+            auto& blas = blases_[i];
+
+            // Create triaccels in the object space
+            std::vector<Bound> bounds;
+            const auto* ps = mesh->Positions();
+            const auto* faces = mesh->Faces();
+            for (int j = 0; j < mesh->NumFaces(); j++)
+            {
+                unsigned int i1 = faces[3 * j];
+                unsigned int i2 = faces[3 * j + 1];
+                unsigned int i3 = faces[3 * j + 2];
+                Vec3 p1(ps[3 * i1], ps[3 * i1 + 1], ps[3 * i1 + 2]);
+                Vec3 p2(ps[3 * i2], ps[3 * i2 + 1], ps[3 * i2 + 2]);
+                Vec3 p3(ps[3 * i3], ps[3 * i3 + 1], ps[3 * i3 + 2]);
+                blas.triangles.push_back(TriAccelTriangle());
+                blas.triangles.back().faceIndex = j;
+                blas.triangles.back().primIndex = 0;
+                blas.triangles.back().Load(p1, p2, p3);
+
+                Bound bound;
+                bound = Math::Union(bound, p1);
+                bound = Math::Union(bound, p2);
+                bound = Math::Union(bound, p3);
+                bound.min -= Vec3(Math::Eps());
+                bound.max += Vec3(Math::Eps());
+                bounds.push_back(bound);
+            }
+
+            const int LeafNumNodes = 9;
+            blas.bvh.Build(bounds, LeafNumNodes);
+        });
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Build top-level BVH
+
+        {
+            // World space bounds of the instances
+            std::vector<Bound> bounds;
+            for (const auto& instance : instances_)
+            {
+                const auto& transform = scene->PrimitiveAt(instance.primIndex)->transform;
+                const auto localBound = blases_[instance.blasIndex].bvh.RootBound();
+                Bound bound;
+                for (int j = 0; j < 8; j++)
+                {
+                    const Vec4 corner(
+                        (j & 1) ? localBound.max.x : localBound.min.x,
+                        (j & 2) ? localBound.max.y : localBound.min.y,
+                        (j & 4) ? localBound.max.z : localBound.min.z,
+                        1_f);
+                    bound = Math::Union(bound, Vec3(transform * corner));
+                }
+                bounds.push_back(bound);
+            }
+
+            const int LeafNumNodes = 2;
+            tlas_.Build(bounds, LeafNumNodes);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        const auto buildEndTime = std::chrono::high_resolution_clock::now();
+        LM_LOG_INFO(boost::str(boost::format("Build time        : %.3fs") % ((double)(std::chrono::duration_cast<std::chrono::milliseconds>(buildEndTime - buildStartTime).count()) / 1000.0)));
+        LM_LOG_INFO(boost::str(boost::format("# of meshes       : %d") % blases_.size()));
+        LM_LOG_INFO(boost::str(boost::format("# of instances    : %d") % instances_.size()));
+
+        return true;
+    };
+
+    LM_IMPL_F(Intersect) = [this](const Scene* scene, const Ray& ray, Intersection& isect, Float minT, Float maxT) -> bool
+    {
+        int minInstance = -1;
+        int minFace = 0;
+        Vec2 minB;
+
+        const bool hit = tlas_.Traverse<false>(ray, minT, maxT, [&](int instanceIndex, Float& instanceMaxT) -> bool
+        {
+            const auto& instance = instances_[instanceIndex];
+            const auto& blas = blases_[instance.blasIndex];
+
+            // Transform the ray into the object space.
+            // The direction is not normalized so that the distances are unchanged.
+            Ray localRay;
+            localRay.o = Vec3(instance.invTransform * Vec4(ray.o.x, ray.o.y, ray.o.z, 1_f));
+            localRay.d = Vec3(instance.invTransform * Vec4(ray.d.x, ray.d.y, ray.d.z, 0_f));
+
+            return blas.bvh.Traverse<false>(localRay, minT, instanceMaxT, [&](int triIndex, Float& triMaxT) -> bool
+            {
+                Float t;
+                Vec2 b;
+                const auto& tri = blas.triangles[triIndex];
+                if (!tri.Intersect(localRay, minT, triMaxT, b[0], b[1], t))
+                {
+                    return false;
+                }
+
+                triMaxT = t;
+                minInstance = instanceIndex;
+                minFace = tri.faceIndex;
+                minB = b;
+                return true;
+            });
+        });
+
+        if (!hit)
+        {
+            return false;
+        }
+
+        isect = IntersectionUtils::CreateTriangleIntersection(
+            scene->PrimitiveAt(instances_[minInstance].primIndex),
+            ray.o + ray.d * maxT,
+            minB,
+            minFace);
+
+        return true;
+    };
+
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        return tlas_.Traverse<true>(ray, minT, maxT, [&](int instanceIndex, Float& instanceMaxT) -> bool
+        {
+            const auto& instance = instances_[instanceIndex];
+            const auto& blas = blases_[instance.blasIndex];
+
+            Ray localRay;
+            localRay.o = Vec3(instance.invTransform * Vec4(ray.o.x, ray.o.y, ray.o.z, 1_f));
+            localRay.d = Vec3(instance.invTransform * Vec4(ray.d.x, ray.d.y, ray.d.z, 0_f));
+
+            return blas.bvh.Traverse<true>(localRay, minT, instanceMaxT, [&](int triIndex, Float& triMaxT) -> bool
+            {
+                Float t;
+                Vec2 b;
+                return blas.triangles[triIndex].Intersect(localRay, minT, triMaxT, b[0], b[1], t);
+            });
+        });
+    };
+
+private:
+
+    // Bottom-level BVH for a triangle mesh
+    struct BLAS
+    {
+        TwoLevelBVH bvh;
+        std::vector<TriAccelTriangle> triangles;
+    };
+
+    // Instance of a triangle mesh
+    struct Instance
+    {
+        Mat4 invTransform;
+        int primIndex;
+        int blasIndex;
+    };
+
+    TwoLevelBVH tlas_;
+    std::vector<BLAS> blases_;
+    std::vector<Instance, aligned_allocator<Instance, 64>> instances_;      // Mat4 requires 32-byte alignment in AVX builds
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Accel_TwoLevel, "accel::twolevel");
+
+LM_NAMESPACE_END
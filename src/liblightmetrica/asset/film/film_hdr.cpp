@@ -27,7 +27,13 @@
 #include <lightmetrica/property.h>
 #include <lightmetrica/logger.h>
 #include <lightmetrica/enum.h>
+#include <lightmetrica/detail/filtertable.h>
+#include <lightmetrica/detail/tonemapper.h>
+#include <lightmetrica/detail/filmstorage.h>
+#include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/exrwriter.h>
 #include <FreeImage.h>
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -42,7 +48,29 @@ namespace
         LM_LOG_ERROR(message);
     }
 
-    bool SaveImage(const std::string& path, const std::vector<Vec3>& film, int width, int height)
+    // Process the rows of the image in parallel
+    template <typename Func>
+    auto ForEachRow(int height, const Func& func) -> void
+    {
+        Parallel::Execute([&]() -> void
+        {
+            tbb::parallel_for(tbb::blocked_range<int>(0, height), [&](const tbb::blocked_range<int>& range) -> void
+            {
+                for (int y = range.begin(); y != range.end(); y++)
+                {
+                    func(y);
+                }
+            });
+        });
+    }
+
+    /*
+        Save the image of `width` * `height` pixels whose values are given by `pixel(index)`.
+        The OpenEXR images are streamed to the file from the film without an intermediate image.
+        If `exrTileSize` is positive, the OpenEXR image is written as a tiled image.
+    */
+    template <typename PixelFunc>
+    bool SaveImage(const std::string& path, int width, int height, const ToneMapper& toneMapper, int exrTileSize, EXRCompression exrCompression, const PixelFunc& pixel)
     {
         FreeImage_SetOutputMessage(FreeImageErrorHandler);
 
@@ -71,9 +99,25 @@ namespace
 
         {
             boost::filesystem::path fsPath(path);
-            if (fsPath.extension() == ".hdr" || fsPath.extension() == ".exr")
+            if (fsPath.extension() == ".exr")
             {
-                #pragma region HDR
+                #pragma region OpenEXR
+
+                // The rows of the film are stored from the bottom
+                return EXRWriter::Save(path, width, height, { "R", "G", "B" }, [&](int y, int c, float* row) -> void
+                {
+                    const int offset = (height - 1 - y) * width;
+                    for (int x = 0; x < width; x++)
+                    {
+                        row[x] = (float)(Math::Max(pixel(offset + x)[c], 0_f));
+                    }
+                }, exrTileSize, exrCompression);
+
+                #pragma endregion
+            }
+            else if (fsPath.extension() == ".hdr")
+            {
+                #pragma region Radiance HDR
 
                 FIBITMAP* fibitmap = FreeImage_AllocateT(FIT_RGBF, width, height);
                 if (!fibitmap)
@@ -82,22 +126,19 @@ namespace
                     return false;
                 }
 
-                for (int y = 0; y < height; y++)
+                ForEachRow(height, [&](int y) -> void
                 {
                     FIRGBF* bits = (FIRGBF*)FreeImage_GetScanLine(fibitmap, y);
                     for (int x = 0; x < width; x++)
                     {
-                        const int i = y * width + x;
-                        //bits[x].red   = (float)(Math::Clamp(film[i][0], 0_f, 1_f));
-                        //bits[x].green = (float)(Math::Clamp(film[i][1], 0_f, 1_f));
-                        //bits[x].blue  = (float)(Math::Clamp(film[i][2], 0_f, 1_f));
-                        bits[x].red   = (float)(Math::Max(film[i][0], 0_f));
-                        bits[x].green = (float)(Math::Max(film[i][1], 0_f));
-                        bits[x].blue  = (float)(Math::Max(film[i][2], 0_f));
+                        const auto v = pixel(y * width + x);
+                        bits[x].red   = (float)(Math::Max(v[0], 0_f));
+                        bits[x].green = (float)(Math::Max(v[1], 0_f));
+                        bits[x].blue  = (float)(Math::Max(v[2], 0_f));
                     }
-                }
+                });
 
-                if (!FreeImage_Save(fsPath.extension() == ".hdr" ? FIF_HDR : FIF_EXR, fibitmap, path.c_str(), HDR_DEFAULT))
+                if (!FreeImage_Save(FIF_HDR, fibitmap, path.c_str(), HDR_DEFAULT))
                 {
                     LM_LOG_ERROR("Failed to save image : " + path);
                     FreeImage_Unload(fibitmap);
@@ -120,20 +161,20 @@ namespace
                     return false;
                 }
 
-                const double Exp = 1.0 / 2.2;
                 const int Bytespp = 3;
-                for (int y = 0; y < height; y++)
+                ForEachRow(height, [&](int y) -> void
                 {
                     BYTE* bits = FreeImage_GetScanLine(tonemappedBitmap, y);
                     for (int x = 0; x < width; x++)
                     {
-                        int idx = y * width + x;
-                        bits[FI_RGBA_RED]   = (BYTE)(Math::Clamp((int)(Math::Pow((double)(film[idx][0]), Exp) * 255_f), 0, 255));
-                        bits[FI_RGBA_GREEN] = (BYTE)(Math::Clamp((int)(Math::Pow((double)(film[idx][1]), Exp) * 255_f), 0, 255));
-                        bits[FI_RGBA_BLUE]  = (BYTE)(Math::Clamp((int)(Math::Pow((double)(film[idx][2]), Exp) * 255_f), 0, 255));
+                        BYTE rgb[3];
+                        toneMapper.Encode(pixel(y * width + x), rgb);
+                        bits[FI_RGBA_RED]   = rgb[0];
+                        bits[FI_RGBA_GREEN] = rgb[1];
+                        bits[FI_RGBA_BLUE]  = rgb[2];
                         bits += Bytespp;
                     }
-                }
+                });
 
                 if (!FreeImage_Save(FIF_PNG, tonemappedBitmap, path.c_str(), PNG_DEFAULT))
                 {
@@ -178,6 +219,44 @@ const std::string HDRImageType_String[] =
 
 LM_ENUM_TYPE_MAP(HDRImageType);
 
+namespace
+{
+    // Loads the reconstruction filter of the film
+    auto LoadFilter(const PropertyNode* prop, FilterTable& filter) -> bool
+    {
+        const auto type = prop->ChildAs<std::string>("filter", "box");
+        if (!filter.Initialize(type, prop->ChildAs<Float>("filter_radius", 0_f)))
+        {
+            LM_LOG_ERROR("Invalid filter type '" + type + "'");
+            return false;
+        }
+        return true;
+    }
+
+    // Loads the tone mapping applied to the 8-bit images
+    auto LoadToneMapper(const PropertyNode* prop, ToneMapper& toneMapper) -> bool
+    {
+        const auto type = prop->ChildAs<std::string>("tonemap", "none");
+        if (!toneMapper.Initialize(type, prop->ChildAs<Float>("exposure", 1_f), prop->ChildAs<Float>("gamma", 2.2_f)))
+        {
+            LM_LOG_ERROR("Invalid tone mapping operator '" + type + "'");
+            return false;
+        }
+        return true;
+    }
+}
+
+/*
+    HDR film.
+    The contributions are splatted with the reconstruction filter given by `filter`
+    (box, gaussian, mitchell, or blackmanharris) of the radius `filter_radius` in pixels.
+    The default box filter accumulates the contribution to the single pixel.
+    The PNG images are tone mapped with `tonemap` (none or reinhard), `exposure`, and `gamma`.
+    The OpenEXR images are streamed from the film, written as tiled images if `exr_tile_size` is positive,
+    and compressed with `exr_compression` (none, zips, or zip). The pixels are written in 32-bit float
+    with the lossless ZIP compression by default, where the former versions wrote 16-bit half with PIZ.
+    The pixels are stored as `storage` (native, float, or kahan) independent of the precision of `Float`.
+*/
 class Film_HDR final : public Film
 {
 public:
@@ -191,7 +270,16 @@ public:
         if (!prop->ChildAs<int>("w", width_)) return false;
         if (!prop->ChildAs<int>("h", height_)) return false;
         type_ = LM_STRING_TO_ENUM(HDRImageType, prop->ChildAs<std::string>("type", "radiancehdr"));
-        data_.assign(width_ * height_, Vec3());
+        if (!LoadFilter(prop, filter_)) return false;
+        if (!LoadToneMapper(prop, toneMapper_)) return false;
+        exrTileSize_ = prop->ChildAs<int>("exr_tile_size", 0);
+        exrCompression_ = LM_STRING_TO_ENUM(EXRCompression, prop->ChildAs<std::string>("exr_compression", "zip"));
+        const auto storage = prop->ChildAs<std::string>("storage", "native");
+        if (!data_.Initialize(storage, width_ * height_))
+        {
+            LM_LOG_ERROR("Invalid storage type '" + storage + "'");
+            return false;
+        }
         return true;
     };
 
@@ -200,6 +288,11 @@ public:
         auto* film = static_cast<Film_HDR*>(o);
         film->width_ = width_;
         film->height_ = height_;
+        film->type_ = type_;
+        film->filter_ = filter_;
+        film->toneMapper_ = toneMapper_;
+        film->exrTileSize_ = exrTileSize_;
+        film->exrCompression_ = exrCompression_;
         film->data_ = data_;
     };
 
@@ -215,9 +308,19 @@ public:
 
     LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
     {
+        if (!filter_.IsBox())
+        {
+            const auto rgb = v.ToRGB();
+            filter_.Footprint(rasterPos, width_, height_, [&](int i, Float w) -> void
+            {
+                data_.Add(i, rgb * w);
+            });
+            return;
+        }
+
         const int pX = Math::Clamp((int)(rasterPos.x * Float(width_)), 0, width_ - 1);
         const int pY = Math::Clamp((int)(rasterPos.y * Float(height_)), 0, height_ - 1);
-        data_[pY * width_ + pX] += v.ToRGB();
+        data_.Add(pY * width_ + pX, v.ToRGB());
     };
 
     LM_IMPL_F(SetPixel) = [this](int x, int y, const SPD& v) -> void
@@ -231,7 +334,23 @@ public:
         #endif
 
         // Convert to RGB and record to data
-        data_[y * width_ + x] = v.ToRGB();
+        data_.Set(y * width_ + x, v.ToRGB());
+    };
+
+    LM_IMPL_F(SplatBlock) = [this](int x, int y, int w, int h, Vec3* block, const Vec2& rasterPos, const SPD& v) -> bool
+    {
+        return filter_.SplatBlock(rasterPos, v.ToRGB(), width_, height_, x, y, w, h, block);
+    };
+
+    LM_IMPL_F(AccumulateBlock) = [this](int x, int y, int w, int h, const Vec3* block) -> void
+    {
+        for (int by = 0; by < h; by++)
+        {
+            for (int bx = 0; bx < w; bx++)
+            {
+                data_.Add((y + by) * width_ + (x + bx), block[by * w + bx]);
+            }
+        }
     };
 
     LM_IMPL_F(Save) = [this](const std::string& path) -> bool
@@ -257,7 +376,7 @@ public:
             }
         }
 
-        return SaveImage(p.string(), data_, width_, height_);
+        return SaveImage(p.string(), width_, height_, toneMapper_, exrTileSize_, exrCompression_, [this](int i) -> Vec3 { return data_.Get(i); });
         #endif
 
         auto p = path;
@@ -274,7 +393,7 @@ public:
             p += ".png";
         }
 
-        return SaveImage(p, data_, width_, height_);
+        return SaveImage(p, width_, height_, toneMapper_, exrTileSize_, exrCompression_, [this](int i) -> Vec3 { return data_.Get(i); });
     };
 
     LM_IMPL_F(Accumulate) = [this](const Film* film_) -> void
@@ -282,17 +401,17 @@ public:
         assert(implName == film_->implName);                            // Internal type must be same
         const auto* film = static_cast<const Film_HDR*>(film_);
         assert(width_ == film->width_ && height_ == film->height_);     // Image size must be same
-        std::transform(data_.begin(), data_.end(), film->data_.begin(), data_.begin(), std::plus<Vec3>());
+        data_.Accumulate(film->data_);
     };
 
     LM_IMPL_F(Rescale) = [this](Float w) -> void
     {
-        for (auto& v : data_) { v *= w; }
+        data_.Scale(w);
     };
 
     LM_IMPL_F(Clear) = [this]() -> void
     {
-        data_.assign(width_ * height_, Vec3());
+        data_.Clear();
     };
 
     LM_IMPL_F(PixelIndex) = [this](const Vec2& rasterPos) -> int
@@ -302,15 +421,313 @@ public:
         return pY * width_ + pX;
     };
 
+    LM_IMPL_F(Serialize) = [this](std::ostream& stream) -> bool
+    {
+        stream.write(reinterpret_cast<const char*>(&width_), sizeof(int));
+        stream.write(reinterpret_cast<const char*>(&height_), sizeof(int));
+        // The values are written in `Float` regardless of the storage type
+        for (int i = 0; i < width_ * height_; i++)
+        {
+            const auto v = data_.Get(i);
+            for (int j = 0; j < 3; j++)
+            {
+                const Float c = v[j];
+                stream.write(reinterpret_cast<const char*>(&c), sizeof(Float));
+            }
+        }
+        return !stream.fail();
+    };
+
+    LM_IMPL_F(Deserialize) = [this](std::istream& stream) -> bool
+    {
+        int w, h;
+        stream.read(reinterpret_cast<char*>(&w), sizeof(int));
+        stream.read(reinterpret_cast<char*>(&h), sizeof(int));
+        if (stream.fail() || w != width_ || h != height_)
+        {
+            LM_LOG_ERROR("Invalid film size");
+            return false;
+        }
+        for (int i = 0; i < width_ * height_; i++)
+        {
+            Vec3 v;
+            for (int j = 0; j < 3; j++)
+            {
+                stream.read(reinterpret_cast<char*>(&v[j]), sizeof(Float));
+            }
+            data_.Set(i, v);
+        }
+        return !stream.fail();
+    };
+
 private:
 
     int width_;
     int height_;
     HDRImageType type_ = HDRImageType::RadianceHDR;
-    std::vector<Vec3> data_;
+    FilterTable filter_;
+    ToneMapper toneMapper_;
+    int exrTileSize_ = 0;                               // Tile size of OpenEXR images (0: scanline)
+    EXRCompression exrCompression_ = EXRCompression::ZIP;  // Compression of OpenEXR images
+    FilmStorage data_;                                  // Pixel values
     
 };
 
 LM_COMPONENT_REGISTER_IMPL(Film_HDR, "film::hdr");
 
+// --------------------------------------------------------------------------------
+
+/*
+    HDR film supporting concurrent splats.
+    The pixel values are stored in atomic variables and updated with CAS loops,
+    so that all threads can share one film instead of cloning the film per thread.
+    Useful for the renderers splatting to arbitrary raster positions (e.g., LT, BDPT).
+*/
+class Film_HDR_Atomic final : public Film
+{
+public:
+
+    LM_IMPL_CLASS(Film_HDR_Atomic, Film);
+
+public:
+
+    LM_IMPL_F(Load) = [this](const PropertyNode* prop, Assets* assets, const Primitive* primitive) -> bool
+    {
+        if (!prop->ChildAs<int>("w", width_)) return false;
+        if (!prop->ChildAs<int>("h", height_)) return false;
+        type_ = LM_STRING_TO_ENUM(HDRImageType, prop->ChildAs<std::string>("type", "radiancehdr"));
+        if (!LoadFilter(prop, filter_)) return false;
+        if (!LoadToneMapper(prop, toneMapper_)) return false;
+        exrTileSize_ = prop->ChildAs<int>("exr_tile_size", 0);
+        exrCompression_ = LM_STRING_TO_ENUM(EXRCompression, prop->ChildAs<std::string>("exr_compression", "zip"));
+        Allocate();
+        return true;
+    };
+
+    LM_IMPL_F(Clone) = [this](Clonable* o) -> void
+    {
+        auto* film = static_cast<Film_HDR_Atomic*>(o);
+        film->width_ = width_;
+        film->height_ = height_;
+        film->type_ = type_;
+        film->filter_ = filter_;
+        film->toneMapper_ = toneMapper_;
+        film->exrTileSize_ = exrTileSize_;
+        film->exrCompression_ = exrCompression_;
+        film->Allocate();
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            film->data_[i].store(data_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    };
+
+    LM_IMPL_F(Width) = [this]() -> int
+    {
+        return width_;
+    };
+
+    LM_IMPL_F(Height) = [this]() -> int
+    {
+        return height_;
+    };
+
+    LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
+    {
+        const auto rgb = v.ToRGB();
+        if (!filter_.IsBox())
+        {
+            filter_.Footprint(rasterPos, width_, height_, [&](int pixel, Float w) -> void
+            {
+                auto* p = &data_[3 * pixel];
+                for (int i = 0; i < 3; i++)
+                {
+                    if (rgb[i] != 0_f)
+                    {
+                        AtomicAdd(p[i], rgb[i] * w);
+                    }
+                }
+            });
+            return;
+        }
+
+        const int pX = Math::Clamp((int)(rasterPos.x * Float(width_)), 0, width_ - 1);
+        const int pY = Math::Clamp((int)(rasterPos.y * Float(height_)), 0, height_ - 1);
+        auto* p = &data_[3 * (pY * width_ + pX)];
+        for (int i = 0; i < 3; i++)
+        {
+            if (rgb[i] != 0_f)
+            {
+                AtomicAdd(p[i], rgb[i]);
+            }
+        }
+    };
+
+    LM_IMPL_F(SetPixel) = [this](int x, int y, const SPD& v) -> void
+    {
+        #if LM_DEBUG_MODE
+        if (x < 0 || width_ <= x || y < 0 || height_ <= y)
+        {
+            LM_LOG_ERROR("Out of range");
+            return;
+        }
+        #endif
+
+        const auto rgb = v.ToRGB();
+        auto* p = &data_[3 * (y * width_ + x)];
+        for (int i = 0; i < 3; i++)
+        {
+            p[i].store(rgb[i], std::memory_order_relaxed);
+        }
+    };
+
+    LM_IMPL_F(SplatBlock) = [this](int x, int y, int w, int h, Vec3* block, const Vec2& rasterPos, const SPD& v) -> bool
+    {
+        return filter_.SplatBlock(rasterPos, v.ToRGB(), width_, height_, x, y, w, h, block);
+    };
+
+    LM_IMPL_F(AccumulateBlock) = [this](int x, int y, int w, int h, const Vec3* block) -> void
+    {
+        for (int by = 0; by < h; by++)
+        {
+            for (int bx = 0; bx < w; bx++)
+            {
+                const auto& rgb = block[by * w + bx];
+                auto* p = &data_[3 * ((y + by) * width_ + (x + bx))];
+                for (int i = 0; i < 3; i++)
+                {
+                    if (rgb[i] != 0_f)
+                    {
+                        AtomicAdd(p[i], rgb[i]);
+                    }
+                }
+            }
+        }
+    };
+
+    LM_IMPL_F(Save) = [this](const std::string& path) -> bool
+    {
+        auto p = path;
+        if (type_ == HDRImageType::RadianceHDR)
+        {
+            p += ".hdr";
+        }
+        else if (type_ == HDRImageType::OpenEXR)
+        {
+            p += ".exr";
+        }
+        else if (type_ == HDRImageType::PNG)
+        {
+            p += ".png";
+        }
+
+        // Read the pixels directly from the atomic variables without copying the image
+        return SaveImage(p, width_, height_, toneMapper_, exrTileSize_, exrCompression_, [this](int i) -> Vec3
+        {
+            return Vec3(data_[3 * i].load(), data_[3 * i + 1].load(), data_[3 * i + 2].load());
+        });
+    };
+
+    LM_IMPL_F(Accumulate) = [this](const Film* film_) -> void
+    {
+        assert(implName == film_->implName);                            // Internal type must be same
+        const auto* film = static_cast<const Film_HDR_Atomic*>(film_);
+        assert(width_ == film->width_ && height_ == film->height_);     // Image size must be same
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            AtomicAdd(data_[i], film->data_[i].load(std::memory_order_relaxed));
+        }
+    };
+
+    LM_IMPL_F(Rescale) = [this](Float w) -> void
+    {
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            data_[i].store(data_[i].load(std::memory_order_relaxed) * w, std::memory_order_relaxed);
+        }
+    };
+
+    LM_IMPL_F(Clear) = [this]() -> void
+    {
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            data_[i].store(0_f, std::memory_order_relaxed);
+        }
+    };
+
+    LM_IMPL_F(PixelIndex) = [this](const Vec2& rasterPos) -> int
+    {
+        const int pX = Math::Clamp((int)(rasterPos.x * Float(width_)), 0, width_ - 1);
+        const int pY = Math::Clamp((int)(rasterPos.y * Float(height_)), 0, height_ - 1);
+        return pY * width_ + pX;
+    };
+
+    LM_IMPL_F(SupportsConcurrentSplat) = [this]() -> bool
+    {
+        return true;
+    };
+
+    LM_IMPL_F(Serialize) = [this](std::ostream& stream) -> bool
+    {
+        stream.write(reinterpret_cast<const char*>(&width_), sizeof(int));
+        stream.write(reinterpret_cast<const char*>(&height_), sizeof(int));
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            const Float v = data_[i].load(std::memory_order_relaxed);
+            stream.write(reinterpret_cast<const char*>(&v), sizeof(Float));
+        }
+        return !stream.fail();
+    };
+
+    LM_IMPL_F(Deserialize) = [this](std::istream& stream) -> bool
+    {
+        int w, h;
+        stream.read(reinterpret_cast<char*>(&w), sizeof(int));
+        stream.read(reinterpret_cast<char*>(&h), sizeof(int));
+        if (stream.fail() || w != width_ || h != height_)
+        {
+            LM_LOG_ERROR("Invalid film size");
+            return false;
+        }
+        for (int i = 0; i < 3 * width_ * height_; i++)
+        {
+            Float v;
+            stream.read(reinterpret_cast<char*>(&v), sizeof(Float));
+            data_[i].store(v, std::memory_order_relaxed);
+        }
+        return !stream.fail();
+    };
+
+private:
+
+    auto Allocate() -> void
+    {
+        const int n = 3 * width_ * height_;
+        data_.reset(new std::atomic<Float>[n]);
+        for (int i = 0; i < n; i++)
+        {
+            data_[i].store(0_f, std::memory_order_relaxed);
+        }
+    }
+
+    static auto AtomicAdd(std::atomic<Float>& a, Float v) -> void
+    {
+        auto old = a.load(std::memory_order_relaxed);
+        while (!a.compare_exchange_weak(old, old + v, std::memory_order_relaxed));
+    }
+
+private:
+
+    int width_;
+    int height_;
+    HDRImageType type_ = HDRImageType::RadianceHDR;
+    FilterTable filter_;
+    ToneMapper toneMapper_;
+    int exrTileSize_ = 0;                               // Tile size of OpenEXR images (0: scanline)
+    EXRCompression exrCompression_ = EXRCompression::ZIP;  // Compression of OpenEXR images
+    std::unique_ptr<std::atomic<Float>[]> data_;        // RGB values of the pixels
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Film_HDR_Atomic, "film::hdr_atomic");
+
 LM_NAMESPACE_END
@@ -0,0 +1,300 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/detail/filtertable.h>
+#include <lightmetrica/detail/exrwriter.h>
+
+LM_NAMESPACE_BEGIN
+
+/*
+    Multi-layer film.
+    Records the auxiliary layers (albedo, normal, depth, and primitive ID of the first hit)
+    given by `SplatLayer` in addition to the rendered image, so that the layers
+    for compositing or denoising are obtained in the same pass as the rendering.
+    The image and the layers are saved as a multi-channel OpenEXR image,
+    which is written as a tiled image if `exr_tile_size` is positive
+    and compressed with `exr_compression` (none, zips, or zip; zip by default).
+    The reconstruction filter (`filter`, `filter_radius`) is applied only to the rendered image.
+    The layers except for the primitive IDs are averaged over the samples recorded in each pixel,
+    thus they are independent of the scale given by `Rescale`.
+*/
+class Film_MultiLayer final : public Film
+{
+public:
+
+    LM_IMPL_CLASS(Film_MultiLayer, Film);
+
+public:
+
+    LM_IMPL_F(Load) = [this](const PropertyNode* prop, Assets* assets, const Primitive* primitive) -> bool
+    {
+        if (!prop->ChildAs<int>("w", width_)) return false;
+        if (!prop->ChildAs<int>("h", height_)) return false;
+        const auto filterType = prop->ChildAs<std::string>("filter", "box");
+        if (!filter_.Initialize(filterType, prop->ChildAs<Float>("filter_radius", 0_f)))
+        {
+            LM_LOG_ERROR("Invalid filter type '" + filterType + "'");
+            return false;
+        }
+        exrTileSize_ = prop->ChildAs<int>("exr_tile_size", 0);
+        exrCompression_ = LM_STRING_TO_ENUM(EXRCompression, prop->ChildAs<std::string>("exr_compression", "zip"));
+        Clear();
+        return true;
+    };
+
+    LM_IMPL_F(Clone) = [this](Clonable* o) -> void
+    {
+        auto* film = static_cast<Film_MultiLayer*>(o);
+        film->width_ = width_;
+        film->height_ = height_;
+        film->filter_ = filter_;
+        film->exrTileSize_ = exrTileSize_;
+        film->exrCompression_ = exrCompression_;
+        film->data_ = data_;
+        for (int i = 0; i < FilmLayer::NumLayers; i++)
+        {
+            film->layers_[i] = layers_[i];
+            film->counts_[i] = counts_[i];
+        }
+    };
+
+    LM_IMPL_F(Width) = [this]() -> int
+    {
+        return width_;
+    };
+
+    LM_IMPL_F(Height) = [this]() -> int
+    {
+        return height_;
+    };
+
+    LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
+    {
+        if (!filter_.IsBox())
+        {
+            const auto rgb = v.ToRGB();
+            filter_.Footprint(rasterPos, width_, height_, [&](int i, Float w) -> void
+            {
+                data_[i] += rgb * w;
+            });
+            return;
+        }
+
+        data_[PixelIndex(rasterPos)] += v.ToRGB();
+    };
+
+    LM_IMPL_F(SplatLayer) = [this](int layer, const Vec2& rasterPos, const Vec3& v) -> void
+    {
+        const int i = PixelIndex(rasterPos);
+        if (layer == FilmLayer::PrimitiveID)
+        {
+            layers_[layer][i] = v;
+            return;
+        }
+        layers_[layer][i] += v;
+        counts_[layer][i] += 1_f;
+    };
+
+    LM_IMPL_F(SetPixel) = [this](int x, int y, const SPD& v) -> void
+    {
+        data_[y * width_ + x] = v.ToRGB();
+    };
+
+    LM_IMPL_F(SplatBlock) = [this](int x, int y, int w, int h, Vec3* block, const Vec2& rasterPos, const SPD& v) -> bool
+    {
+        return filter_.SplatBlock(rasterPos, v.ToRGB(), width_, height_, x, y, w, h, block);
+    };
+
+    LM_IMPL_F(AccumulateBlock) = [this](int x, int y, int w, int h, const Vec3* block) -> void
+    {
+        for (int by = 0; by < h; by++)
+        {
+            std::transform(block + by * w, block + (by + 1) * w, data_.begin() + (y + by) * width_ + x, data_.begin() + (y + by) * width_ + x, std::plus<Vec3>());
+        }
+    };
+
+    LM_IMPL_F(Save) = [this](const std::string& path) -> bool
+    {
+        // Channels of the image and the layers.
+        // `layer` is -1 for the rendered image.
+        struct Channel
+        {
+            std::string name;
+            int layer;
+            int component;
+        };
+        const std::vector<Channel> channels =
+        {
+            { "R", -1, 0 }, { "G", -1, 1 }, { "B", -1, 2 },
+            { "albedo.R", FilmLayer::Albedo, 0 }, { "albedo.G", FilmLayer::Albedo, 1 }, { "albedo.B", FilmLayer::Albedo, 2 },
+            { "normal.X", FilmLayer::Normal, 0 }, { "normal.Y", FilmLayer::Normal, 1 }, { "normal.Z", FilmLayer::Normal, 2 },
+            { "depth.Z", FilmLayer::Depth, 0 },
+            { "id.V", FilmLayer::PrimitiveID, 0 },
+        };
+        std::vector<std::string> channelNames;
+        for (const auto& channel : channels) { channelNames.push_back(channel.name); }
+
+        // The rows of the film are stored from the bottom
+        return EXRWriter::Save(path + ".exr", width_, height_, channelNames, [&](int y, int c, float* row) -> void
+        {
+            const auto& channel = channels[c];
+            const int offset = (height_ - 1 - y) * width_;
+            for (int x = 0; x < width_; x++)
+            {
+                const int i = offset + x;
+                if (channel.layer < 0)
+                {
+                    row[x] = (float)(data_[i][channel.component]);
+                }
+                else
+                {
+                    const Float count = counts_[channel.layer][i];
+                    const Float v = layers_[channel.layer][i][channel.component];
+                    row[x] = (float)(channel.layer == FilmLayer::PrimitiveID ? v : count > 0_f ? v / count : 0_f);
+                }
+            }
+        }, exrTileSize_, exrCompression_);
+    };
+
+    LM_IMPL_F(Accumulate) = [this](const Film* film_) -> void
+    {
+        assert(implName == film_->implName);                            // Internal type must be same
+        const auto* film = static_cast<const Film_MultiLayer*>(film_);
+        assert(width_ == film->width_ && height_ == film->height_);     // Image size must be same
+        std::transform(data_.begin(), data_.end(), film->data_.begin(), data_.begin(), std::plus<Vec3>());
+        for (int i = 0; i < FilmLayer::NumLayers; i++)
+        {
+            if (i == FilmLayer::PrimitiveID)
+            {
+                // Take the IDs recorded by the other film
+                std::transform(layers_[i].begin(), layers_[i].end(), film->layers_[i].begin(), layers_[i].begin(), [](const Vec3& v1, const Vec3& v2) { return v2.x != 0_f ? v2 : v1; });
+                continue;
+            }
+            std::transform(layers_[i].begin(), layers_[i].end(), film->layers_[i].begin(), layers_[i].begin(), std::plus<Vec3>());
+            std::transform(counts_[i].begin(), counts_[i].end(), film->counts_[i].begin(), counts_[i].begin(), std::plus<Float>());
+        }
+    };
+
+    LM_IMPL_F(Rescale) = [this](Float w) -> void
+    {
+        // The layers are normalized by the sample counts on save
+        for (auto& v : data_) { v *= w; }
+    };
+
+    LM_IMPL_F(Clear) = [this]() -> void
+    {
+        data_.assign(width_ * height_, Vec3());
+        for (int i = 0; i < FilmLayer::NumLayers; i++)
+        {
+            layers_[i].assign(width_ * height_, Vec3());
+            counts_[i].assign(width_ * height_, 0_f);
+        }
+    };
+
+    LM_IMPL_F(PixelIndex) = [this](const Vec2& rasterPos) -> int
+    {
+        const int pX = Math::Clamp((int)(rasterPos.x * Float(width_)), 0, width_ - 1);
+        const int pY = Math::Clamp((int)(rasterPos.y * Float(height_)), 0, height_ - 1);
+        return pY * width_ + pX;
+    };
+
+    LM_IMPL_F(Serialize) = [this](std::ostream& stream) -> bool
+    {
+        stream.write(reinterpret_cast<const char*>(&width_), sizeof(int));
+        stream.write(reinterpret_cast<const char*>(&height_), sizeof(int));
+        const auto WriteData = [&](const std::vector<Vec3>& data) -> void
+        {
+            for (const auto& v : data)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    const Float c = v[i];
+                    stream.write(reinterpret_cast<const char*>(&c), sizeof(Float));
+                }
+            }
+        };
+        WriteData(data_);
+        for (const auto& layer : layers_)
+        {
+            WriteData(layer);
+        }
+        for (const auto& count : counts_)
+        {
+            stream.write(reinterpret_cast<const char*>(count.data()), sizeof(Float) * count.size());
+        }
+        return !stream.fail();
+    };
+
+    LM_IMPL_F(Deserialize) = [this](std::istream& stream) -> bool
+    {
+        int w, h;
+        stream.read(reinterpret_cast<char*>(&w), sizeof(int));
+        stream.read(reinterpret_cast<char*>(&h), sizeof(int));
+        if (stream.fail() || w != width_ || h != height_)
+        {
+            LM_LOG_ERROR("Invalid film size");
+            return false;
+        }
+        const auto ReadData = [&](std::vector<Vec3>& data) -> void
+        {
+            for (auto& v : data)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    stream.read(reinterpret_cast<char*>(&v[i]), sizeof(Float));
+                }
+            }
+        };
+        ReadData(data_);
+        for (auto& layer : layers_)
+        {
+            ReadData(layer);
+        }
+        for (auto& count : counts_)
+        {
+            stream.read(reinterpret_cast<char*>(count.data()), sizeof(Float) * count.size());
+        }
+        return !stream.fail();
+    };
+
+private:
+
+    int width_;
+    int height_;
+    FilterTable filter_;
+    int exrTileSize_;                                       // Tile size of the OpenEXR image (0: scanline)
+    EXRCompression exrCompression_;                         // Compression of the OpenEXR image
+    std::vector<Vec3> data_;                                // Rendered image
+    std::vector<Vec3> layers_[FilmLayer::NumLayers];        // Auxiliary layers
+    std::vector<Float> counts_[FilmLayer::NumLayers];       // Number of samples recorded in each pixel of the layers
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Film_MultiLayer, "film::multilayer");
+
+LM_NAMESPACE_END
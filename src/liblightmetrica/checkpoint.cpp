@@ -0,0 +1,168 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/detail/checkpoint.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/math.h>
+
+LM_NAMESPACE_BEGIN
+
+namespace
+{
+    // Header of the checkpoint file
+    const char Magic[4] = { 'L', 'M', 'C', 'P' };
+    const unsigned int FileVersion = 1;
+}
+
+class CheckpointImpl
+{
+private:
+
+    static std::unique_ptr<CheckpointImpl> instance_;
+
+public:
+
+    static CheckpointImpl* Instance()
+    {
+        if (!instance_) instance_.reset(new CheckpointImpl);
+        return instance_.get();
+    }
+
+public:
+
+    std::string path_;
+    double interval_ = -1;
+    bool resume_ = false;
+
+public:
+
+    auto Save(const std::string& tag, const std::function<bool(std::ostream& out)>& writeFunc) const -> bool
+    {
+        // Write to a temporary file in the same directory
+        const boost::filesystem::path path(path_);
+        const auto tmpPath = boost::filesystem::unique_path(path.string() + ".%%%%-%%%%.tmp");
+        {
+            std::ofstream out(tmpPath.string(), std::ios::out | std::ios::binary);
+            if (!out)
+            {
+                LM_LOG_ERROR("Failed to open checkpoint file: " + tmpPath.string());
+                return false;
+            }
+
+            // Header
+            out.write(Magic, sizeof(Magic));
+            Checkpoint::Write(out, FileVersion);
+            Checkpoint::Write(out, (unsigned int)(sizeof(Float)));
+            Checkpoint::Write(out, (unsigned int)(tag.size()));
+            out.write(tag.data(), tag.size());
+
+            // Content
+            if (!writeFunc(out) || !out)
+            {
+                LM_LOG_ERROR("Failed to write checkpoint: " + tmpPath.string());
+                out.close();
+                boost::filesystem::remove(tmpPath);
+                return false;
+            }
+        }
+
+        // Replace the previous checkpoint
+        boost::system::error_code ec;
+        boost::filesystem::rename(tmpPath, path, ec);
+        if (ec)
+        {
+            LM_LOG_ERROR("Failed to rename checkpoint file: " + ec.message());
+            boost::filesystem::remove(tmpPath);
+            return false;
+        }
+
+        return true;
+    }
+
+    auto Load(const std::string& tag, const std::function<bool(std::istream& in)>& readFunc) const -> bool
+    {
+        std::ifstream in(path_, std::ios::in | std::ios::binary);
+        if (!in)
+        {
+            LM_LOG_ERROR("Failed to open checkpoint file: " + path_);
+            return false;
+        }
+
+        // Check header
+        char magic[4];
+        unsigned int version, floatSize, tagSize;
+        in.read(magic, sizeof(magic));
+        if (!in || !std::equal(magic, magic + 4, Magic) || !Checkpoint::Read(in, version) || version != FileVersion)
+        {
+            LM_LOG_ERROR("Invalid checkpoint file: " + path_);
+            return false;
+        }
+        if (!Checkpoint::Read(in, floatSize) || floatSize != sizeof(Float))
+        {
+            LM_LOG_ERROR("Checkpoint was written with different floating-point precision");
+            return false;
+        }
+        if (!Checkpoint::Read(in, tagSize))
+        {
+            LM_LOG_ERROR("Invalid checkpoint file: " + path_);
+            return false;
+        }
+        std::string fileTag(tagSize, '\0');
+        in.read(&fileTag[0], tagSize);
+        if (!in || fileTag != tag)
+        {
+            LM_LOG_ERROR("Checkpoint was written by different component");
+            LM_LOG_INDENTER();
+            LM_LOG_ERROR("Expected: " + tag);
+            LM_LOG_ERROR("Actual  : " + fileTag);
+            return false;
+        }
+
+        // Content
+        if (!readFunc(in))
+        {
+            LM_LOG_ERROR("Failed to read checkpoint: " + path_);
+            return false;
+        }
+
+        return true;
+    }
+
+};
+
+std::unique_ptr<CheckpointImpl> CheckpointImpl::instance_;
+
+// --------------------------------------------------------------------------------
+
+auto Checkpoint::SetPath(const std::string& path) -> void { CheckpointImpl::Instance()->path_ = path; }
+auto Checkpoint::GetPath() -> std::string { return CheckpointImpl::Instance()->path_; }
+auto Checkpoint::SetInterval(double interval) -> void { CheckpointImpl::Instance()->interval_ = interval; }
+auto Checkpoint::GetInterval() -> double { return CheckpointImpl::Instance()->interval_; }
+auto Checkpoint::SetResume(bool resume) -> void { CheckpointImpl::Instance()->resume_ = resume; }
+auto Checkpoint::GetResume() -> bool { return CheckpointImpl::Instance()->resume_; }
+auto Checkpoint::Save(const std::string& tag, const std::function<bool(std::ostream& out)>& writeFunc) -> bool { return CheckpointImpl::Instance()->Save(tag, writeFunc); }
+auto Checkpoint::Load(const std::string& tag, const std::function<bool(std::istream& in)>& readFunc) -> bool { return CheckpointImpl::Instance()->Load(tag, readFunc); }
+
+LM_NAMESPACE_END
@@ -0,0 +1,314 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/detail/exrwriter.h>
+#include <lightmetrica/logger.h>
+#include <zlib.h>
+
+LM_NAMESPACE_BEGIN
+
+namespace
+{
+    // Little-endian writers of the primitive types
+    template <typename T>
+    auto Write(std::ostream& out, T v) -> void
+    {
+        out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    auto WriteString(std::ostream& out, const std::string& s) -> void
+    {
+        out.write(s.c_str(), s.size() + 1);
+    }
+
+    // Writes the header of an attribute
+    auto WriteAttribute(std::ostream& out, const std::string& name, const std::string& type, int size) -> void
+    {
+        WriteString(out, name);
+        WriteString(out, type);
+        Write<std::int32_t>(out, size);
+    }
+
+    // Compresses the data of a chunk with the ZIP compression of OpenEXR,
+    // that is, zlib after splitting the bytes into the even and odd ones and applying the delta predictor.
+    // Returns false if the data is not compressible, where the chunk must be stored without compression.
+    auto CompressZIP(const std::vector<char>& data, std::vector<char>& tmp, std::vector<char>& compressed) -> bool
+    {
+        const size_t n = data.size();
+        tmp.resize(n);
+        {
+            char* t1 = tmp.data();
+            char* t2 = tmp.data() + (n + 1) / 2;
+            for (size_t i = 0; i < n; i++)
+            {
+                *((i & 1) == 0 ? t1++ : t2++) = data[i];
+            }
+        }
+        {
+            auto* t = reinterpret_cast<unsigned char*>(tmp.data());
+            int p = n > 0 ? t[0] : 0;
+            for (size_t i = 1; i < n; i++)
+            {
+                const int d = int(t[i]) - p + (128 + 256);
+                p = t[i];
+                t[i] = (unsigned char)(d);
+            }
+        }
+
+        uLongf size = compressBound((uLong)(n));
+        compressed.resize(size);
+        if (compress(reinterpret_cast<Bytef*>(compressed.data()), &size, reinterpret_cast<const Bytef*>(tmp.data()), (uLong)(n)) != Z_OK || size >= n)
+        {
+            return false;
+        }
+        compressed.resize(size);
+        return true;
+    }
+}
+
+auto EXRWriter::Save(const std::string& path, int width, int height, const std::vector<std::string>& channelNames, const std::function<void(int y, int channel, float* row)>& rowFunc, int tileSize, EXRCompression compression) -> bool
+{
+    #pragma region Check & create output directory
+
+    {
+        const auto parent = boost::filesystem::path(path).parent_path();
+        if (!boost::filesystem::exists(parent) && parent != "")
+        {
+            LM_LOG_INFO("Creating directory : " + parent.string());
+            if (!boost::filesystem::create_directories(parent))
+            {
+                LM_LOG_WARN("Failed to create output directory : " + parent.string());
+                return false;
+            }
+        }
+    }
+
+    #pragma endregion
+
+    // --------------------------------------------------------------------------------
+
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    if (!out)
+    {
+        LM_LOG_ERROR("Failed to open file : " + path);
+        return false;
+    }
+
+    // The channels must be sorted by the names
+    std::vector<int> order(channelNames.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return channelNames[a] < channelNames[b]; });
+
+    // --------------------------------------------------------------------------------
+
+    #pragma region Header
+
+    // Magic number and version 2 (single-part scanline or tiled image)
+    const bool tiled = tileSize > 0;
+    Write<std::int32_t>(out, 20000630);
+    Write<std::int32_t>(out, tiled ? 2 | 0x200 : 2);
+
+    {
+        int size = 1;
+        for (const auto& name : channelNames) size += (int)(name.size()) + 1 + 16;
+        WriteAttribute(out, "channels", "chlist", size);
+        for (int c : order)
+        {
+            WriteString(out, channelNames[c]);
+            Write<std::int32_t>(out, 2);        // FLOAT
+            Write<std::uint8_t>(out, 0);        // pLinear
+            Write<std::uint8_t>(out, 0);        // Reserved
+            Write<std::uint8_t>(out, 0);
+            Write<std::uint8_t>(out, 0);
+            Write<std::int32_t>(out, 1);        // xSampling
+            Write<std::int32_t>(out, 1);        // ySampling
+        }
+        Write<std::uint8_t>(out, 0);
+    }
+
+    WriteAttribute(out, "compression", "compression", 1);
+    Write<std::uint8_t>(out, compression == EXRCompression::ZIP ? 3 : compression == EXRCompression::ZIPS ? 2 : 0);
+
+    for (const auto* name : { "dataWindow", "displayWindow" })
+    {
+        WriteAttribute(out, name, "box2i", 16);
+        Write<std::int32_t>(out, 0);
+        Write<std::int32_t>(out, 0);
+        Write<std::int32_t>(out, width - 1);
+        Write<std::int32_t>(out, height - 1);
+    }
+
+    WriteAttribute(out, "lineOrder", "lineOrder", 1);
+    Write<std::uint8_t>(out, 0);                // INCREASING_Y
+
+    WriteAttribute(out, "pixelAspectRatio", "float", 4);
+    Write<float>(out, 1.0f);
+
+    WriteAttribute(out, "screenWindowCenter", "v2f", 8);
+    Write<float>(out, 0.0f);
+    Write<float>(out, 0.0f);
+
+    WriteAttribute(out, "screenWindowWidth", "float", 4);
+    Write<float>(out, 1.0f);
+
+    if (tiled)
+    {
+        WriteAttribute(out, "tiles", "tiledesc", 9);
+        Write<std::uint32_t>(out, tileSize);
+        Write<std::uint32_t>(out, tileSize);
+        Write<std::uint8_t>(out, 0);            // ONE_LEVEL, ROUND_DOWN
+    }
+
+    // End of header
+    Write<std::uint8_t>(out, 0);
+
+    #pragma endregion
+
+    // --------------------------------------------------------------------------------
+
+    #pragma region Offset table
+
+    // Each chunk contains one tile, or 16 scanlines with the ZIP compression and one scanline otherwise.
+    // Since the sizes of the compressed chunks are not known in advance,
+    // the offset table is filled in after writing the chunks.
+    const int numChannels = (int)(channelNames.size());
+    const int linesPerChunk = !tiled && compression == EXRCompression::ZIP ? 16 : 1;
+    const int numTilesX = tiled ? (width + tileSize - 1) / tileSize : 1;
+    const int numTilesY = tiled ? (height + tileSize - 1) / tileSize : (height + linesPerChunk - 1) / linesPerChunk;
+    const auto offsetTablePos = out.tellp();
+    std::vector<std::uint64_t> offsets;
+    offsets.reserve((size_t)(numTilesX) * numTilesY);
+    for (int i = 0; i < numTilesX * numTilesY; i++)
+    {
+        Write<std::uint64_t>(out, 0);
+    }
+
+    #pragma endregion
+
+    // --------------------------------------------------------------------------------
+
+    #pragma region Chunks
+
+    // Writes the pixel data of a chunk preceded by its size
+    std::vector<char> chunk, tmp, compressed;
+    const auto WriteChunkData = [&]() -> void
+    {
+        if (compression != EXRCompression::None && CompressZIP(chunk, tmp, compressed))
+        {
+            Write<std::int32_t>(out, (std::int32_t)(compressed.size()));
+            out.write(compressed.data(), compressed.size());
+            return;
+        }
+        Write<std::int32_t>(out, (std::int32_t)(chunk.size()));
+        out.write(chunk.data(), chunk.size());
+    };
+
+    if (!tiled)
+    {
+        std::vector<float> row(width);
+        for (int i = 0; i < numTilesY; i++)
+        {
+            const int y0 = i * linesPerChunk;
+            const int h = std::min(linesPerChunk, height - y0);
+            chunk.resize(sizeof(float) * width * numChannels * h);
+            auto* dst = chunk.data();
+            for (int y = y0; y < y0 + h; y++)
+            {
+                for (int c : order)
+                {
+                    rowFunc(y, c, row.data());
+                    std::memcpy(dst, row.data(), sizeof(float) * width);
+                    dst += sizeof(float) * width;
+                }
+            }
+
+            offsets.push_back((std::uint64_t)(out.tellp()));
+            Write<std::int32_t>(out, y0);
+            WriteChunkData();
+        }
+    }
+    else
+    {
+        // Rows of the tiles are buffered one at a time
+        std::vector<float> strip((size_t)(tileSize) * width * numChannels);
+        for (int ty = 0; ty < numTilesY; ty++)
+        {
+            const int y0 = ty * tileSize;
+            const int h = std::min(tileSize, height - y0);
+            for (int y = 0; y < h; y++)
+            {
+                for (int i = 0; i < numChannels; i++)
+                {
+                    rowFunc(y0 + y, order[i], &strip[((size_t)(y) * numChannels + i) * width]);
+                }
+            }
+
+            for (int tx = 0; tx < numTilesX; tx++)
+            {
+                const int x0 = tx * tileSize;
+                const int w = std::min(tileSize, width - x0);
+                chunk.resize(sizeof(float) * w * h * numChannels);
+                auto* dst = chunk.data();
+                for (int y = 0; y < h; y++)
+                {
+                    for (int i = 0; i < numChannels; i++)
+                    {
+                        std::memcpy(dst, &strip[((size_t)(y) * numChannels + i) * width + x0], sizeof(float) * w);
+                        dst += sizeof(float) * w;
+                    }
+                }
+
+                offsets.push_back((std::uint64_t)(out.tellp()));
+                Write<std::int32_t>(out, tx);
+                Write<std::int32_t>(out, ty);
+                Write<std::int32_t>(out, 0);    // Level
+                Write<std::int32_t>(out, 0);
+                WriteChunkData();
+            }
+        }
+    }
+
+    // Fill in the offset table
+    out.seekp(offsetTablePos);
+    for (const auto offset : offsets)
+    {
+        Write<std::uint64_t>(out, offset);
+    }
+
+    #pragma endregion
+
+    // --------------------------------------------------------------------------------
+
+    if (!out)
+    {
+        LM_LOG_ERROR("Failed to write image : " + path);
+        return false;
+    }
+
+    LM_LOG_INFO("Successfully saved to " + path);
+    return true;
+}
+
+LM_NAMESPACE_END
@@ -27,8 +27,174 @@
 #include <lightmetrica/logger.h>
 #include <tbb/tbb.h>
 
+#if LM_PLATFORM_WINDOWS
+#include <Windows.h>
+#elif LM_PLATFORM_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 LM_NAMESPACE_BEGIN
 
+namespace
+{
+    // NUMA node of the current thread (set when the thread is pinned)
+    thread_local int CurrentNumaNode = 0;
+
+    /*
+        Detects the CPUs of each NUMA node.
+        Returns a single node with all CPUs if the topology is not available.
+    */
+    auto DetectNumaTopology() -> std::vector<std::vector<int>>
+    {
+        std::vector<std::vector<int>> nodes;
+
+        #if LM_PLATFORM_WINDOWS
+        ULONG highestNode;
+        if (GetNumaHighestNodeNumber(&highestNode))
+        {
+            for (ULONG node = 0; node <= highestNode; node++)
+            {
+                ULONGLONG mask;
+                if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask) || mask == 0)
+                {
+                    continue;
+                }
+                std::vector<int> cpus;
+                for (int cpu = 0; cpu < 64; cpu++)
+                {
+                    if (mask & (ULONGLONG(1) << cpu)) cpus.push_back(cpu);
+                }
+                nodes.push_back(cpus);
+            }
+        }
+        #elif LM_PLATFORM_LINUX
+        // Parse lists of the form '0-3,8-11'
+        for (int node = 0;; node++)
+        {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!in)
+            {
+                break;
+            }
+
+            std::vector<int> cpus;
+            std::string range;
+            while (std::getline(in, range, ','))
+            {
+                int first, last;
+                const auto n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+                if (n < 1) continue;
+                if (n == 1) last = first;
+                for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+            }
+            if (!cpus.empty())
+            {
+                nodes.push_back(cpus);
+            }
+        }
+        #endif
+
+        if (nodes.empty())
+        {
+            std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+            std::iota(cpus.begin(), cpus.end(), 0);
+            nodes.push_back(cpus);
+        }
+
+        return nodes;
+    }
+
+    // Sets the affinity of the current thread to the given CPUs
+    auto SetThreadAffinity(const std::vector<int>& cpus) -> void
+    {
+        #if LM_PLATFORM_WINDOWS
+        DWORD_PTR mask = 0;
+        for (int cpu : cpus) mask |= DWORD_PTR(1) << cpu;
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+        #elif LM_PLATFORM_LINUX
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int cpu : cpus) CPU_SET(cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+        #else
+        LM_UNUSED(cpus);
+        #endif
+    }
+
+    /*
+        Pins the worker threads entering the task arena.
+        If `numa` is disabled, the thread in the i-th slot of the arena is pinned to the CPU (i mod #CPUs).
+        Otherwise the thread is pinned to the CPUs of the NUMA node (i mod #nodes),
+        so that the memory allocated by the thread is placed on the node.
+        The master thread (slot 0) is left unpinned, because the other threads
+        created by the master thread (e.g., the writer thread of the scheduler) inherit the affinity.
+    */
+    class ThreadPinningObserver : public tbb::task_scheduler_observer
+    {
+    public:
+
+        ThreadPinningObserver(const std::vector<std::vector<int>>& numaNodes, bool numa)
+            : numaNodes_(numaNodes)
+            , numa_(numa)
+        {}
+
+    public:
+
+        virtual void on_scheduler_entry(bool isWorker) override
+        {
+            if (!isWorker)
+            {
+                return;
+            }
+
+            const int slot = tbb::this_task_arena::current_thread_index();
+            if (slot < 0)
+            {
+                return;
+            }
+
+            if (numa_)
+            {
+                const int node = slot % static_cast<int>(numaNodes_.size());
+                SetThreadAffinity(numaNodes_[node]);
+                CurrentNumaNode = node;
+            }
+            else
+            {
+                // Find the node of the CPU
+                int cpuIndex = slot % NumCPUs();
+                for (int node = 0; node < static_cast<int>(numaNodes_.size()); node++)
+                {
+                    const int n = static_cast<int>(numaNodes_[node].size());
+                    if (cpuIndex < n)
+                    {
+                        SetThreadAffinity({ numaNodes_[node][cpuIndex] });
+                        CurrentNumaNode = node;
+                        break;
+                    }
+                    cpuIndex -= n;
+                }
+            }
+        }
+
+    private:
+
+        auto NumCPUs() const -> int
+        {
+            int n = 0;
+            for (const auto& cpus : numaNodes_) n += static_cast<int>(cpus.size());
+            return n;
+        }
+
+    private:
+
+        const std::vector<std::vector<int>>& numaNodes_;
+        bool numa_;
+
+    };
+}
+
 class ParallelImpl
 {
 private:
@@ -51,6 +217,18 @@ private:
     int numThreads_ = static_cast<int>(std::thread::hardware_concurrency());
     #endif
 
+    int workerIndex_ = 0;
+    int numWorkers_ = 1;
+
+    // Process-wide task arena shared by the parallel loops, created on the first use
+    std::unique_ptr<tbb::task_arena> arena_;
+
+    // Thread placement
+    bool pinThreads_ = false;
+    bool numaAware_ = false;
+    std::vector<std::vector<int>> numaNodes_ = DetectNumaTopology();
+    std::unique_ptr<ThreadPinningObserver> pinningObserver_;
+
 public:
 
     auto SetNumThreads(int numThreads)
@@ -60,6 +238,9 @@ public:
         {
             numThreads_ = static_cast<int>(std::thread::hardware_concurrency()) + numThreads_;
         }
+
+        // Recreate the arena with the new number of threads
+        arena_.reset();
     }
 
     auto GetNumThreads() const -> int
@@ -67,42 +248,120 @@ public:
         return numThreads_;
     }
 
-    auto For(long long numSamples, const std::function<void(long long index, int threadid, bool init)>& processFunc) const
+    auto SetWorkerProcess(int workerIndex, int numWorkers)
+    {
+        workerIndex_ = workerIndex;
+        numWorkers_ = numWorkers;
+    }
+
+    auto GetWorkerIndex() const -> int
+    {
+        return workerIndex_;
+    }
+
+    auto GetNumWorkers() const -> int
+    {
+        return numWorkers_;
+    }
+
+    auto SetPinThreads(bool pinThreads)
+    {
+        pinThreads_ = pinThreads;
+        UpdatePinningObserver();
+    }
+
+    auto GetPinThreads() const -> bool
+    {
+        return pinThreads_;
+    }
+
+    auto SetNumaAware(bool numaAware)
+    {
+        numaAware_ = numaAware;
+        if (numaAware_)
+        {
+            LM_LOG_INFO(boost::str(boost::format("# of NUMA nodes : %d") % numaNodes_.size()));
+        }
+        UpdatePinningObserver();
+    }
+
+    auto GetNumaAware() const -> bool
+    {
+        return numaAware_;
+    }
+
+    auto GetNumNumaNodes() const -> int
+    {
+        return static_cast<int>(numaNodes_.size());
+    }
+
+    auto ExecuteOnNumaNode(int node, const std::function<void()>& func) const -> void
+    {
+        std::thread thread([&]() -> void
+        {
+            SetThreadAffinity(numaNodes_[node]);
+            CurrentNumaNode = node;
+            func();
+        });
+        thread.join();
+    }
+
+    auto UpdatePinningObserver() -> void
+    {
+        // The threads already pinned keep the affinity until they enter the arena again
+        if (pinningObserver_)
+        {
+            pinningObserver_->observe(false);
+            pinningObserver_.reset();
+        }
+        if (pinThreads_ || numaAware_)
+        {
+            pinningObserver_.reset(new ThreadPinningObserver(numaNodes_, numaAware_));
+            pinningObserver_->observe(true);
+        }
+    }
+
+    auto Execute(const std::function<void()>& func) -> void
+    {
+        if (!arena_)
+        {
+            arena_.reset(new tbb::task_arena(std::max(1, numThreads_)));
+        }
+        arena_->execute(func);
+    }
+
+    auto ForBatch(long long numSamples, const std::function<void(long long begin, long long end, int threadid, bool init)>& processFunc)
     {
-        tbb::task_scheduler_init tbbinit(numThreads_);
         const auto mainThreadId = std::this_thread::get_id();
 
         // --------------------------------------------------------------------------------
 
+        // The thread ID is the slot of the thread in the arena, which is bounded by the number of threads.
+        // Note that the OS threads occupying the slots may change over the loop,
+        // so the per-thread data is indexed by the slot rather than by the OS thread.
         struct Context
         {
-            int threadid = -1;
+            bool initialized = false;
             long long processed = 0;
         };
-        tbb::enumerable_thread_specific<Context> contexts;
-        std::mutex contextInitMutex;
-        int currentThreadID = 0;
-        
+        std::vector<Context> contexts(std::max(1, numThreads_));
+
         // --------------------------------------------------------------------------------
 
         std::atomic<long long> processed(0);
-        tbb::parallel_for(tbb::blocked_range<long long>(0, numSamples, 1000), [&](const tbb::blocked_range<long long>& range) -> void
+        Execute([&]() -> void
         {
-            bool init = false;
-            auto& ctx = contexts.local();
-            if (ctx.threadid < 0)
+            tbb::parallel_for(tbb::blocked_range<long long>(0, numSamples, 1000), [&](const tbb::blocked_range<long long>& range) -> void
             {
-                init = true;
-                std::unique_lock<std::mutex> lock(contextInitMutex);
-                ctx.threadid = currentThreadID++;
-            }
+                const int threadid = tbb::this_task_arena::current_thread_index();
+                auto& ctx = contexts[threadid];
+                const bool init = !ctx.initialized;
+                ctx.initialized = true;
 
-            // --------------------------------------------------------------------------------
+                // --------------------------------------------------------------------------------
 
-            for (long long i = range.begin(); i != range.end(); i++)
-            {
-                processFunc(i, ctx.threadid, init && i == range.begin());
-                ctx.processed++;
+                processFunc(range.begin(), range.end(), threadid, init);
+                ctx.processed += range.size();
                 if (ctx.processed > 1000)
                 {
                     processed += ctx.processed;
@@ -113,8 +372,8 @@ public:
                         LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
                     }
                 }
-            }
 
+            });
         });
 
         LM_LOG_INFO("Progress: 100.0%");
@@ -128,6 +387,27 @@ std::unique_ptr<ParallelImpl> ParallelImpl::instance_;
 
 auto Parallel::SetNumThreads(int numThreads) -> void { ParallelImpl::Instance()->SetNumThreads(numThreads); }
 auto Parallel::GetNumThreads() -> int { return ParallelImpl::Instance()->GetNumThreads(); }
-auto Parallel::For(long long numSamples, const std::function<void(long long index, int threadid, bool init)>& processFunc) -> void { ParallelImpl::Instance()->For(numSamples, processFunc); }
+auto Parallel::SetWorkerProcess(int workerIndex, int numWorkers) -> void { ParallelImpl::Instance()->SetWorkerProcess(workerIndex, numWorkers); }
+auto Parallel::GetWorkerIndex() -> int { return ParallelImpl::Instance()->GetWorkerIndex(); }
+auto Parallel::GetNumWorkers() -> int { return ParallelImpl::Instance()->GetNumWorkers(); }
+auto Parallel::SetPinThreads(bool pinThreads) -> void { ParallelImpl::Instance()->SetPinThreads(pinThreads); }
+auto Parallel::GetPinThreads() -> bool { return ParallelImpl::Instance()->GetPinThreads(); }
+auto Parallel::SetNumaAware(bool numaAware) -> void { ParallelImpl::Instance()->SetNumaAware(numaAware); }
+auto Parallel::GetNumaAware() -> bool { return ParallelImpl::Instance()->GetNumaAware(); }
+auto Parallel::GetNumNumaNodes() -> int { return ParallelImpl::Instance()->GetNumNumaNodes(); }
+auto Parallel::GetNumaNode() -> int { return CurrentNumaNode; }
+auto Parallel::ExecuteOnNumaNode(int node, const std::function<void()>& func) -> void { ParallelImpl::Instance()->ExecuteOnNumaNode(node, func); }
+auto Parallel::Execute(const std::function<void()>& func) -> void { ParallelImpl::Instance()->Execute(func); }
+auto Parallel::For(long long numSamples, const std::function<void(long long index, int threadid, bool init)>& processFunc) -> void
+{
+    ParallelImpl::Instance()->ForBatch(numSamples, [&](long long begin, long long end, int threadid, bool init) -> void
+    {
+        for (long long i = begin; i != end; i++)
+        {
+            processFunc(i, threadid, init && i == begin);
+        }
+    });
+}
+auto Parallel::ForBatch(long long numSamples, const std::function<void(long long begin, long long end, int threadid, bool init)>& processFunc) -> void { ParallelImpl::Instance()->ForBatch(numSamples, processFunc); }
 
 LM_NAMESPACE_END
@@ -859,7 +859,7 @@ public:
 
         // --------------------------------------------------------------------------------
 
-        const auto processedSamples = sched_->Process(scene, film, initRng, [&](Film* film, Random* rng)
+        const auto processedSamples = sched_->ProcessKernel(scene, film, initRng, [&](Film* film, Random* rng)
         {
             #if LM_COMPILER_CLANG
             auto& subpathL = subpathL_.local();
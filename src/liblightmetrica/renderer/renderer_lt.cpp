@@ -63,7 +63,7 @@ public:
 
     LM_IMPL_F(Render) = [this](const Scene* scene, Random* initRng, Film* film_) -> void
     {
-        sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
+        sched_->ProcessKernel(scene, film_, initRng, [&](Film* film, Random* rng)
         {
             #pragma region Sample a light
 
@@ -82,6 +82,13 @@ public:
                 Random rng;
                 std::vector<Photon> photons;
             };
+            // Each worker process traces its own photons, so that the merged image averages
+            // the estimates with independent photon maps
+            if (Parallel::GetNumWorkers() > 1)
+            {
+                initRng->SetSeed(Random::DeriveSeed(initRng->NextUInt(), Parallel::GetWorkerIndex()));
+            }
+
             std::vector<Context> contexts(Parallel::GetNumThreads());
             for (auto& ctx : contexts)
             {
@@ -139,7 +146,7 @@ public:
         // --------------------------------------------------------------------------------
 
         #pragma region Trace eye rays
-        sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
+        sched_->ProcessKernel(scene, film_, initRng, [&](Film* film, Random* rng)
         {
             bool gatherNext = !finalgather_;
             PathSamplerUtils::TraceSubpath(scene, rng, maxNumVertices_, TransportDirection::EL, [&](int numVertices, const Vec2& rasterPos, const PathSamplerUtils::PathVertex& pv, const PathSamplerUtils::PathVertex& v, SPD& throughput) -> bool
@@ -76,6 +76,13 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        // The passes depend on the previous ones, so the rendering cannot be split into worker processes
+        if (Parallel::GetNumWorkers() > 1)
+        {
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'renderer::ppm'");
+            return false;
+        }
+
         maxNumVertices_        = prop->Child("max_num_vertices")->As<int>();
         numSamples_            = prop->ChildAs<long long>("num_samples", 100000L);
         numIterationPass_         = prop->ChildAs<long long>("num_iteration_pass", 1000L);
@@ -36,6 +36,9 @@
 #include <lightmetrica/surfacegeometry.h>
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/scheduler.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/renderutils.h>
+#include <lightmetrica/detail/parallel.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -55,6 +58,22 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        const auto schedulerType = prop->ChildAs<std::string>("scheduler", "default");
+        if (schedulerType == "adaptive" && Parallel::GetNumWorkers() > 1)
+        {
+            // The per-pixel statistics driving the adaptive sampling are local to the process
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'scheduler::adaptive'");
+            return false;
+        }
+        if (schedulerType != "default")
+        {
+            sched_ = ComponentFactory::Create<Scheduler>("scheduler::" + schedulerType);
+            if (!sched_)
+            {
+                LM_LOG_ERROR("Invalid scheduler type: " + schedulerType);
+                return false;
+            }
+        }
         sched_->Load(prop);
         maxNumVertices_ = prop->ChildAs("max_num_vertices", -1);
         minNumVertices_ = prop->ChildAs("min_num_vertices", 0);
@@ -63,7 +82,24 @@ public:
 
     LM_IMPL_F(Render) = [this](const Scene* scene, Random* initRng, Film* film_) -> void
     {
-        sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
+        // State of a path being traced
+        struct Path
+        {
+            SPD throughput;
+            const Primitive* primitive;
+            int type;
+            SurfaceGeometry geom;
+            Vec3 wi;
+            Vec2 rasterPos;
+            int numVertices;
+        };
+
+        // --------------------------------------------------------------------------------
+
+        // Sample a sensor and the primary ray. `rasterPosE` is the raster position of the sample
+        // determined by the caller, or nullptr if the position is sampled by the renderer.
+        // Returns false if the path is terminated before the intersection query.
+        const auto SamplePrimaryRay = [&](Random* rng, const Vec2* rasterPosE, Path& path, Ray& ray) -> bool
         {
             #pragma region Sample a sensor
 
@@ -79,7 +115,8 @@ public:
 
             SurfaceGeometry geomE;
             Vec3 initWo;
-            E->SamplePositionAndDirection(rng->Next2D(), rng->Next2D(), geomE, initWo);
+            const auto uE = rasterPosE ? *rasterPosE : rng->Next2D();
+            E->SamplePositionAndDirection(uE, rng->Next2D(), geomE, initWo);
             const auto pdfPE = E->EvaluatePositionGivenDirectionPDF(geomE, initWo, false);
             assert(pdfPE.v > 0);
 
@@ -89,144 +126,250 @@ public:
 
             #pragma region Calculate raster position for initial vertex
 
-            Vec2 rasterPos;
-            if (!E->RasterPosition(initWo, geomE, rasterPos))
+            if (!E->RasterPosition(initWo, geomE, path.rasterPos))
             {
                 // This can happen due to numerical errors
-                return;
+                return false;
             }
 
             #pragma endregion
 
             // --------------------------------------------------------------------------------
 
-            #pragma region Temporary variables
+            #pragma region Initial vertex
 
-            auto throughput = E->EvaluatePosition(geomE, false) / pdfPE / pdfE;
-            const auto* primitive = E;
-            int type = SurfaceInteractionType::E;
-            auto geom = geomE;
-            Vec3 wi;
-            int numVertices = 1;
+            path.throughput = E->EvaluatePosition(geomE, false) / pdfPE / pdfE;
+            path.primitive = E;
+            path.type = SurfaceInteractionType::E;
+            path.geom = geomE;
+            path.wi = Vec3();
+            path.numVertices = 1;
+            if (maxNumVertices_ != -1 && path.numVertices >= maxNumVertices_)
+            {
+                return false;
+            }
+
+            const auto pdfD = E->EvaluateDirectionPDF(geomE, path.type, path.wi, initWo, false);
+            const auto fs = E->EvaluateDirection(geomE, path.type, path.wi, initWo, TransportDirection::EL, false);
+            if (fs.Black())
+            {
+                return false;
+            }
+            assert(pdfD > 0_f);
+            path.throughput *= fs / pdfD;
+            ray = { geomE.p, initWo };
 
             #pragma endregion
 
-            // --------------------------------------------------------------------------------
+            return true;
+        };
 
+        // --------------------------------------------------------------------------------
+
+        // Trace the path given the result of the intersection query with `ray`
+        const auto TracePath = [&](Film* film, Random* rng, Path& path, Ray ray, bool hit, Intersection isect) -> void
+        {
             while (true)
             {
-                if (maxNumVertices_ != -1 && numVertices >= maxNumVertices_)
+                #pragma region Intersection
+
+                // Record the auxiliary layers at the first hit from the sensor
+                if (path.type == SurfaceInteractionType::E)
+                {
+                    RenderUtils::SplatLayers(film, path.rasterPos, ray, hit ? &isect : nullptr);
+                }
+
+                if (!hit)
                 {
                     break;
                 }
 
+                #pragma endregion
+
                 // --------------------------------------------------------------------------------
 
-                #pragma region Sample direction
+                #pragma region Handle hit with light source
 
-                Vec3 wo;
-                if (type == SurfaceInteractionType::E)
-                {
-                    wo = initWo;
-                }
-                else
+                if ((isect.primitive->Type() & SurfaceInteractionType::L) > 0)
                 {
-                    primitive->SampleDirection(rng->Next2D(), rng->Next(), type, geom, wi, wo);
+                    // Accumulate to film
+                    if (path.numVertices + 1 >= minNumVertices_)
+                    {
+                        const auto C =
+                            path.throughput
+                            * isect.primitive->EvaluateDirection(isect.geom, SurfaceInteractionType::L, Vec3(), -ray.d, TransportDirection::EL, false)
+                            * isect.primitive->EvaluatePosition(isect.geom, false);
+                        film->Splat(path.rasterPos, C);
+                    }
                 }
-                const auto pdfD = primitive->EvaluateDirectionPDF(geom, type, wi, wo, false);
 
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #pragma region Evaluate direction
+                #pragma region Path termination
 
-                const auto fs = primitive->EvaluateDirection(geom, type, wi, wo, TransportDirection::EL, false);
-                if (fs.Black())
+                if (isect.geom.infinite)
                 {
                     break;
                 }
 
+                const Float rrProb = 0.5_f;
+                if (rng->Next() > rrProb)
+                {
+                    break;
+                }
+                else
+                {
+                    path.throughput /= rrProb;
+                }
+
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #pragma region Update throughput
+                #pragma region Update information
 
-                assert(pdfD > 0_f);
-                throughput *= fs / pdfD;
+                path.geom = isect.geom;
+                path.primitive = isect.primitive;
+                path.type = isect.primitive->Type() & ~SurfaceInteractionType::Emitter;
+                path.wi = -ray.d;
+                path.numVertices++;
 
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #pragma region Intersection
-
-                // Setup next ray
-                Ray ray = { geom.p, wo };
-
-                // Intersection query
-                Intersection isect;
-                if (!scene->Intersect(ray, isect))
+                if (maxNumVertices_ != -1 && path.numVertices >= maxNumVertices_)
                 {
                     break;
                 }
 
-                #pragma endregion
-
                 // --------------------------------------------------------------------------------
 
-                #pragma region Handle hit with light source
+                #pragma region Sample direction
 
-                if ((isect.primitive->Type() & SurfaceInteractionType::L) > 0)
-                {
-                    // Accumulate to film
-                    if (numVertices + 1 >= minNumVertices_)
-                    {
-                        const auto C =
-                            throughput
-                            * isect.primitive->EvaluateDirection(isect.geom, SurfaceInteractionType::L, Vec3(), -ray.d, TransportDirection::EL, false)
-                            * isect.primitive->EvaluatePosition(isect.geom, false);
-                        film->Splat(rasterPos, C);
-                    }
-                }
+                Vec3 wo;
+                path.primitive->SampleDirection(rng->Next2D(), rng->Next(), path.type, path.geom, path.wi, wo);
+                const auto pdfD = path.primitive->EvaluateDirectionPDF(path.geom, path.type, path.wi, wo, false);
 
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #pragma region Path termination
+                #pragma region Evaluate direction
 
-                if (isect.geom.infinite)
+                const auto fs = path.primitive->EvaluateDirection(path.geom, path.type, path.wi, wo, TransportDirection::EL, false);
+                if (fs.Black())
                 {
                     break;
                 }
 
-                const Float rrProb = 0.5_f;
-                if (rng->Next() > rrProb)
-                {
-                    break;
-                }
-                else
-                {
-                    throughput /= rrProb;
-                }
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Update throughput
+
+                assert(pdfD > 0_f);
+                path.throughput *= fs / pdfD;
 
                 #pragma endregion
 
                 // --------------------------------------------------------------------------------
 
-                #pragma region Update information
+                #pragma region Intersection query
 
-                geom = isect.geom;
-                primitive = isect.primitive;
-                type = isect.primitive->Type() & ~SurfaceInteractionType::Emitter;
-                wi = -ray.d;
-                numVertices++;
+                ray = { path.geom.p, wo };
+                hit = scene->Intersect(ray, isect);
 
                 #pragma endregion
             }
-        });
+        };
+
+        // --------------------------------------------------------------------------------
+
+        // Process a sample
+        const auto ProcessSample = [&](Film* film, Random* rng, const Vec2* rasterPosE) -> void
+        {
+            Path path;
+            Ray ray;
+            if (!SamplePrimaryRay(rng, rasterPosE, path, ray))
+            {
+                return;
+            }
+            Intersection isect;
+            const bool hit = scene->Intersect(ray, isect);
+            TracePath(film, rng, path, ray, hit, isect);
+        };
+
+        // Process a packet of `n` samples. The primary rays of the samples pass through
+        // 2x2 neighboring pixels placed at a random position (wrapping around the image),
+        // so that the coherent rays are traced at once with `Scene::IntersectPacket`.
+        // Each sample is still uniformly distributed over the image.
+        const int PacketSize = 4;
+        const auto ProcessPacket = [&](Film* film, Random* rng, int n) -> void
+        {
+            #pragma region Primary rays
+
+            const Vec2 pixelSize(1_f / Float(film->Width()), 1_f / Float(film->Height()));
+            const auto u = rng->Next2D();
+            Path paths[PacketSize];
+            Ray rays[PacketSize];
+            int m = 0;
+            for (int i = 0; i < n; i++)
+            {
+                auto rasterPosE = u + Vec2(Float(i & 1) * pixelSize.x, Float(i >> 1) * pixelSize.y);
+                rasterPosE.x -= rasterPosE.x >= 1_f ? 1_f : 0_f;
+                rasterPosE.y -= rasterPosE.y >= 1_f ? 1_f : 0_f;
+                if (SamplePrimaryRay(rng, &rasterPosE, paths[m], rays[m]))
+                {
+                    m++;
+                }
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Trace paths
+
+            Intersection isects[PacketSize];
+            const auto hits = scene->IntersectPacket(rays, m, isects);
+            for (int i = 0; i < m; i++)
+            {
+                TracePath(film, rng, paths[i], rays[i], (hits & (1u << i)) != 0, isects[i]);
+            }
+
+            #pragma endregion
+        };
+
+        // --------------------------------------------------------------------------------
+
+        if (sched_->ProcessRaster.Implemented())
+        {
+            sched_->ProcessRaster(scene, film_, initRng, [&](Film* film, Random* rng, const Vec2& rasterPos)
+            {
+                ProcessSample(film, rng, &rasterPos);
+            });
+        }
+        else if (sched_->ProcessBatch.Implemented())
+        {
+            sched_->ProcessBatch(scene, film_, initRng, [&](Film* film, Random* rng, long long numSamples) -> void
+            {
+                for (long long i = 0; i < numSamples; i += PacketSize)
+                {
+                    ProcessPacket(film, rng, (int)(std::min<long long>(PacketSize, numSamples - i)));
+                }
+            });
+        }
+        else
+        {
+            sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
+            {
+                ProcessSample(film, rng, nullptr);
+            });
+        }
     };
 
 };
@@ -37,7 +37,9 @@
 #include <lightmetrica/surfacegeometry.h>
 #include <lightmetrica/primitive.h>
 #include <lightmetrica/scheduler.h>
+#include <lightmetrica/logger.h>
 #include <lightmetrica/renderutils.h>
+#include <lightmetrica/detail/parallel.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -57,6 +59,22 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        const auto schedulerType = prop->ChildAs<std::string>("scheduler", "default");
+        if (schedulerType == "adaptive" && Parallel::GetNumWorkers() > 1)
+        {
+            // The per-pixel statistics driving the adaptive sampling are local to the process
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'scheduler::adaptive'");
+            return false;
+        }
+        if (schedulerType != "default")
+        {
+            sched_ = ComponentFactory::Create<Scheduler>("scheduler::" + schedulerType);
+            if (!sched_)
+            {
+                LM_LOG_ERROR("Invalid scheduler type: " + schedulerType);
+                return false;
+            }
+        }
         sched_->Load(prop);
         maxNumVertices_ = prop->ChildAs<int>("max_num_vertices", -1);
         return true;
@@ -64,7 +82,9 @@ public:
 
     LM_IMPL_F(Render) = [this](const Scene* scene, Random* initRng, Film* film_) -> void
     {
-        sched_->Process(scene, film_, initRng, [&](Film* film, Random* rng)
+        // Process a sample. `rasterPosE` is the raster position of the sample
+        // determined by the scheduler, or nullptr if the position is sampled by the renderer.
+        const auto ProcessSample = [&](Film* film, Random* rng, const Vec2* rasterPosE) -> void
         {
             #pragma region Sample a sensor
 
@@ -80,7 +100,8 @@ public:
 
             SurfaceGeometry geomE;
             Vec3 initWo;
-            E->sensor->SamplePositionAndDirection(rng->Next2D(), rng->Next2D(), geomE, initWo);
+            const auto uE = rasterPosE ? *rasterPosE : rng->Next2D();
+            E->sensor->SamplePositionAndDirection(uE, rng->Next2D(), geomE, initWo);
             const auto pdfPE = E->sensor->EvaluatePositionGivenDirectionPDF(geomE, initWo, false);
             assert(pdfPE.v > 0);
 
@@ -230,7 +251,15 @@ public:
 
                 // Intersection query
                 Intersection isect;
-                if (!scene->Intersect(ray, isect))
+                const bool hit = scene->Intersect(ray, isect);
+
+                // Record the auxiliary layers at the first hit from the sensor
+                if (type == SurfaceInteractionType::E)
+                {
+                    RenderUtils::SplatLayers(film, rasterPos, ray, hit ? &isect : nullptr);
+                }
+
+                if (!hit)
                 {
                     break;
                 }
@@ -270,7 +299,22 @@ public:
 
                 #pragma endregion
             }
-        });
+        };
+
+        if (sched_->ProcessRaster.Implemented())
+        {
+            sched_->ProcessRaster(scene, film_, initRng, [&](Film* film, Random* rng, const Vec2& rasterPos)
+            {
+                ProcessSample(film, rng, &rasterPos);
+            });
+        }
+        else
+        {
+            sched_->ProcessKernel(scene, film_, initRng, [&](Film* film, Random* rng)
+            {
+                ProcessSample(film, rng, nullptr);
+            });
+        }
     };
 
 private:
@@ -31,6 +31,8 @@
 #include <lightmetrica/surfacegeometry.h>
 #include <lightmetrica/emitter.h>
 #include <lightmetrica/intersection.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/detail/parallel.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -44,6 +46,12 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        // The image is deterministic, so the worker processes would render the identical images
+        if (Parallel::GetNumWorkers() > 1)
+        {
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'renderer::raycast'");
+            return false;
+        }
         return true;
     };
 
@@ -52,34 +60,64 @@ public:
         const int w = film->Width();
         const int h = film->Height();
 
-        for (int y = 0; y < h; y++)
+        // Rays are traced by the packets of 2x2 pixels
+        for (int y = 0; y < h; y += 2)
         {
-            for (int x = 0; x < w; x++)
+            for (int x = 0; x < w; x += 2)
             {
-                // Raster position
-                Vec2 rasterPos((Float(x) + 0.5_f) / Float(w), (Float(y) + 0.5_f) / Float(h));
+                #pragma region Setup rays
+
+                int n = 0;
+                int pixels[4][2];
+                Ray rays[4];
+                for (int i = 0; i < 4; i++)
+                {
+                    const int px = x + (i & 1);
+                    const int py = y + (i >> 1);
+                    if (px >= w || py >= h)
+                    {
+                        continue;
+                    }
+
+                    // Raster position
+                    Vec2 rasterPos((Float(px) + 0.5_f) / Float(w), (Float(py) + 0.5_f) / Float(h));
+
+                    // Position and direction of a ray
+                    const auto* E = scene->GetSensor()->emitter;
+                    SurfaceGeometry geomE;
+                    Vec3 wo;
+                    E->SamplePositionAndDirection(rasterPos, Vec2(), geomE, wo);
+
+                    // Setup a ray
+                    rays[n] = { geomE.p, wo };
+                    pixels[n][0] = px;
+                    pixels[n][1] = py;
+                    n++;
+                }
+
+                #pragma endregion
 
-                // Position and direction of a ray
-                const auto* E = scene->GetSensor()->emitter;
-                SurfaceGeometry geomE;
-                Vec3 wo;
-                E->SamplePositionAndDirection(rasterPos, Vec2(), geomE, wo);
+                // --------------------------------------------------------------------------------
 
-                // Setup a ray
-                Ray ray = { geomE.p, wo };
+                #pragma region Intersection query
 
-                // Intersection query
-                Intersection isect;
-                if (!scene->Intersect(ray, isect))
+                Intersection isects[4];
+                const auto hits = scene->IntersectPacket(rays, n, isects);
+                for (int i = 0; i < n; i++)
                 {
-                    // No intersection -> black
-                    film->SetPixel(x, y, SPD());
-                    continue;
+                    if ((hits & (1u << i)) == 0)
+                    {
+                        // No intersection -> black
+                        film->SetPixel(pixels[i][0], pixels[i][1], SPD());
+                        continue;
+                    }
+
+                    // Set color to the pixel
+                    const auto c = Math::Abs(Math::Dot(isects[i].geom.sn, -rays[i].d));
+                    film->SetPixel(pixels[i][0], pixels[i][1], SPD(c));
                 }
 
-                // Set color to the pixel
-                const auto c = Math::Abs(Math::Dot(isect.geom.sn, -ray.d));
-                film->SetPixel(x, y, SPD(c));
+                #pragma endregion
             }
 
             const double progress = 100.0 * y / film->Height();
@@ -40,6 +40,7 @@
 #include <lightmetrica/detail/photonmap.h>
 #include <lightmetrica/detail/pathsamplerutils.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
 #include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
@@ -75,6 +76,13 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* prop) -> bool
     {
+        // The passes depend on the previous ones, so the rendering cannot be split into worker processes
+        if (Parallel::GetNumWorkers() > 1)
+        {
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'renderer::sppm'");
+            return false;
+        }
+
         maxNumVertices_        = prop->Child("max_num_vertices")->As<int>();
         numIterationPass_      = prop->ChildAs<long long>("num_iteration_pass", 1000L);
         numPhotonTraceSamples_ = prop->ChildAs<long long>("num_photon_trace_samples", 100L);
@@ -107,16 +115,70 @@ public:
 
         const auto W = film->Width();
         const auto H = film->Height();
-        std::vector<MeasurementPoint> mps(W * H);
-        for (auto& mp : mps)
+        std::vector<MeasurementPoint> mps;
+        long long totalPhotonTraceSamples = 0;
+        long long startPass = 0;
+        const auto InitMeasurementPoints = [&]() -> void
+        {
+            mps.assign(W * H, MeasurementPoint());
+            for (auto& mp : mps)
+            {
+                mp.radius = initialRadius_;
+                mp.N = 0_f;
+            }
+            totalPhotonTraceSamples = 0;
+            startPass = 0;
+        };
+        InitMeasurementPoints();
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Resume from checkpoint
+
+        // The state carried over the passes is restored from the checkpoint.
+        // Other information of the measurement points is recomputed in every pass.
+        if (Checkpoint::GetResume())
         {
-            mp.radius = initialRadius_;
-            mp.N = 0_f;
+            LM_LOG_INFO("Resuming from checkpoint: " + Checkpoint::GetPath());
+            LM_LOG_INDENTER();
+            const bool result = Checkpoint::Load("renderer::sppm", [&](std::istream& in) -> bool
+            {
+                long long numMPs;
+                if (!Checkpoint::Read(in, startPass) || !Checkpoint::Read(in, totalPhotonTraceSamples) || !Checkpoint::Read(in, numMPs) || numMPs != (long long)mps.size())
+                {
+                    return false;
+                }
+                for (auto& mp : mps)
+                {
+                    if (!Checkpoint::Read(in, mp.radius) || !Checkpoint::Read(in, mp.N) || !Checkpoint::Read(in, mp.tau) || !Checkpoint::Read(in, mp.emission))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            });
+
+            if (result)
+            {
+                LM_LOG_INFO("Starting from pass " + std::to_string(startPass));
+
+                // Use the RNG streams different from the ones before the checkpoint
+                initRng->SetSeed(Random::DeriveSeed(initRng->NextUInt(), startPass));
+            }
+            else
+            {
+                LM_LOG_WARN("Failed to load checkpoint. Rendering from scratch.");
+                InitMeasurementPoints();
+            }
         }
 
-        long long totalPhotonTraceSamples = 0;
+        auto prevCheckpointTime = std::chrono::high_resolution_clock::now();
 
-        for (long long pass = 0; pass < numIterationPass_; pass++)
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        for (long long pass = startPass; pass < numIterationPass_; pass++)
         {
             LM_LOG_INFO("Pass " + std::to_string(pass));
             LM_LOG_INDENTER();
@@ -316,6 +378,34 @@ public:
                 #endif
             }
             #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Save checkpoint
+            if (Checkpoint::Enabled())
+            {
+                const auto currentTime = std::chrono::high_resolution_clock::now();
+                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevCheckpointTime).count()) / 1000.0;
+                if (elapsed >= Checkpoint::GetInterval() || pass == numIterationPass_ - 1)
+                {
+                    Checkpoint::Save("renderer::sppm", [&](std::ostream& out) -> bool
+                    {
+                        Checkpoint::Write(out, pass + 1);
+                        Checkpoint::Write(out, totalPhotonTraceSamples);
+                        Checkpoint::Write(out, (long long)(mps.size()));
+                        for (const auto& mp : mps)
+                        {
+                            Checkpoint::Write(out, mp.radius);
+                            Checkpoint::Write(out, mp.N);
+                            Checkpoint::Write(out, mp.tau);
+                            Checkpoint::Write(out, mp.emission);
+                        }
+                        return true;
+                    });
+                    prevCheckpointTime = currentTime;
+                }
+            }
+            #pragma endregion
         }
         #pragma endregion
     };
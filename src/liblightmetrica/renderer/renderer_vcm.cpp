@@ -34,6 +34,7 @@
 #include <lightmetrica/random.h>
 #include <lightmetrica/sensor.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
 #include <lightmetrica/detail/photonmap.h>
 #include <lightmetrica/detail/pathsamplerutils.h>
 
@@ -557,6 +558,13 @@ public:
 
     LM_IMPL_F(Initialize) = [this](const PropertyNode* p) -> bool
     {
+        // The passes depend on the previous ones, so the rendering cannot be split into worker processes
+        if (Parallel::GetNumWorkers() > 1)
+        {
+            LM_LOG_ERROR("Multiple worker processes (--num-workers) are not supported by 'renderer::vcm'");
+            return false;
+        }
+
         maxNumVertices_        = p->ChildAs<int>("max_num_vertices", 10);
         minNumVertices_        = p->ChildAs<int>("min_num_vertices", 0);
         numIterationPass_      = p->ChildAs<long long>("num_iteration_pass", 100L);
@@ -580,7 +588,50 @@ public:
     LM_IMPL_F(Render) = [this](const Scene* scene, Random* initRng, Film* film) -> void
     {
         Float mergeRadius = 0_f;
-        for (long long pass = 0; pass < numIterationPass_; pass++)
+        long long startPass = 0;
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Resume from checkpoint
+
+        // The merge radius and the film averaged over the passes are carried over the passes
+        const bool checkpoint = film->Serialize.Implemented() && film->Deserialize.Implemented();
+        if ((Checkpoint::Enabled() || Checkpoint::GetResume()) && !checkpoint)
+        {
+            LM_LOG_WARN("Checkpoints are not supported by the film. Ignoring checkpoint options.");
+        }
+        if (checkpoint && Checkpoint::GetResume())
+        {
+            LM_LOG_INFO("Resuming from checkpoint: " + Checkpoint::GetPath());
+            LM_LOG_INDENTER();
+            const bool result = Checkpoint::Load("renderer::vcm", [&](std::istream& in) -> bool
+            {
+                return Checkpoint::Read(in, startPass) && Checkpoint::Read(in, mergeRadius) && film->Deserialize(in);
+            });
+
+            if (result)
+            {
+                LM_LOG_INFO("Starting from pass " + std::to_string(startPass));
+
+                // Use the RNG streams different from the ones before the checkpoint
+                initRng->SetSeed(Random::DeriveSeed(initRng->NextUInt(), startPass));
+            }
+            else
+            {
+                LM_LOG_WARN("Failed to load checkpoint. Rendering from scratch.");
+                startPass = 0;
+                mergeRadius = 0_f;
+                film->Clear();
+            }
+        }
+
+        auto prevCheckpointTime = std::chrono::high_resolution_clock::now();
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        for (long long pass = startPass; pass < numIterationPass_; pass++)
         {
             LM_LOG_INFO("Pass " + std::to_string(pass));
             LM_LOG_INDENTER();
@@ -774,6 +825,26 @@ public:
                 film->Save(boost::str(f % pass));
             }
             #endif
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Save checkpoint
+            if (checkpoint && Checkpoint::Enabled())
+            {
+                const auto currentTime = std::chrono::high_resolution_clock::now();
+                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevCheckpointTime).count()) / 1000.0;
+                if (elapsed >= Checkpoint::GetInterval() || pass == numIterationPass_ - 1)
+                {
+                    Checkpoint::Save("renderer::vcm", [&](std::ostream& out) -> bool
+                    {
+                        Checkpoint::Write(out, pass + 1);
+                        Checkpoint::Write(out, mergeRadius);
+                        return film->Serialize(out);
+                    });
+                    prevCheckpointTime = currentTime;
+                }
+            }
+            #pragma endregion
         }
     };
 
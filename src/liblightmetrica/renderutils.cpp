@@ -0,0 +1,59 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+#include <pch.h>
+#include <lightmetrica/renderutils.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/ray.h>
+#include <lightmetrica/intersection.h>
+#include <lightmetrica/primitive.h>
+#include <lightmetrica/bsdf.h>
+
+LM_NAMESPACE_BEGIN
+
+auto RenderUtils::SplatLayers(Film* film, const Vec2& rasterPos, const Ray& ray, const Intersection* isect) -> void
+{
+    if (!film->SplatLayer.Implemented())
+    {
+        return;
+    }
+
+    // Escaped rays contribute zeros so that the layers are averaged over all samples in the pixel
+    if (!isect || isect->geom.infinite)
+    {
+        film->SplatLayer(FilmLayer::Albedo, rasterPos, Vec3());
+        film->SplatLayer(FilmLayer::Normal, rasterPos, Vec3());
+        film->SplatLayer(FilmLayer::Depth, rasterPos, Vec3());
+        return;
+    }
+
+    const auto* bsdf = isect->primitive->bsdf;
+    film->SplatLayer(FilmLayer::Albedo, rasterPos, bsdf && bsdf->Reflectance.Implemented() ? bsdf->Reflectance().ToRGB() : Vec3());
+    film->SplatLayer(FilmLayer::Normal, rasterPos, isect->geom.sn);
+    film->SplatLayer(FilmLayer::Depth, rasterPos, Vec3(Math::Length(isect->geom.p - ray.o)));
+    film->SplatLayer(FilmLayer::PrimitiveID, rasterPos, Vec3(Float(isect->primitive->index + 1)));
+}
+
+LM_NAMESPACE_END
@@ -36,6 +36,7 @@
 #include <lightmetrica/ray.h>
 #include <lightmetrica/intersection.h>
 #include <lightmetrica/detail/propertyutils.h>
+#include <tbb/tbb.h>
 
 LM_NAMESPACE_BEGIN
 
@@ -380,32 +381,38 @@ public:
 
         // --------------------------------------------------------------------------------
 
-        #pragma region Compute scene bound
+        #pragma region Precompute world-space geometry
 
-        // AABB
-        bound_ = Bound();
-        for (const auto& primitive : primitives_)
         {
-            if (primitive->mesh)
+            // The buffers are not created for the meshes shared by multiple primitives
+            // to avoid duplicating the instanced geometry.
+            std::unordered_map<const TriangleMesh*, int> meshRefCounts;
+            for (const auto& primitive : primitives_)
             {
-                const int n = primitive->mesh->NumVertices();
-                const auto* ps = primitive->mesh->Positions();
-                for (int i = 0; i < n; i++)
+                if (primitive->mesh)
                 {
-                    Vec3 p(primitive->transform * Vec4(ps[3 * i], ps[3 * i + 1], ps[3 * i + 2], 1_f));
-                    bound_ = Math::Union(bound_, p);
+                    meshRefCounts[primitive->mesh]++;
                 }
             }
 
-            if (primitive->emitter && primitive->emitter->GetBound.Implemented())
+            worldGeometries_.assign(primitives_.size(), WorldGeometry());
+            tbb::parallel_for(0, (int)(primitives_.size()), [&](int i) -> void
             {
-                bound_ = Math::Union(bound_, primitive->emitter->GetBound());
-            }
+                const auto* mesh = primitives_[i]->mesh;
+                if (mesh && mesh->NumVertices() > 0 && meshRefCounts.at(mesh) == 1)
+                {
+                    UpdateWorldGeometry(i);
+                }
+            });
         }
-        
-        // Bounding sphere
-        sphereBound_.center = (bound_.max + bound_.min) * .5_f;
-        sphereBound_.radius = Math::Length(sphereBound_.center - bound_.max) * 1.01_f;  // Grow slightly
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Compute scene bound
+
+        ComputeBound();
 
         #pragma endregion
 
@@ -484,6 +491,63 @@ public:
         return accel_->Intersect(this, ray, isect, minT, maxT);
     };
 
+    LM_IMPL_F(Occluded) = [this](const Ray& ray, Float minT, Float maxT) -> bool
+    {
+        if (accel_->Occluded.Implemented())
+        {
+            return accel_->Occluded(ray, minT, maxT);
+        }
+
+        Intersection _;
+        return accel_->Intersect(this, ray, _, minT, maxT);
+    };
+
+    LM_IMPL_F(IntersectPacket) = [this](const Ray* rays, int n, Intersection* isects) -> unsigned int
+    {
+        assert(0 <= n && n <= 32);
+
+        // Intersect with accel
+        unsigned int hits = 0;
+        if (accel_->IntersectPacket.Implemented())
+        {
+            hits = accel_->IntersectPacket(this, rays, n, isects, Math::EpsIsect(), Math::Inf());
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if (accel_->Intersect(this, rays[i], isects[i], Math::EpsIsect(), Math::Inf()))
+                {
+                    hits |= 1u << i;
+                }
+            }
+        }
+
+        // Intersect with emitter shapes for the rays missing the geometries
+        if (!emitterShapes_.empty())
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if ((hits & (1u << i)) > 0)
+                {
+                    continue;
+                }
+
+                Float maxT = Math::Inf();
+                for (size_t j = 0; j < emitterShapes_.size(); j++)
+                {
+                    if (emitterShapes_[j]->Intersect(rays[i], Math::EpsIsect(), maxT, isects[i]))
+                    {
+                        maxT = Math::Length(isects[i].geom.p - rays[i].o);
+                        hits |= 1u << i;
+                    }
+                }
+            }
+        }
+
+        return hits;
+    };
+
     LM_IMPL_F(PrimitiveByID) = [this](const std::string& id) -> const Primitive*
     {
         const auto it = primitiveIDMap_.find(id);
@@ -550,6 +614,124 @@ public:
         return sphereBound_;
     };
 
+    LM_IMPL_F(SetPrimitiveTransform) = [this](int index, const Mat4& transform) -> void
+    {
+        auto* primitive = primitives_.at(index).get();
+        primitive->transform = transform;
+        primitive->normalTransform = Mat3(Math::Transpose(Math::Inverse(transform)));
+        if (primitive->worldPositions)
+        {
+            UpdateWorldGeometry(index);
+        }
+    };
+
+    LM_IMPL_F(Refit) = [this]() -> bool
+    {
+        if (accel_->Refit.Implemented())
+        {
+            if (!accel_->Refit(this))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if (!accel_->Build(this))
+            {
+                return false;
+            }
+        }
+
+        ComputeBound();
+        return true;
+    };
+
+private:
+
+    // Transform the mesh of the primitive to the world coordinates
+    auto UpdateWorldGeometry(int index) -> void
+    {
+        auto* primitive = primitives_[index].get();
+        auto& geom = worldGeometries_[index];
+        const auto* mesh = primitive->mesh;
+
+        // Positions
+        const int nv = mesh->NumVertices();
+        const auto* ps = mesh->Positions();
+        geom.ps.resize(3 * nv);
+        for (int i = 0; i < nv; i++)
+        {
+            const Vec3 p(primitive->transform * Vec4(ps[3 * i], ps[3 * i + 1], ps[3 * i + 2], 1_f));
+            geom.ps[3 * i] = p.x;
+            geom.ps[3 * i + 1] = p.y;
+            geom.ps[3 * i + 2] = p.z;
+        }
+
+        // Normals
+        const auto* ns = mesh->Normals();
+        if (ns)
+        {
+            geom.ns.resize(3 * nv);
+            for (int i = 0; i < nv; i++)
+            {
+                const auto n = primitive->normalTransform * Vec3(ns[3 * i], ns[3 * i + 1], ns[3 * i + 2]);
+                geom.ns[3 * i] = n.x;
+                geom.ns[3 * i + 1] = n.y;
+                geom.ns[3 * i + 2] = n.z;
+            }
+        }
+
+        // Face normals
+        const int nf = mesh->NumFaces();
+        const auto* fs = mesh->Faces();
+        geom.gns.resize(3 * nf);
+        for (int i = 0; i < nf; i++)
+        {
+            const auto* p1 = &geom.ps[3 * fs[3 * i]];
+            const auto* p2 = &geom.ps[3 * fs[3 * i + 1]];
+            const auto* p3 = &geom.ps[3 * fs[3 * i + 2]];
+            const Vec3 e1(p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2]);
+            const Vec3 e2(p3[0] - p1[0], p3[1] - p1[1], p3[2] - p1[2]);
+            const auto gn = Math::Normalize(Math::Cross(e1, e2));
+            geom.gns[3 * i] = gn.x;
+            geom.gns[3 * i + 1] = gn.y;
+            geom.gns[3 * i + 2] = gn.z;
+        }
+
+        primitive->worldPositions = geom.ps.data();
+        primitive->worldNormals = ns ? geom.ns.data() : nullptr;
+        primitive->worldFaceNormals = geom.gns.data();
+    }
+
+    // Compute the scene bound from the current transforms
+    auto ComputeBound() -> void
+    {
+        // AABB
+        bound_ = Bound();
+        for (const auto& primitive : primitives_)
+        {
+            if (primitive->mesh)
+            {
+                const int n = primitive->mesh->NumVertices();
+                const auto* ps = primitive->mesh->Positions();
+                for (int i = 0; i < n; i++)
+                {
+                    Vec3 p(primitive->transform * Vec4(ps[3 * i], ps[3 * i + 1], ps[3 * i + 2], 1_f));
+                    bound_ = Math::Union(bound_, p);
+                }
+            }
+
+            if (primitive->emitter && primitive->emitter->GetBound.Implemented())
+            {
+                bound_ = Math::Union(bound_, primitive->emitter->GetBound());
+            }
+        }
+        
+        // Bounding sphere
+        sphereBound_.center = (bound_.max + bound_.min) * .5_f;
+        sphereBound_.radius = Math::Length(sphereBound_.center - bound_.max) * 1.01_f;  // Grow slightly
+    }
+
 private:
 
     std::vector<std::unique_ptr<Primitive>> primitives_;                // Primitives
@@ -557,11 +739,20 @@ private:
     Primitive* sensorPrimitive_;                                        // Pointer to sensor primitive
     std::vector<size_t> lightPrimitiveIndices_;                         // Pointers to light primitives
 
-    const Accel* accel_;                                                // Acceleration structure
+    Accel* accel_;                                                      // Acceleration structure
     Bound bound_;                                                       // Scene bound (AABB)
     SphereBound sphereBound_;                                           // Scene bound (sphere)
     std::vector<const EmitterShape*> emitterShapes_;                    // Special shapes for emitters
 
+    // World-space geometry of the primitives
+    struct WorldGeometry
+    {
+        std::vector<Float> ps;          // Positions
+        std::vector<Float> ns;          // Normals
+        std::vector<Float> gns;         // Face normals
+    };
+    std::vector<WorldGeometry> worldGeometries_;
+
     // Predefined assets
     BSDF::UniquePtr nullBSDF_ = ComponentFactory::Create<BSDF>("bsdf::null");
 
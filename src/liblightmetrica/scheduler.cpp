@@ -29,10 +29,18 @@
 #include <lightmetrica/film.h>
 #include <lightmetrica/random.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
 #include <tbb/tbb.h>
+#include <condition_variable>
 
 LM_NAMESPACE_BEGIN
 
+namespace
+{
+    // Tag of the checkpoints written by the scheduler
+    const std::string CheckpointTag = "scheduler::default";
+}
+
 class Scheduler_ final : public Scheduler
 {
 public:
@@ -55,6 +63,14 @@ public:
         progressImageUpdateInterval_ = prop->ChildAs<double>("progress_image_update_interval", -1);
         numSamples_ = prop->ChildAs<long long>("num_samples", 10000000L);
         renderTime_ = prop->ChildAs<double>("render_time", -1);
+        deterministic_ = prop->ChildAs<int>("deterministic", 0) != 0;
+        numStreams_ = std::max(1, prop->ChildAs<int>("num_streams", 16));
+
+        if (deterministic_ && renderTime_ > 0)
+        {
+            LM_LOG_WARN("Deterministic mode is not supported with 'render_time'. Disabled.");
+            deterministic_ = false;
+        }
 
         #pragma endregion
 
@@ -70,6 +86,8 @@ public:
             LM_LOG_INFO("progress_image_update_interval = " + std::to_string(progressImageUpdateInterval_));
             LM_LOG_INFO("num_samples                    = " + std::to_string(numSamples_));
             LM_LOG_INFO("render_time                    = " + std::to_string(renderTime_));
+            LM_LOG_INFO("deterministic                  = " + std::to_string(deterministic_ ? 1 : 0));
+            LM_LOG_INFO("num_streams                    = " + std::to_string(numStreams_));
         }
 
         #pragma endregion
@@ -77,7 +95,96 @@ public:
 
     LM_IMPL_F(Process) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*)>& processSampleFunc) -> long long
     {
-        tbb::task_scheduler_init init(Parallel::GetNumThreads());
+        return ProcessBatch(scene, film, initRng, [&](Film* film, Random* rng, long long numSamples) -> void
+        {
+            for (long long i = 0; i < numSamples; i++)
+            {
+                processSampleFunc(film, rng);
+            }
+        });
+    };
+
+    LM_IMPL_F(ProcessBatch) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, long long)>& processBatchFunc) -> long long
+    {
+        if (deterministic_)
+        {
+            return ProcessDeterministic(film, initRng, processBatchFunc);
+        }
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Worker process
+
+        // Render the share of the samples assigned to the worker process with the independent RNG streams
+        const int numWorkers = Parallel::GetNumWorkers();
+        const int workerIndex = Parallel::GetWorkerIndex();
+        const long long numSamples = numSamples_ * (workerIndex + 1) / numWorkers - numSamples_ * workerIndex / numWorkers;
+        if (numWorkers > 1)
+        {
+            LM_LOG_INFO(boost::str(boost::format("Worker process %d / %d (%d samples)") % workerIndex % numWorkers % numSamples));
+            initRng->SetSeed(Random::DeriveSeed(initRng->NextUInt(), workerIndex));
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Checkpoint
+
+        // Film data and # of samples restored from the checkpoint
+        Film::UniquePtr baseFilm{ nullptr, nullptr };
+        long long baseSamples = 0;
+        double baseElapsed = 0;
+
+        const bool checkpoint = Checkpoint::Enabled() && film->Serialize.Implemented();
+        if (Checkpoint::GetResume())
+        {
+            LM_LOG_INFO("Resuming from checkpoint: " + Checkpoint::GetPath());
+            LM_LOG_INDENTER();
+
+            baseFilm = ComponentFactory::Clone<Film>(film);
+            const bool result = film->Deserialize.Implemented() && Checkpoint::Load(CheckpointTag, [&](std::istream& in) -> bool
+            {
+                return Checkpoint::Read(in, baseSamples) && Checkpoint::Read(in, baseElapsed) && baseFilm->Deserialize(in);
+            });
+
+            if (result)
+            {
+                LM_LOG_INFO(boost::str(boost::format("# of samples: %d") % baseSamples));
+
+                // Use the RNG streams different from the ones before the checkpoint
+                initRng->SetSeed(Random::DeriveSeed(initRng->NextUInt(), baseSamples));
+            }
+            else
+            {
+                LM_LOG_WARN("Failed to load checkpoint. Rendering from scratch.");
+                baseFilm.reset();
+                baseSamples = 0;
+                baseElapsed = 0;
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Shared film
+
+        // If the film supports concurrent splats, all threads directly record to the given film.
+        // This avoids per-thread copies of the film and the gather step at the end of the rendering.
+        // The shared film is not used with checkpoints because the checkpoint needs the film data
+        // consistent with the number of samples.
+        const bool sharedFilm = film->SupportsConcurrentSplat.Implemented() && film->SupportsConcurrentSplat() && !checkpoint;
+        if (sharedFilm)
+        {
+            film->Clear();
+            if (baseFilm)
+            {
+                film->Accumulate(baseFilm.get());
+            }
+        }
+
+        #pragma endregion
 
         // --------------------------------------------------------------------------------
 
@@ -85,13 +192,23 @@ public:
 
         struct Context
         {
-            int id = -1;						        // Thread ID
-            Random rng;							        // Thread-specific RNG
-            Film::UniquePtr film{ nullptr, nullptr };	// Thread specific film
-            long long processedSamples = 0;	        	// Temp for counting # of processed samples
+            int id = -1;						            // Thread ID
+            Random rng;							            // Thread-specific RNG
+            Film::UniquePtr film{ nullptr, nullptr };	    // Thread specific film
+            long long processedSamples = 0;	            	// Temp for counting # of processed samples
+
+            // Double buffering for progress images and checkpoints.
+            // When the epoch is advanced, the thread hands its film over to the writer thread
+            // by swapping it with the (cleared) back film, and continues rendering without waiting.
+            int epoch = 0;                                  // Epoch of the last hand-over
+            long long filmSamples = 0;                      // # of samples recorded in `film`
+            Film::UniquePtr backFilm{ nullptr, nullptr };   // Film handed over to the writer thread
+            long long backFilmSamples = 0;                  // # of samples recorded in `backFilm`
+            std::atomic<bool> backFilmReady{ false };       // True if `backFilm` is waiting for the writer thread
         };
 
         tbb::enumerable_thread_specific<Context> contexts;
+        std::vector<Context*> initializedContexts;
         std::mutex contextInitMutex;
         int currentThreadID = 0;
 
@@ -99,15 +216,157 @@ public:
 
         // --------------------------------------------------------------------------------
 
+        #pragma region Progress image writer
+
+        // Intermediate images and checkpoints are merged and saved in a background thread,
+        // so that the worker threads do not need to stop the rendering.
+        std::atomic<int> epoch(0);
+        std::atomic<long long> processedSamples(baseSamples);
+        std::thread writerThread;
+        std::mutex writerMutex;
+        std::condition_variable writerCond;
+        bool writerFinished = false;
+
+        const auto renderStartTime = std::chrono::high_resolution_clock::now() - std::chrono::milliseconds((long long)(baseElapsed * 1000.0));
+        const auto Elapsed = [&]() -> double
+        {
+            const auto currentTime = std::chrono::high_resolution_clock::now();
+            return (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+        };
+
+        if (progressImageUpdateInterval_ > 0 || checkpoint)
+        {
+            writerThread = std::thread([&]() -> void
+            {
+                // Accumulated film of the handed-over films
+                auto masterFilm = ComponentFactory::Clone<Film>(film);
+                masterFilm->Clear();
+                long long masterSamples = 0;
+                if (baseFilm)
+                {
+                    masterFilm->Accumulate(baseFilm.get());
+                    masterSamples = baseSamples;
+                }
+
+                long long progressImageCount = 0;
+                auto prevImageUpdateTime = std::chrono::high_resolution_clock::now();
+                auto prevCheckpointTime = prevImageUpdateTime;
+                const double waitInterval =
+                    progressImageUpdateInterval_ > 0 && checkpoint ? std::min(progressImageUpdateInterval_, Checkpoint::GetInterval()) :
+                    progressImageUpdateInterval_ > 0 ? progressImageUpdateInterval_ : Checkpoint::GetInterval();
+                const auto SecondsSince = [](const std::chrono::high_resolution_clock::time_point& t) -> double
+                {
+                    return (double)(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - t).count()) / 1000.0;
+                };
+
+                while (true)
+                {
+                    #pragma region Wait for the next update
+
+                    {
+                        std::unique_lock<std::mutex> lock(writerMutex);
+                        writerCond.wait_for(lock, std::chrono::milliseconds((long long)(waitInterval * 1000.0)), [&]() { return writerFinished; });
+                        if (writerFinished)
+                        {
+                            break;
+                        }
+                    }
+
+                    #pragma endregion
+
+                    // --------------------------------------------------------------------------------
+
+                    #pragma region Gather film data
+
+                    Film::UniquePtr progressFilm{ nullptr, nullptr };
+                    if (sharedFilm)
+                    {
+                        // The shared film is still being accumulated, so the progress image is created from its copy
+                        progressFilm = ComponentFactory::Clone<Film>(film);
+                        masterSamples = processedSamples;
+                    }
+                    else
+                    {
+                        // Merge the films handed over since the last update
+                        std::vector<Context*> ctxs;
+                        {
+                            std::unique_lock<std::mutex> lock(contextInitMutex);
+                            ctxs = initializedContexts;
+                        }
+                        for (auto* ctx : ctxs)
+                        {
+                            if (ctx->backFilmReady.load(std::memory_order_acquire))
+                            {
+                                masterFilm->Accumulate(ctx->backFilm.get());
+                                masterSamples += ctx->backFilmSamples;
+                                ctx->backFilm->Clear();
+                                ctx->backFilmSamples = 0;
+                                ctx->backFilmReady.store(false, std::memory_order_release);
+                            }
+                        }
+
+                        // Request the threads to hand over their films for the next update
+                        epoch++;
+                    }
+
+                    #pragma endregion
+
+                    // --------------------------------------------------------------------------------
+
+                    #pragma region Save checkpoint
+
+                    if (checkpoint && SecondsSince(prevCheckpointTime) >= Checkpoint::GetInterval())
+                    {
+                        SaveCheckpoint(masterFilm.get(), masterSamples, Elapsed());
+                        prevCheckpointTime = std::chrono::high_resolution_clock::now();
+                    }
+
+                    #pragma endregion
+
+                    // --------------------------------------------------------------------------------
+
+                    #pragma region Save image
+
+                    if (progressImageUpdateInterval_ > 0 && masterSamples > 0 && SecondsSince(prevImageUpdateTime) >= progressImageUpdateInterval_)
+                    {
+                        if (!progressFilm)
+                        {
+                            progressFilm = ComponentFactory::Clone<Film>(masterFilm.get());
+                        }
+                        progressFilm->Rescale((Float)(film->Width() * film->Height()) / masterSamples);
+
+                        progressImageCount++;
+                        const auto path = boost::str(boost::format("progress_%010d") % progressImageCount);
+                        {
+                            LM_LOG_INFO("Saving progress: ");
+                            LM_LOG_INDENTER();
+                            progressFilm->Save(path);
+                        }
+                        prevImageUpdateTime = std::chrono::high_resolution_clock::now();
+                    }
+
+                    #pragma endregion
+                }
+
+                // Return the remaining data to the main thread
+                if (!sharedFilm)
+                {
+                    film->Clear();
+                    film->Accumulate(masterFilm.get());
+                }
+            });
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
         #pragma region Render loop
 
-        std::atomic<long long> processedSamples(0);
-        long long progressImageCount = 0;
-        const auto renderStartTime = std::chrono::high_resolution_clock::now();
-        auto prevImageUpdateTime = renderStartTime;
-        const long long NumSamples = renderTime_ < 0 ? numSamples_ : grainSize_ * 1000;
+        const long long NumSamples = renderTime_ < 0 ? std::max(0LL, numSamples - baseSamples) : grainSize_ * 1000;
+        const bool finished = renderTime_ < 0 ? NumSamples == 0 : baseElapsed > renderTime_;
 
-        while (true)
+        while (!finished)
         {
             #pragma region Helper function
 
@@ -120,7 +379,7 @@ public:
                 {
                     if (ctx.id == 0)
                     {
-                        const double progress = (double)(processedSamples) / numSamples_ * 100.0;
+                        const double progress = (double)(processedSamples) / numSamples * 100.0;
                         LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
                     }
                 }
@@ -136,6 +395,21 @@ public:
                 }
             };
 
+            const auto HandOverFilm = [&](Context& ctx) -> void
+            {
+                // Skip if the writer thread has not yet consumed the previous film
+                if (ctx.backFilmReady.load(std::memory_order_acquire))
+                {
+                    return;
+                }
+
+                std::swap(ctx.film, ctx.backFilm);
+                ctx.backFilmSamples = ctx.filmSamples;
+                ctx.filmSamples = 0;
+                ctx.epoch = epoch;
+                ctx.backFilmReady.store(true, std::memory_order_release);
+            };
+
             #pragma endregion
 
             // --------------------------------------------------------------------------------
@@ -143,62 +417,78 @@ public:
             #pragma region Parallel loop
 
             std::atomic<bool> done(false);
-            tbb::parallel_for(tbb::blocked_range<long long>(0, NumSamples, grainSize_), [&](const tbb::blocked_range<long long>& range) -> void
+            Parallel::Execute([&]() -> void
             {
-                if (done)
+                tbb::parallel_for(tbb::blocked_range<long long>(0, NumSamples, grainSize_), [&](const tbb::blocked_range<long long>& range) -> void
                 {
-                    return;
-                }
+                    if (done)
+                    {
+                        return;
+                    }
 
-                // --------------------------------------------------------------------------------
+                    // --------------------------------------------------------------------------------
 
-                #pragma region Thread local storage
+                    #pragma region Thread local storage
 
-                auto& ctx = contexts.local();
-                if (ctx.id < 0)
-                {
-                    std::unique_lock<std::mutex> lock(contextInitMutex);
-                    ctx.id = currentThreadID++;
-                    ctx.rng.SetSeed(initRng->NextUInt());
-                    ctx.film = ComponentFactory::Clone<Film>(film);
-                }
+                    auto& ctx = contexts.local();
+                    if (ctx.id < 0)
+                    {
+                        std::unique_lock<std::mutex> lock(contextInitMutex);
+                        ctx.id = currentThreadID++;
+                        ctx.rng.SetSeed(initRng->NextUInt());
+                        if (!sharedFilm)
+                        {
+                            ctx.film = ComponentFactory::Clone<Film>(film);
+                            if (progressImageUpdateInterval_ > 0 || checkpoint)
+                            {
+                                ctx.backFilm = ComponentFactory::Clone<Film>(film);
+                                ctx.backFilm->Clear();
+                            }
+                        }
+                        initializedContexts.push_back(&ctx);
+                    }
 
-                #pragma endregion
+                    #pragma endregion
 
-                // --------------------------------------------------------------------------------
+                    // --------------------------------------------------------------------------------
 
-                #pragma region Sample loop
+                    #pragma region Sample loop
 
-                for (long long sample = range.begin(); sample != range.end(); sample++)
-                {
-                    // Process sampleprocessedSamples
-                    processSampleFunc(ctx.film.get(), &ctx.rng);
+                    // Hand over the film if requested by the writer thread
+                    if (ctx.backFilm && ctx.epoch != epoch.load(std::memory_order_relaxed))
+                    {
+                        HandOverFilm(ctx);
+                    }
+
+                    // Process samples in the range at once
+                    processBatchFunc(sharedFilm ? film : ctx.film.get(), &ctx.rng, range.size());
 
                     // Report progress
-                    ctx.processedSamples++;
+                    ctx.filmSamples += range.size();
+                    ctx.processedSamples += range.size();
                     if (ctx.processedSamples > progressUpdateInterval_)
                     {
                         ProcessProgress(ctx);
                     }
-                }
 
-                #pragma endregion
+                    #pragma endregion
 
-                // --------------------------------------------------------------------------------
+                    // --------------------------------------------------------------------------------
 
-                #pragma region Check termination
+                    #pragma region Check termination
 
-                if (renderTime_ > 0)
-                {
-                    const auto currentTime = std::chrono::high_resolution_clock::now();
-                    const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
-                    if (elapsed > renderTime_)
+                    if (renderTime_ > 0)
                     {
-                        done = true;
+                        const auto currentTime = std::chrono::high_resolution_clock::now();
+                        const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+                        if (elapsed > renderTime_)
+                        {
+                            done = true;
+                        }
                     }
-                }
 
-                #pragma endregion
+                    #pragma endregion
+                });
             });
 
             #pragma endregion
@@ -216,48 +506,6 @@ public:
 
             // --------------------------------------------------------------------------------
 
-            #pragma region Progress update of intermediate image
-
-            if (progressImageUpdateInterval_ > 0)
-            {
-                const auto currentTime = std::chrono::high_resolution_clock::now();
-                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - prevImageUpdateTime).count()) / 1000.0;
-                if (elapsed > progressImageUpdateInterval_)
-                {
-                    // Gather film data
-                    film->Clear();
-                    contexts.combine_each([&](const Context& ctx)
-                    {
-                        film->Accumulate(ctx.film.get());
-                    });
-
-                    // Rescale
-                    film->Rescale((Float)(film->Width() * film->Height()) / processedSamples);
-
-                    // Output path
-                    progressImageCount++;
-                    std::string path;
-                    {
-                        std::unordered_map<std::string, std::string> dict;
-                        path = boost::str(boost::format("progress_%010d") % progressImageCount);
-                    }
-
-                    // Save image
-                    {
-                        LM_LOG_INFO("Saving progress: ");
-                        LM_LOG_INDENTER();
-                        film->Save(path);
-                    }
-
-                    // Update time
-                    prevImageUpdateTime = currentTime;
-                }
-            }
-
-            #pragma endregion
-
-            // --------------------------------------------------------------------------------
-
             #pragma region Exit condition
 
             if (renderTime_ < 0 || done)
@@ -277,12 +525,44 @@ public:
 
         #pragma region Gather film data
 
+        // Stop the writer thread, which leaves the merged film data in `film`
+        if (writerThread.joinable())
+        {
+            {
+                std::unique_lock<std::mutex> lock(writerMutex);
+                writerFinished = true;
+            }
+            writerCond.notify_one();
+            writerThread.join();
+        }
+        else if (!sharedFilm)
+        {
+            film->Clear();
+            if (baseFilm)
+            {
+                film->Accumulate(baseFilm.get());
+            }
+        }
+
         // Gather film data
-        film->Clear();
-        contexts.combine_each([&](const Context& ctx)
+        if (!sharedFilm)
         {
-            film->Accumulate(ctx.film.get());
-        });
+            contexts.combine_each([&](const Context& ctx)
+            {
+                film->Accumulate(ctx.film.get());
+                if (ctx.backFilmReady)
+                {
+                    film->Accumulate(ctx.backFilm.get());
+                }
+            });
+        }
+
+        // Save final state so that the rendering can be continued later with more samples,
+        // or merged with the results of the other worker processes
+        if (checkpoint || (numWorkers > 1 && film->Serialize.Implemented()))
+        {
+            SaveCheckpoint(film, processedSamples, Elapsed());
+        }
 
         // Rescale
         film->Rescale((Float)(film->Width() * film->Height()) / processedSamples);
@@ -299,6 +579,146 @@ public:
         return numSamples_;
     };
 
+private:
+
+    /*
+        Deterministic version of the render loop.
+        The samples are split into blocks of `grainSize_` samples, and the RNG of each block
+        is seeded with a hash of (initial seed, block index). The blocks are distributed
+        to a fixed number of streams, each of which records its blocks in order to its own film,
+        and the films are gathered in the order of the streams.
+        Thus the result is identical irrespective of the number of threads and the scheduling.
+        Note that the parallelism is limited by the number of streams.
+    */
+    auto ProcessDeterministic(Film* film, Random* initRng, const std::function<void(Film*, Random*, long long)>& processBatchFunc) -> long long
+    {
+        if (progressImageUpdateInterval_ > 0)
+        {
+            LM_LOG_WARN("Progress images are not supported in deterministic mode");
+        }
+        if (Checkpoint::Enabled() || Checkpoint::GetResume())
+        {
+            LM_LOG_WARN("Checkpoints are not supported in deterministic mode");
+        }
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Worker process
+
+        // The worker process renders the blocks assigned in the round-robin manner.
+        // Since the RNGs are seeded by the global block indices, the worker processes
+        // together evaluate exactly the same samples as the rendering with a single process.
+        const int numWorkers = Parallel::GetNumWorkers();
+        const int workerIndex = Parallel::GetWorkerIndex();
+        const long long numBlocks = (numSamples_ + grainSize_ - 1) / grainSize_;
+        const long long numLocalBlocks = workerIndex < numBlocks ? (numBlocks - workerIndex + numWorkers - 1) / numWorkers : 0;
+        long long numSamples = 0;
+        for (long long block = workerIndex; block < numBlocks; block += numWorkers)
+        {
+            numSamples += std::min(grainSize_, numSamples_ - block * grainSize_);
+        }
+        if (numWorkers > 1)
+        {
+            LM_LOG_INFO(boost::str(boost::format("Worker process %d / %d (%d samples)") % workerIndex % numWorkers % numSamples));
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Streams
+
+        struct Stream
+        {
+            Random rng;
+            Film::UniquePtr film{ nullptr, nullptr };
+        };
+
+        const auto seed = initRng->NextUInt();
+        std::vector<Stream> streams(numStreams_);
+        for (auto& stream : streams)
+        {
+            stream.film = ComponentFactory::Clone<Film>(film);
+            stream.film->Clear();
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Render loop
+
+        std::atomic<long long> processedSamples(0);
+        Parallel::Execute([&]() -> void
+        {
+            tbb::parallel_for(0, numStreams_, [&](int streamIndex) -> void
+            {
+                auto& stream = streams[streamIndex];
+                for (long long localBlock = streamIndex; localBlock < numLocalBlocks; localBlock += numStreams_)
+                {
+                    const long long block = workerIndex + localBlock * numWorkers;
+
+                    // Process samples in the block
+                    stream.rng.SetSeed(Random::DeriveSeed(seed, block));
+                    const long long begin = block * grainSize_;
+                    const long long end = std::min(begin + grainSize_, numSamples_);
+                    processBatchFunc(stream.film.get(), &stream.rng, end - begin);
+
+                    // Report progress
+                    processedSamples += end - begin;
+                    if (streamIndex == 0)
+                    {
+                        const double progress = (double)(processedSamples) / numSamples * 100.0;
+                        LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+                    }
+                }
+            });
+        });
+
+        LM_LOG_INFO("Progress: 100.0%");
+        LM_LOG_INFO(boost::str(boost::format("# of samples: %d") % processedSamples));
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Gather film data
+
+        film->Clear();
+        for (const auto& stream : streams)
+        {
+            film->Accumulate(stream.film.get());
+        }
+
+        // Save the partial result of the worker process
+        if (numWorkers > 1 && film->Serialize.Implemented())
+        {
+            SaveCheckpoint(film, processedSamples, 0);
+        }
+
+        if (processedSamples > 0)
+        {
+            film->Rescale((Float)(film->Width() * film->Height()) / processedSamples);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return processedSamples;
+    }
+
+    // Save the film data with the number of samples as the checkpoint
+    auto SaveCheckpoint(Film* film, long long samples, double elapsed) const -> bool
+    {
+        return Checkpoint::Save(CheckpointTag, [&](std::ostream& out) -> bool
+        {
+            Checkpoint::Write(out, samples);
+            Checkpoint::Write(out, elapsed);
+            return film->Serialize(out);
+        });
+    }
+
 private:
 
     long long grainSize_;
@@ -307,6 +727,8 @@ private:
 
     long long numSamples_;      //!< Number of samples
     double renderTime_;         //!< Render time
+    bool deterministic_;        //!< Deterministic mode
+    int numStreams_;            //!< Number of streams in deterministic mode
 
 };
 
@@ -0,0 +1,504 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/scheduler.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/detail/parallel.h>
+#include <tbb/tbb.h>
+
+LM_NAMESPACE_BEGIN
+
+/*
+    View of a film capturing the contribution of a sample.
+    All contributions splatted while processing a sample are accumulated to a single value,
+    which is recorded to the statistics of the pixel of the sample by the scheduler.
+    The contributions splatted to the other pixels (e.g., light tracing) cannot be represented
+    and are reported by `OffPixel`. The values of the auxiliary layers are buffered
+    and forwarded to the underlying film by `Flush`.
+*/
+class Film_SampleView final : public Film
+{
+public:
+
+    LM_IMPL_CLASS(Film_SampleView, Film);
+
+public:
+
+    LM_IMPL_F(Width) = [this]() -> int
+    {
+        return film_->Width();
+    };
+
+    LM_IMPL_F(Height) = [this]() -> int
+    {
+        return film_->Height();
+    };
+
+    LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
+    {
+        const int width = film_->Width();
+        const int height = film_->Height();
+        const int pX = Math::Clamp((int)(rasterPos.x * Float(width)), 0, width - 1);
+        const int pY = Math::Clamp((int)(rasterPos.y * Float(height)), 0, height - 1);
+        if ((long long)(pY) * width + pX != pixel_)
+        {
+            offPixel_ = true;
+            return;
+        }
+        value_ += v.ToRGB();
+    };
+
+    LM_IMPL_F(SplatLayer) = [this](int layer, const Vec2& rasterPos, const Vec3& v) -> void
+    {
+        if (!film_->SplatLayer.Implemented())
+        {
+            return;
+        }
+        layers_.push_back({ layer, rasterPos, v });
+    };
+
+    LM_IMPL_F(PixelIndex) = [this](const Vec2& rasterPos) -> int
+    {
+        return film_->PixelIndex(rasterPos);
+    };
+
+public:
+
+    Film_SampleView(Film* film, std::mutex* mutex)
+        : film_(film)
+        , mutex_(mutex)
+    {}
+
+public:
+
+    // Start processing a sample of the pixel
+    auto Begin(long long pixel) -> void
+    {
+        pixel_ = pixel;
+        value_ = Vec3();
+    }
+
+    // Contribution of the sample
+    auto Value() const -> const Vec3&
+    {
+        return value_;
+    }
+
+    // True if the contributions are splatted outside of the pixels of the samples
+    auto OffPixel() const -> bool
+    {
+        return offPixel_;
+    }
+
+    // Forward the buffered values of the layers to the underlying film
+    auto Flush() -> void
+    {
+        if (layers_.empty())
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(*mutex_);
+        for (const auto& l : layers_)
+        {
+            film_->SplatLayer(l.layer, l.rasterPos, l.v);
+        }
+        layers_.clear();
+    }
+
+private:
+
+    struct BufferedLayer
+    {
+        int layer;
+        Vec2 rasterPos;
+        Vec3 v;
+    };
+
+private:
+
+    Film* film_;
+    std::mutex* mutex_;
+    long long pixel_ = 0;
+    Vec3 value_;
+    bool offPixel_ = false;
+    std::vector<BufferedLayer> layers_;
+
+};
+
+// --------------------------------------------------------------------------------
+
+/*
+    Adaptive scheduler.
+    Distributes the samples to the pixels according to the estimated variance.
+    The scheduler tracks the sum, the second moment of the luminance, and the number of samples
+    for each pixel. After the initial pass with `initial_samples` samples per pixel, every pass
+    distributes the budget of `samples_per_pass` samples per pixel (on average) in proportion to
+    the relative error of the pixels, and the pixels with the relative error below `threshold`
+    are excluded from the later passes. The pixel values are the mean of the samples of the pixel.
+    The variance is estimated over the blocks of `block_size`^2 pixels, since a pixel with
+    a few samples often observes no non-zero contributions and would be regarded as converged.
+    The means of the pixels are splatted to the centers of the pixels with the filter of the film.
+    Only the renderers utilizing `ProcessRaster` and splatting the contributions to the pixels of
+    the samples benefit from the scheduler; if a contribution is splatted to the other pixel,
+    the rendering falls back to the default scheduler. `Process` and `ProcessBatch` are delegated
+    to the default scheduler.
+*/
+class Scheduler_Adaptive final : public Scheduler
+{
+public:
+
+    LM_IMPL_CLASS(Scheduler_Adaptive, Scheduler);
+
+public:
+
+    LM_IMPL_F(Load) = [this](const PropertyNode* prop) -> void
+    {
+        #pragma region Load parameters
+
+        sched_->Load(prop);
+        numSamples_ = prop->ChildAs<long long>("num_samples", 10000000L);
+        renderTime_ = prop->ChildAs<double>("render_time", -1);
+        initialSamples_ = std::max(2, prop->ChildAs<int>("initial_samples", 16));
+        samplesPerPass_ = std::max(1, prop->ChildAs<int>("samples_per_pass", 4));
+        threshold_ = prop->ChildAs<Float>("threshold", 0.01_f);
+        blockSize_ = std::max(1, prop->ChildAs<int>("block_size", 8));
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Print loaded parameters
+
+        {
+            LM_LOG_INFO("Loaded parameters");
+            LM_LOG_INDENTER();
+            LM_LOG_INFO("num_samples                    = " + std::to_string(numSamples_));
+            LM_LOG_INFO("render_time                    = " + std::to_string(renderTime_));
+            LM_LOG_INFO("initial_samples                = " + std::to_string(initialSamples_));
+            LM_LOG_INFO("samples_per_pass               = " + std::to_string(samplesPerPass_));
+            LM_LOG_INFO("threshold                      = " + std::to_string(threshold_));
+            LM_LOG_INFO("block_size                     = " + std::to_string(blockSize_));
+        }
+
+        #pragma endregion
+    };
+
+    LM_IMPL_F(Process) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*)>& processSampleFunc) -> long long
+    {
+        return sched_->Process(scene, film, initRng, processSampleFunc);
+    };
+
+    LM_IMPL_F(ProcessBatch) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, long long)>& processBatchFunc) -> long long
+    {
+        return sched_->ProcessBatch(scene, film, initRng, processBatchFunc);
+    };
+
+    LM_IMPL_F(GetNumSamples) = [this]() -> long long
+    {
+        return numSamples_;
+    };
+
+    LM_IMPL_F(ProcessRaster) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, const Vec2&)>& processSampleFunc) -> long long
+    {
+        #pragma region Pixel statistics
+
+        struct PixelStats
+        {
+            Vec3 sum;                   // Sum of the contributions
+            Float sumL = 0_f;           // Sum of the luminance
+            Float sumL2 = 0_f;          // Sum of the squared luminance
+            long long n = 0;            // Number of samples
+            long long passSamples = 0;  // Number of samples assigned in the current pass
+            bool converged = false;     // True if the pixel is converged
+        };
+
+        const int width = film->Width();
+        const int height = film->Height();
+        const long long numPixels = (long long)(width) * height;
+        std::vector<PixelStats> stats(numPixels);
+
+        // Mean and variance of the luminance of a sample in the blocks
+        struct BlockStats
+        {
+            Float mean;
+            Float var;
+        };
+        const int numBlocksX = (width + blockSize_ - 1) / blockSize_;
+        const int numBlocksY = (height + blockSize_ - 1) / blockSize_;
+        std::vector<BlockStats> blockStats(numBlocksX * numBlocksY);
+        const auto BlockIndex = [&](long long i) -> int
+        {
+            return (int)((i / width) / blockSize_) * numBlocksX + (int)((i % width) / blockSize_);
+        };
+        const auto UpdateBlockStats = [&]() -> void
+        {
+            std::vector<Float> sumL(blockStats.size(), 0_f), sumL2(blockStats.size(), 0_f), n(blockStats.size(), 0_f);
+            for (long long i = 0; i < numPixels; i++)
+            {
+                const int b = BlockIndex(i);
+                sumL[b] += stats[i].sumL;
+                sumL2[b] += stats[i].sumL2;
+                n[b] += Float(stats[i].n);
+            }
+            for (size_t b = 0; b < blockStats.size(); b++)
+            {
+                blockStats[b].mean = sumL[b] / n[b];
+                blockStats[b].var = std::max(0_f, sumL2[b] / n[b] - blockStats[b].mean * blockStats[b].mean) * n[b] / (n[b] - 1_f);
+            }
+        };
+
+        // Relative error of the mean of the pixel
+        const auto RelativeError = [&](long long i) -> Float
+        {
+            const auto& b = blockStats[BlockIndex(i)];
+            const Float stderror = Math::Sqrt(b.var / Float(stats[i].n));
+            return b.mean > 0_f ? stderror / b.mean : (stderror > 0_f ? Math::Inf() : 0_f);
+        };
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Thread local storage
+
+        struct Context
+        {
+            Random rng;                                 // Thread-specific RNG
+            std::unique_ptr<Film_SampleView> view;      // Thread-specific film view
+        };
+
+        tbb::enumerable_thread_specific<Context> contexts;
+        std::mutex contextInitMutex;
+        std::mutex filmMutex;
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Render loop
+
+        long long processedSamples = 0;
+        const auto renderStartTime = std::chrono::high_resolution_clock::now();
+
+        for (int pass = 0; ; pass++)
+        {
+            #pragma region Assign samples
+
+            long long passSamples = 0;
+            if (pass == 0)
+            {
+                for (auto& s : stats)
+                {
+                    s.passSamples = initialSamples_;
+                }
+                passSamples = numPixels * initialSamples_;
+            }
+            else
+            {
+                // Check convergence and compute the weights
+                UpdateBlockStats();
+                std::vector<Float> weights(numPixels, 0_f);
+                Float sumWeights = 0_f;
+                long long numConverged = 0;
+                for (long long i = 0; i < numPixels; i++)
+                {
+                    auto& s = stats[i];
+                    if (!s.converged)
+                    {
+                        const auto e = RelativeError(i);
+                        if (e < threshold_)
+                        {
+                            s.converged = true;
+                        }
+                        else
+                        {
+                            weights[i] = std::min(e, 1_f);
+                            sumWeights += weights[i];
+                        }
+                    }
+                    if (s.converged)
+                    {
+                        numConverged++;
+                    }
+                }
+
+                LM_LOG_INFO(boost::str(boost::format("Pass %d: converged %d / %d pixels") % pass % numConverged % numPixels));
+                if (sumWeights == 0_f)
+                {
+                    break;
+                }
+
+                // Distribute the budget of the pass in proportion to the weights
+                const long long budget = renderTime_ < 0
+                    ? std::min(numPixels * samplesPerPass_, numSamples_ - processedSamples)
+                    : numPixels * samplesPerPass_;
+                for (long long i = 0; i < numPixels; i++)
+                {
+                    auto& s = stats[i];
+                    s.passSamples = weights[i] > 0_f ? (long long)(Float(budget) * weights[i] / sumWeights + 0.5_f) : 0;
+                    passSamples += s.passSamples;
+                }
+                if (passSamples == 0)
+                {
+                    break;
+                }
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Parallel loop over pixels
+
+            Parallel::Execute([&]() -> void
+            {
+                tbb::parallel_for(tbb::blocked_range<long long>(0, numPixels, 64), [&](const tbb::blocked_range<long long>& range) -> void
+                {
+                    auto& ctx = contexts.local();
+                    if (!ctx.view)
+                    {
+                        std::unique_lock<std::mutex> lock(contextInitMutex);
+                        ctx.rng.SetSeed(initRng->NextUInt());
+                        ctx.view.reset(new Film_SampleView(film, &filmMutex));
+                    }
+
+                    for (long long i = range.begin(); i != range.end(); i++)
+                    {
+                        auto& s = stats[i];
+                        const int x = (int)(i % width);
+                        const int y = (int)(i / width);
+                        for (long long sample = 0; sample < s.passSamples; sample++)
+                        {
+                            ctx.view->Begin(i);
+                            const Vec2 rasterPos((Float(x) + ctx.rng.Next()) / Float(width), (Float(y) + ctx.rng.Next()) / Float(height));
+                            processSampleFunc(ctx.view.get(), &ctx.rng, rasterPos);
+
+                            const auto& v = ctx.view->Value();
+                            const auto L = Math::Luminance(v);
+                            s.sum += v;
+                            s.sumL += L;
+                            s.sumL2 += L * L;
+                            s.n++;
+                        }
+                    }
+
+                    ctx.view->Flush();
+                });
+            });
+
+            processedSamples += passSamples;
+
+            // Fall back to the default scheduler if the contributions are not representable
+            for (const auto& ctx : contexts)
+            {
+                if (ctx.view && ctx.view->OffPixel())
+                {
+                    LM_LOG_WARN("Contributions splatted outside of the pixels of the samples are not supported by 'scheduler::adaptive'");
+                    LM_LOG_WARN("Falling back to the default scheduler");
+                    film->Clear();
+                    return sched_->Process(scene, film, initRng, [&](Film* film, Random* rng) -> void
+                    {
+                        processSampleFunc(film, rng, rng->Next2D());
+                    });
+                }
+            }
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Exit condition
+
+            if (renderTime_ < 0)
+            {
+                const double progress = (double)(processedSamples) / numSamples_ * 100.0;
+                LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+                if (processedSamples >= numSamples_)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                const auto currentTime = std::chrono::high_resolution_clock::now();
+                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+                LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%% (%.1fs / %.1fs)") % (elapsed / renderTime_ * 100.0) % elapsed % renderTime_));
+                if (elapsed > renderTime_)
+                {
+                    break;
+                }
+            }
+
+            #pragma endregion
+        }
+
+        LM_LOG_INFO("Progress: 100.0%");
+        LM_LOG_INFO(boost::str(boost::format("# of samples: %d") % processedSamples));
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Record to film
+
+        // Splat the means of the pixels to the centers of the pixels with the filter of the film,
+        // keeping the auxiliary layers recorded while rendering
+        for (long long i = 0; i < numPixels; i++)
+        {
+            const auto& s = stats[i];
+            if (s.n > 0)
+            {
+                const Vec2 rasterPos((Float(i % width) + 0.5_f) / Float(width), (Float(i / width) + 0.5_f) / Float(height));
+                film->Splat(rasterPos, SPD::FromRGB(s.sum / Float(s.n)));
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return processedSamples;
+    };
+
+private:
+
+    Scheduler::UniquePtr sched_ = ComponentFactory::Create<Scheduler>();
+
+    int initialSamples_;
+    int samplesPerPass_;
+    Float threshold_;
+    int blockSize_;
+
+    long long numSamples_;      //!< Number of samples
+    double renderTime_;         //!< Render time
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Scheduler_Adaptive, "scheduler::adaptive");
+
+LM_NAMESPACE_END
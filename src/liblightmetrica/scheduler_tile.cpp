@@ -0,0 +1,455 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch.h>
+#include <lightmetrica/scheduler.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
+#include <lightmetrica/detail/filtertable.h>
+#include <tbb/tbb.h>
+
+LM_NAMESPACE_BEGIN
+
+/*
+    View of a film used by a thread processing the tiles.
+    The splats are accumulated to a thread-local block of pixels covering the current tile
+    and the apron around it (large enough for the footprint of any reconstruction filter)
+    with the filter of the underlying film (`Film::SplatBlock`), and the block is added to the film
+    once per tile (`Film::AccumulateBlock`), so that the threads rarely contend for the lock of the shared film.
+    The splats outside of the block (e.g., light tracing), the auxiliary layers,
+    and the splats to the films not supporting the blocks are buffered with their raster positions
+    and replayed to the film in batches.
+*/
+class Film_TileView final : public Film
+{
+public:
+
+    LM_IMPL_CLASS(Film_TileView, Film);
+
+public:
+
+    LM_IMPL_F(Width) = [this]() -> int
+    {
+        return film_->Width();
+    };
+
+    LM_IMPL_F(Height) = [this]() -> int
+    {
+        return film_->Height();
+    };
+
+    LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
+    {
+        if (blockSupported_ && film_->SplatBlock(blockX_, blockY_, blockW_, blockH_, block_.data(), rasterPos, v))
+        {
+            blockUsed_ = true;
+            return;
+        }
+        splats_.push_back({ -1, rasterPos, v.ToRGB() });
+        if (splats_.size() >= MaxNumBufferedSplats)
+        {
+            Flush();
+        }
+    };
+
+    LM_IMPL_F(SplatLayer) = [this](int layer, const Vec2& rasterPos, const Vec3& v) -> void
+    {
+        if (!film_->SplatLayer.Implemented())
+        {
+            return;
+        }
+        splats_.push_back({ layer, rasterPos, v });
+        if (splats_.size() >= MaxNumBufferedSplats)
+        {
+            Flush();
+        }
+    };
+
+    LM_IMPL_F(SetPixel) = [this](int x, int y, const SPD& v) -> void
+    {
+        std::unique_lock<std::mutex> lock(*mutex_);
+        film_->SetPixel(x, y, v);
+    };
+
+    LM_IMPL_F(PixelIndex) = [this](const Vec2& rasterPos) -> int
+    {
+        return film_->PixelIndex(rasterPos);
+    };
+
+public:
+
+    Film_TileView(Film* film, std::mutex* mutex)
+        : film_(film)
+        , mutex_(mutex)
+        , blockSupported_(film->SplatBlock.Implemented() && film->AccumulateBlock.Implemented())
+    {}
+
+public:
+
+    // Begin to process the tile [x0, x1) * [y0, y1)
+    auto Begin(int x0, int y0, int x1, int y1) -> void
+    {
+        if (!blockSupported_)
+        {
+            return;
+        }
+
+        // Block of the tile with the apron, clipped by the film
+        const int apron = (int)(std::ceil(FilterTable::MaxRadius())) + 1;
+        blockX_ = std::max(0, x0 - apron);
+        blockY_ = std::max(0, y0 - apron);
+        blockW_ = std::min(film_->Width(), x1 + apron) - blockX_;
+        blockH_ = std::min(film_->Height(), y1 + apron) - blockY_;
+        block_.assign(blockW_ * blockH_, Vec3());
+        blockUsed_ = false;
+    }
+
+    // Forward the block and the buffered splats to the underlying film
+    auto Flush() -> void
+    {
+        std::unique_lock<std::mutex> lock(*mutex_);
+        if (blockUsed_)
+        {
+            film_->AccumulateBlock(blockX_, blockY_, blockW_, blockH_, block_.data());
+            std::fill(block_.begin(), block_.end(), Vec3());
+            blockUsed_ = false;
+        }
+        for (const auto& splat : splats_)
+        {
+            if (splat.layer < 0)
+            {
+                film_->Splat(splat.rasterPos, SPD::FromRGB(splat.v));
+            }
+            else
+            {
+                film_->SplatLayer(splat.layer, splat.rasterPos, splat.v);
+            }
+        }
+        splats_.clear();
+    }
+
+private:
+
+    static const size_t MaxNumBufferedSplats = 1 << 16;
+
+    // Buffered splat. `layer` is -1 for the rendered image.
+    struct BufferedSplat
+    {
+        int layer;
+        Vec2 rasterPos;
+        Vec3 v;
+    };
+
+private:
+
+    Film* film_;
+    std::mutex* mutex_;
+    std::vector<BufferedSplat> splats_;
+
+    // Block of the pixels of the current tile
+    bool blockSupported_;
+    bool blockUsed_ = false;
+    int blockX_ = 0;
+    int blockY_ = 0;
+    int blockW_ = 0;
+    int blockH_ = 0;
+    std::vector<Vec3> block_;
+
+};
+
+// --------------------------------------------------------------------------------
+
+/*
+    Tile-based scheduler.
+    Splits the screen into tiles and processes the tiles in parallel.
+    Each thread accumulates the splats to a block of the pixels around the tile added to the shared film per tile,
+    so the memory consumption does not grow with the number of threads
+    unlike the default scheduler which clones the film for each thread.
+    The RNG is seeded per tile and pass from the initial seed,
+    so the samples do not depend on the assignment of the tiles to the threads.
+    With multiple worker processes, each worker renders the tiles assigned in the round-robin manner
+    and writes the partial result in the format of the default scheduler for `lightmetrica merge`.
+    Only the renderers utilizing `ProcessRaster` benefit from the scheduler;
+    `Process` and `ProcessBatch` are delegated to the default scheduler.
+*/
+class Scheduler_Tile final : public Scheduler
+{
+public:
+
+    LM_IMPL_CLASS(Scheduler_Tile, Scheduler);
+
+public:
+
+    LM_IMPL_F(Load) = [this](const PropertyNode* prop) -> void
+    {
+        #pragma region Load parameters
+
+        sched_->Load(prop);
+        tileSize_ = prop->ChildAs<int>("tile_size", 32);
+        numSamples_ = prop->ChildAs<long long>("num_samples", 10000000L);
+        renderTime_ = prop->ChildAs<double>("render_time", -1);
+        samplesPerPass_ = prop->ChildAs<int>("samples_per_pass", renderTime_ < 0 ? -1 : 1);
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Print loaded parameters
+
+        {
+            LM_LOG_INFO("Loaded parameters");
+            LM_LOG_INDENTER();
+            LM_LOG_INFO("tile_size                      = " + std::to_string(tileSize_));
+            LM_LOG_INFO("num_samples                    = " + std::to_string(numSamples_));
+            LM_LOG_INFO("render_time                    = " + std::to_string(renderTime_));
+            LM_LOG_INFO("samples_per_pass               = " + std::to_string(samplesPerPass_));
+        }
+
+        #pragma endregion
+    };
+
+    LM_IMPL_F(Process) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*)>& processSampleFunc) -> long long
+    {
+        return sched_->Process(scene, film, initRng, processSampleFunc);
+    };
+
+    LM_IMPL_F(ProcessBatch) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, long long)>& processBatchFunc) -> long long
+    {
+        return sched_->ProcessBatch(scene, film, initRng, processBatchFunc);
+    };
+
+    LM_IMPL_F(GetNumSamples) = [this]() -> long long
+    {
+        return numSamples_;
+    };
+
+    LM_IMPL_F(ProcessRaster) = [this](const Scene* scene, Film* film, Random* initRng, const std::function<void(Film*, Random*, const Vec2&)>& processSampleFunc) -> long long
+    {
+        #pragma region Tiles
+
+        const int width = film->Width();
+        const int height = film->Height();
+        const int numTilesX = (width + tileSize_ - 1) / tileSize_;
+        const int numTilesY = (height + tileSize_ - 1) / tileSize_;
+        const int numTiles = numTilesX * numTilesY;
+
+        // Number of samples per pixel
+        const long long numPixels = (long long)(width) * height;
+        const long long spp = std::max(1LL, (numSamples_ + numPixels - 1) / numPixels);
+        const long long sppPerPass = samplesPerPass_ > 0 ? std::min((long long)(samplesPerPass_), spp) : spp;
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Worker process
+
+        // The worker process renders the tiles `workerIndex + i * numWorkers`.
+        // Since the RNGs are seeded by the global tile indices, the worker processes
+        // together evaluate exactly the same samples as the rendering with a single process.
+        const int numWorkers = Parallel::GetNumWorkers();
+        const int workerIndex = Parallel::GetWorkerIndex();
+        const int numLocalTiles = workerIndex < numTiles ? (numTiles - workerIndex + numWorkers - 1) / numWorkers : 0;
+        long long numLocalPixels = 0;
+        for (int tile = workerIndex; tile < numTiles; tile += numWorkers)
+        {
+            const int x0 = (tile % numTilesX) * tileSize_;
+            const int y0 = (tile / numTilesX) * tileSize_;
+            numLocalPixels += (long long)(std::min(x0 + tileSize_, width) - x0) * (std::min(y0 + tileSize_, height) - y0);
+        }
+        if (numWorkers > 1)
+        {
+            LM_LOG_INFO(boost::str(boost::format("Worker process %d / %d (%d tiles)") % workerIndex % numWorkers % numLocalTiles));
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Thread local storage
+
+        std::mutex filmMutex;
+
+        struct Context
+        {
+            int id = -1;                                // Thread ID
+            Random rng;                                 // Thread-specific RNG seeded per tile
+            std::unique_ptr<Film_TileView> tile;        // Thread-specific view of the film
+        };
+
+        tbb::enumerable_thread_specific<Context> contexts;
+        std::mutex contextInitMutex;
+        int currentThreadID = 0;
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Render loop
+
+        film->Clear();
+        const unsigned int seed = initRng->NextUInt();
+        int pass = 0;
+        long long processedSamples = 0;
+        long long processedSpp = 0;
+        const auto renderStartTime = std::chrono::high_resolution_clock::now();
+
+        while (true)
+        {
+            #pragma region Parallel loop over tiles
+
+            const long long passSpp = renderTime_ < 0 ? std::min(sppPerPass, spp - processedSpp) : sppPerPass;
+            std::atomic<int> processedTiles(0);
+            Parallel::Execute([&]() -> void
+            {
+                tbb::parallel_for(tbb::blocked_range<int>(0, numLocalTiles, 1), [&](const tbb::blocked_range<int>& range) -> void
+                {
+                    auto& ctx = contexts.local();
+                    if (ctx.id < 0)
+                    {
+                        std::unique_lock<std::mutex> lock(contextInitMutex);
+                        ctx.id = currentThreadID++;
+                        ctx.tile.reset(new Film_TileView(film, &filmMutex));
+                    }
+
+                    for (int localTile = range.begin(); localTile != range.end(); localTile++)
+                    {
+                        // Tile region
+                        const int tile = workerIndex + localTile * numWorkers;
+                        const int x0 = (tile % numTilesX) * tileSize_;
+                        const int y0 = (tile / numTilesX) * tileSize_;
+                        const int x1 = std::min(x0 + tileSize_, width);
+                        const int y1 = std::min(y0 + tileSize_, height);
+                        ctx.rng.SetSeed(Random::DeriveSeed(seed, (long long)(pass) * numTiles + tile));
+                        ctx.tile->Begin(x0, y0, x1, y1);
+
+                        // Sample loop
+                        for (int y = y0; y < y1; y++)
+                        {
+                            for (int x = x0; x < x1; x++)
+                            {
+                                for (long long sample = 0; sample < passSpp; sample++)
+                                {
+                                    const Vec2 rasterPos((Float(x) + ctx.rng.Next()) / Float(width), (Float(y) + ctx.rng.Next()) / Float(height));
+                                    processSampleFunc(ctx.tile.get(), &ctx.rng, rasterPos);
+                                }
+                            }
+                        }
+
+                        ctx.tile->Flush();
+
+                        // Report progress
+                        const int n = ++processedTiles;
+                        if (renderTime_ < 0 && ctx.id == 0)
+                        {
+                            const double progress = ((double)(processedSpp) + (double)(n) / numLocalTiles * passSpp) / spp * 100.0;
+                            LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%%") % progress));
+                        }
+                    }
+                });
+            });
+
+            processedSamples += numLocalPixels * passSpp;
+            processedSpp += passSpp;
+            pass++;
+
+            #pragma endregion
+
+            // --------------------------------------------------------------------------------
+
+            #pragma region Exit condition
+
+            if (renderTime_ < 0)
+            {
+                if (processedSpp >= spp)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                const auto currentTime = std::chrono::high_resolution_clock::now();
+                const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - renderStartTime).count()) / 1000.0;
+                LM_LOG_INPLACE(boost::str(boost::format("Progress: %.1f%% (%.1fs / %.1fs)") % (elapsed / renderTime_ * 100.0) % elapsed % renderTime_));
+                if (elapsed > renderTime_)
+                {
+                    break;
+                }
+            }
+
+            #pragma endregion
+        }
+
+        LM_LOG_INFO("Progress: 100.0%");
+        LM_LOG_INFO(boost::str(boost::format("# of samples: %d") % processedSamples));
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Rescale
+
+        // Save the partial result of the worker process in the same format as the default scheduler
+        if (numWorkers > 1 && film->Serialize.Implemented())
+        {
+            const double elapsed = (double)(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - renderStartTime).count()) / 1000.0;
+            Checkpoint::Save("scheduler::default", [&](std::ostream& out) -> bool
+            {
+                Checkpoint::Write(out, processedSamples);
+                Checkpoint::Write(out, elapsed);
+                return film->Serialize(out);
+            });
+        }
+
+        if (processedSamples > 0)
+        {
+            film->Rescale((Float)(numPixels) / processedSamples);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return processedSamples;
+    };
+
+private:
+
+    Scheduler::UniquePtr sched_ = ComponentFactory::Create<Scheduler>();
+
+    int tileSize_;
+    int samplesPerPass_;
+
+    long long numSamples_;      //!< Number of samples
+    double renderTime_;         //!< Render time
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Scheduler_Tile, "scheduler::tile");
+
+LM_NAMESPACE_END
@@ -29,6 +29,10 @@
 #include <lightmetrica/trianglemesh.h>
 #include <lightmetrica/ray.h>
 #include <lightmetrica/intersection.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/accelcache.h>
+#include <lightmetrica/bvhbuildutils.h>
+#include <lightmetrica-test/utils.h>
 #include <lightmetrica-test/mathutils.h>
 
 LM_TEST_NAMESPACE_BEGIN
@@ -50,7 +54,10 @@ struct AccelTest : public ::testing::TestWithParam<const char*>
     }
 };
 
-INSTANTIATE_TEST_CASE_P(AccelTypes, AccelTest, ::testing::Values("accel::naive", "accel::embree", "accel::bvh", "accel::bvh_sah", "accel::bvh_sahbin", "accel::bvh_sahxyz", "accel::qbvh"));
+INSTANTIATE_TEST_CASE_P(AccelTypes, AccelTest, ::testing::Values("accel::naive", "accel::embree", "accel::bvh", "accel::bvh_sah", "accel::bvh_sahbin", "accel::bvh_sahxyz", "accel::qbvh", "accel::twolevel"));
+#if LM_AVX || defined(__AVX__)
+INSTANTIATE_TEST_CASE_P(AccelTypesAVX, AccelTest, ::testing::Values("accel::obvh"));
+#endif
 
 #pragma endregion
 
@@ -206,6 +213,8 @@ public:
                 ns.push_back(n[2]);
             }
 
+            fs.push_back(3 * i);
+            fs.push_back(3 * i + 1);
             fs.push_back(3 * i + 2);
         }
     }
@@ -235,13 +244,18 @@ public:
 
     LM_IMPL_F(NumPrimitives) = [this]() -> int { return 1; };
     LM_IMPL_F(PrimitiveAt) = [this](int index) -> const Primitive* { return &primitive_; };
+    LM_IMPL_F(SetPrimitiveTransform) = [this](int index, const Mat4& transform) -> void
+    {
+        primitive_.transform = transform;
+        primitive_.normalTransform = Mat3(Math::Transpose(Math::Inverse(transform)));
+    };
 
 public:
 
-    Stub_Scene(const TriangleMesh& mesh)
+    Stub_Scene(const TriangleMesh& mesh, const Mat4& transform = Mat4::Identity())
     {
-        primitive_.transform = Mat4::Identity();
         primitive_.mesh = &mesh;
+        SetPrimitiveTransform(0, transform);
     }
 
 private:
@@ -250,6 +264,39 @@ private:
 
 };
 
+// Three instances of the same mesh
+class Stub_InstancedScene : public Scene
+{
+public:
+
+    LM_IMPL_CLASS(Stub_InstancedScene, Scene);
+
+public:
+
+    LM_IMPL_F(NumPrimitives) = [this]() -> int { return 3; };
+    LM_IMPL_F(PrimitiveAt) = [this](int index) -> const Primitive* { return &primitives_[index]; };
+
+public:
+
+    Stub_InstancedScene(const TriangleMesh& mesh)
+    {
+        primitives_[0].transform = Mat4::Identity();
+        primitives_[1].transform = Math::Translate(Vec3(2_f, 0_f, 0_f));
+        primitives_[2].transform = Math::Translate(Vec3(4_f, 0_f, 0_f)) * Math::Scale(Vec3(0.5_f));
+        for (int i = 0; i < 3; i++)
+        {
+            primitives_[i].index = i;
+            primitives_[i].normalTransform = Mat3(Math::Transpose(Math::Inverse(primitives_[i].transform)));
+            primitives_[i].mesh = &mesh;
+        }
+    }
+
+private:
+
+    Primitive primitives_[3];
+
+};
+
 #pragma endregion
 
 // --------------------------------------------------------------------------------
@@ -330,6 +377,288 @@ TEST_P(AccelTest, Simple2)
     }
 }
 
+TEST_P(AccelTest, Packet)
+{
+    StubTriangleMesh_Random mesh;
+    Stub_Scene scene(mesh);
+
+    const auto accel = ComponentFactory::Create<Accel>(GetParam());
+    ASSERT_NE(nullptr, accel);
+    if (!accel->IntersectPacket.Implemented())
+    {
+        // Packet traversal is optional
+        return;
+    }
+
+    EXPECT_TRUE(accel->Initialize(nullptr));
+    EXPECT_TRUE(accel->Build(&scene));
+
+    // Trace packets of coherent rays toward [0, 1]^2
+    // and compare the results with the single ray queries
+    const int Steps = 32;
+    const Float Delta = 1_f / Float(Steps);
+    for (int i = 0; i < Steps; i++)
+    {
+        for (int j = 0; j < Steps; j += 5)
+        {
+            // The last packet in the row is not fully occupied
+            const int n = std::min(5, Steps - j);
+            Ray rays[5];
+            Intersection isects[5];
+            for (int k = 0; k < n; k++)
+            {
+                rays[k].o = Vec3(0.5_f, 0.5_f, 2_f);
+                rays[k].d = Math::Normalize(Vec3(Delta * (Float(j + k) + 0.5_f), Delta * (Float(i) + 0.5_f), 0_f) - rays[k].o);
+            }
+
+            const auto hits = accel->IntersectPacket(&scene, rays, n, isects, 0_f, Math::Inf());
+            EXPECT_EQ(0u, hits >> n);
+            for (int k = 0; k < n; k++)
+            {
+                Intersection isect;
+                const bool hit = accel->Intersect(&scene, rays[k], isect, 0_f, Math::Inf());
+                ASSERT_EQ(hit, (hits & (1u << k)) != 0);
+                if (hit)
+                {
+                    EXPECT_TRUE(ExpectVecNear(isect.geom.p, isects[k].geom.p, Math::EpsLarge()));
+                    EXPECT_TRUE(ExpectVecNear(isect.geom.gn, isects[k].geom.gn, Math::EpsLarge()));
+                }
+            }
+        }
+    }
+}
+
+TEST_P(AccelTest, Occluded)
+{
+    StubTriangleMesh_Random mesh;
+    Stub_Scene scene(mesh);
+
+    const auto accel = ComponentFactory::Create<Accel>(GetParam());
+    ASSERT_NE(nullptr, accel);
+    EXPECT_TRUE(accel->Initialize(nullptr));
+    EXPECT_TRUE(accel->Build(&scene));
+
+    // Occlusion query must agree with the intersection query,
+    // also for the limited range of the distance
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dist;
+    for (int i = 0; i < 1000; i++)
+    {
+        Ray ray;
+        ray.o = Vec3(Float(dist(gen)), Float(dist(gen)), 2_f);
+        ray.d = Math::Normalize(Vec3(Float(dist(gen)), Float(dist(gen)), 0_f) - ray.o);
+        const Float maxT = Float(dist(gen)) * 3_f;
+
+        Intersection isect;
+        const bool hit = accel->Intersect(&scene, ray, isect, 0_f, maxT);
+        EXPECT_EQ(hit, accel->Occluded(ray, 0_f, maxT));
+    }
+}
+
+TEST_P(AccelTest, Instancing)
+{
+    StubTriangleMesh_Simple mesh;
+    Stub_InstancedScene scene(mesh);
+
+    const auto accel = ComponentFactory::Create<Accel>(GetParam());
+    ASSERT_NE(nullptr, accel);
+    EXPECT_TRUE(accel->Initialize(nullptr));
+    EXPECT_TRUE(accel->Build(&scene));
+
+    // Trace rays in the region of [0, 5] x [0, 1]
+    for (int i = 0; i < 4; i++)
+    {
+        const Float y = 0.15_f + 0.2_f * Float(i);
+        for (int j = 0; j < 50; j++)
+        {
+            const Float x = 0.05_f + 0.1_f * Float(j);
+
+            // Expected primitive
+            int expected = -1;
+            if (x < 1_f) expected = 0;
+            else if (2_f < x && x < 3_f) expected = 1;
+            else if (4_f < x && x < 4.5_f && y < 0.5_f) expected = 2;
+
+            Ray ray;
+            ray.o = Vec3(x, y, 1_f);
+            ray.d = Vec3(0_f, 0_f, -1_f);
+
+            Intersection isect;
+            const bool hit = accel->Intersect(&scene, ray, isect, 0_f, Math::Inf());
+            ASSERT_EQ(expected >= 0, hit) << "x = " << x << ", y = " << y;
+            EXPECT_EQ(expected >= 0, accel->Occluded(ray, 0_f, Math::Inf()));
+            if (hit)
+            {
+                EXPECT_EQ(scene.PrimitiveAt(expected), isect.primitive);
+                EXPECT_TRUE(ExpectVecNear(Vec3(x, y, 0_f), isect.geom.p, Math::EpsLarge()));
+                EXPECT_TRUE(ExpectVecNear(Vec3(0_f, 0_f, 1_f), isect.geom.gn, Math::EpsLarge()));
+            }
+        }
+    }
+}
+
+TEST_P(AccelTest, Refit)
+{
+    StubTriangleMesh_Random mesh;
+    Stub_Scene scene(mesh);
+
+    const auto accel = ComponentFactory::Create<Accel>(GetParam());
+    ASSERT_NE(nullptr, accel);
+    EXPECT_TRUE(accel->Initialize(nullptr));
+    EXPECT_TRUE(accel->Build(&scene));
+
+    // Move the mesh and update the accel.
+    // The result must be same as the scene originally created with the transform.
+    const auto transform = Math::Translate(Vec3(0.3_f, -0.2_f, 0.1_f)) * Math::Scale(Vec3(1.2_f));
+    scene.SetPrimitiveTransform(0, transform);
+    EXPECT_TRUE(accel->Refit.Implemented() ? accel->Refit(&scene) : accel->Build(&scene));
+
+    Stub_Scene refScene(mesh, transform);
+    const auto refAccel = ComponentFactory::Create<Accel>("accel::naive");
+    EXPECT_TRUE(refAccel->Initialize(nullptr));
+    EXPECT_TRUE(refAccel->Build(&refScene));
+
+    const int Steps = 32;
+    const Float Delta = 2_f / Float(Steps);
+    for (int i = 0; i < Steps; i++)
+    {
+        for (int j = 0; j < Steps; j++)
+        {
+            Ray ray;
+            ray.o = Vec3(0.5_f, 0.5_f, 2_f);
+            ray.d = Math::Normalize(Vec3(Delta * (Float(j) + 0.5_f) - 0.5_f, Delta * (Float(i) + 0.5_f) - 0.5_f, 0_f) - ray.o);
+
+            Intersection isect, refIsect;
+            const bool hit = refAccel->Intersect(&refScene, ray, refIsect, 0_f, Math::Inf());
+            ASSERT_EQ(hit, accel->Intersect(&scene, ray, isect, 0_f, Math::Inf()));
+            EXPECT_EQ(hit, accel->Occluded(ray, 0_f, Math::Inf()));
+            if (hit)
+            {
+                EXPECT_TRUE(ExpectVecNear(refIsect.geom.p, isect.geom.p, Math::EpsLarge()));
+                EXPECT_TRUE(ExpectVecNear(refIsect.geom.gn, isect.geom.gn, Math::EpsLarge()));
+            }
+        }
+    }
+}
+
+/*
+    Checks if the traversal stack covers the degenerate trees deeper than the fixed-size stack.
+*/
+TEST(BVHBuildUtilsTest, TraversalStack)
+{
+    // Chain of the intermediate nodes where the second child is a leaf,
+    // so that a leaf is left on the stack for each level
+    struct Node
+    {
+        bool isleaf;
+        struct { int child1, child2; } internal;
+    };
+    const int N = 300;
+    std::vector<Node> nodes;
+    for (int i = 0; i < N; i++)
+    {
+        nodes.push_back(Node{ false, { 2 * i + 2, 2 * i + 1 } });
+        nodes.push_back(Node{ true, { -1, -1 } });
+    }
+    nodes.push_back(Node{ true, { -1, -1 } });
+    ASSERT_EQ(N, BVHBuildUtils::MaxDepth(nodes));
+
+    // Traverse all nodes with the stack
+    BVHBuildUtils::TraversalStack<16> stack(BVHBuildUtils::MaxDepth(nodes) + 1);
+    int stackIndex = 0;
+    int maxStackIndex = 0;
+    int numVisited = 0;
+    stack[0] = 0;
+    while (stackIndex >= 0)
+    {
+        const auto& node = nodes[stack[stackIndex--]];
+        numVisited++;
+        if (node.isleaf)
+        {
+            continue;
+        }
+        stack[++stackIndex] = node.internal.child2;
+        stack[++stackIndex] = node.internal.child1;
+        maxStackIndex = std::max(maxStackIndex, stackIndex);
+    }
+    EXPECT_EQ((int)(nodes.size()), numVisited);
+    EXPECT_EQ(N, maxStackIndex);
+}
+
+// A failed load must not leave the previously loaded cache accessible
+TEST(AccelCacheTest, LoadMismatchedHash)
+{
+    const auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    const int data[] = { 1, 2, 3 };
+    ASSERT_TRUE(AccelCache::Save(path, 1, { { data, sizeof(data) } }));
+
+    AccelCache cache;
+    ASSERT_TRUE(cache.Load(path, 1));
+    ASSERT_EQ(1, cache.NumSections());
+    size_t count;
+    EXPECT_EQ(2, cache.Data<int>(0, count)[1]);
+    EXPECT_EQ(3U, count);
+
+    EXPECT_FALSE(cache.Load(path, 2));
+    EXPECT_EQ(0, cache.NumSections());
+
+    boost::filesystem::remove(path);
+}
+
+#if LM_SSE && LM_SINGLE_PRECISION
+TEST(AccelCacheTest, QBVH)
+{
+    StubTriangleMesh_Random mesh;
+    Stub_Scene scene(mesh);
+
+    const auto cacheDir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString("cache_dir: " + cacheDir.string()));
+
+    // The first accel builds the structure and writes the cache,
+    // the second one loads the structure from the cache.
+    const auto accel1 = ComponentFactory::Create<Accel>("accel::qbvh");
+    ASSERT_TRUE(accel1->Initialize(prop->Root()));
+    ASSERT_TRUE(accel1->Build(&scene));
+    ASSERT_FALSE(boost::filesystem::is_empty(cacheDir));
+
+    // The second build must not rebuild the structure
+    const auto accel2 = ComponentFactory::Create<Accel>("accel::qbvh");
+    ASSERT_TRUE(accel2->Initialize(prop->Root()));
+    bool built = false;
+    const auto out = TestUtils::CaptureStdout([&]()
+    {
+        Logger::Run();
+        built = accel2->Build(&scene);
+        Logger::Stop();
+    });
+    ASSERT_TRUE(built);
+    EXPECT_NE(std::string::npos, out.find("Loaded from cache"));
+
+    const int Steps = 32;
+    const Float Delta = 1_f / Float(Steps);
+    for (int i = 0; i < Steps; i++)
+    {
+        for (int j = 0; j < Steps; j++)
+        {
+            Ray ray;
+            ray.o = Vec3(0.5_f, 0.5_f, 2_f);
+            ray.d = Math::Normalize(Vec3(Delta * (Float(j) + 0.5_f), Delta * (Float(i) + 0.5_f), 0_f) - ray.o);
+
+            Intersection isect1, isect2;
+            const bool hit = accel1->Intersect(&scene, ray, isect1, 0_f, Math::Inf());
+            ASSERT_EQ(hit, accel2->Intersect(&scene, ray, isect2, 0_f, Math::Inf()));
+            if (hit)
+            {
+                EXPECT_TRUE(ExpectVecNear(isect1.geom.p, isect2.geom.p, Math::EpsLarge()));
+            }
+        }
+    }
+
+    boost::filesystem::remove_all(cacheDir);
+}
+#endif
+
 #pragma endregion
 
 LM_TEST_NAMESPACE_END
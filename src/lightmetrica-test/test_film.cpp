@@ -26,7 +26,13 @@
 #include <lightmetrica/film.h>
 #include <lightmetrica/property.h>
 #include <lightmetrica/logger.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/detail/tonemapper.h>
+#include <lightmetrica/detail/exrwriter.h>
+#include <lightmetrica/detail/filmstorage.h>
 #include <lightmetrica-test/utils.h>
+#include <lightmetrica-test/mathutils.h>
+#include <zlib.h>
 
 LM_TEST_NAMESPACE_BEGIN
 
@@ -38,7 +44,7 @@ struct FilmTest : public ::testing::TestWithParam<const char*>
     virtual auto TearDown() -> void override { Logger::Stop(); }
 };
 
-INSTANTIATE_TEST_CASE_P(FilmTypes, FilmTest, ::testing::Values("film::hdr"));
+INSTANTIATE_TEST_CASE_P(FilmTypes, FilmTest, ::testing::Values("film::hdr", "film::hdr_atomic", "film::multilayer"));
 
 #pragma endregion
 
@@ -61,6 +67,410 @@ TEST_P(FilmTest, Initialize)
     EXPECT_EQ(500, film->Height());
 }
 
+TEST_P(FilmTest, Serialize)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | w: 10
+    | h: 5
+    )x")));
+
+    const auto film = ComponentFactory::Create<Film>(GetParam());
+    ASSERT_TRUE(film->Load(prop->Root(), nullptr, nullptr));
+    for (int y = 0; y < 5; y++)
+    {
+        for (int x = 0; x < 10; x++)
+        {
+            film->SetPixel(x, y, SPD::FromRGB(Vec3(Float(x), Float(y), Float(x * y))));
+        }
+    }
+
+    std::stringstream ss;
+    ASSERT_TRUE(film->Serialize(ss));
+
+    // Restore to another film and serialize again
+    const auto film2 = ComponentFactory::Create<Film>(GetParam());
+    ASSERT_TRUE(film2->Load(prop->Root(), nullptr, nullptr));
+    ASSERT_TRUE(film2->Deserialize(ss));
+    std::stringstream ss2;
+    ASSERT_TRUE(film2->Serialize(ss2));
+    EXPECT_EQ(ss.str(), ss2.str());
+
+    // Size mismatch
+    const auto prop2 = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop2->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | w: 5
+    | h: 10
+    )x")));
+    const auto film3 = ComponentFactory::Create<Film>(GetParam());
+    ASSERT_TRUE(film3->Load(prop2->Root(), nullptr, nullptr));
+    std::stringstream ss3(ss.str());
+    EXPECT_FALSE(film3->Deserialize(ss3));
+}
+
+/*
+    Checks if the reconstruction filters are normalized.
+    Splatting a constant contribution uniformly over the film
+    must reproduce the constant in all pixels including the ones near the borders.
+*/
+TEST_P(FilmTest, Filter)
+{
+    for (const std::string filter : { "box", "gaussian", "mitchell", "blackmanharris" })
+    {
+        const auto prop = ComponentFactory::Create<PropertyTree>();
+        ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+        | w: 8
+        | h: 8
+        | filter: )x" + filter + R"x(
+        )x")));
+
+        const auto film = ComponentFactory::Create<Film>(GetParam());
+        ASSERT_TRUE(film->Load(prop->Root(), nullptr, nullptr));
+
+        // Splat to the stratified positions
+        const int N = 8 * 128;
+        for (int y = 0; y < N; y++)
+        {
+            for (int x = 0; x < N; x++)
+            {
+                film->Splat(Vec2((Float(x) + 0.5_f) / N, (Float(y) + 0.5_f) / N), SPD(1_f));
+            }
+        }
+        film->Rescale(Float(8 * 8) / Float(N * N));
+
+        // Read the pixel values
+        std::stringstream ss;
+        ASSERT_TRUE(film->Serialize(ss));
+        int w, h;
+        ss.read(reinterpret_cast<char*>(&w), sizeof(int));
+        ss.read(reinterpret_cast<char*>(&h), sizeof(int));
+        std::vector<Float> data(3 * w * h);
+        ss.read(reinterpret_cast<char*>(data.data()), sizeof(Float) * data.size());
+
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                EXPECT_NEAR(1_f, data[3 * (y * w + x)], 1e-3_f) << filter << " (" << x << ", " << y << ")";
+            }
+        }
+    }
+
+    // Unknown filter
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | w: 16
+    | h: 16
+    | filter: unknown
+    )x")));
+    const auto film = ComponentFactory::Create<Film>(GetParam());
+    EXPECT_FALSE(film->Load(prop->Root(), nullptr, nullptr));
+}
+
+/*
+    Checks if the splats accumulated to a block of pixels with `SplatBlock`
+    are same as the splats directly accumulated to the film.
+    The splats with the footprints outside of the block are rejected.
+*/
+TEST_P(FilmTest, SplatBlock)
+{
+    for (const std::string filter : { "box", "mitchell" })
+    {
+        const auto prop = ComponentFactory::Create<PropertyTree>();
+        ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+        | w: 16
+        | h: 16
+        | filter: )x" + filter + R"x(
+        )x")));
+
+        const auto film1 = ComponentFactory::Create<Film>(GetParam());
+        const auto film2 = ComponentFactory::Create<Film>(GetParam());
+        ASSERT_TRUE(film1->Load(prop->Root(), nullptr, nullptr));
+        ASSERT_TRUE(film2->Load(prop->Root(), nullptr, nullptr));
+
+        // Block [2, 14) * [0, 10)
+        const int bx = 2, by = 0, bw = 12, bh = 10;
+        std::vector<Vec3> block(bw * bh);
+        Random rng;
+        rng.SetSeed(1);
+        int numBlockSplats = 0;
+        for (int i = 0; i < 1000; i++)
+        {
+            const Vec2 rasterPos(rng.Next(), rng.Next());
+            const auto v = SPD::FromRGB(Vec3(rng.Next(), rng.Next(), rng.Next()));
+            film1->Splat(rasterPos, v);
+            if (film2->SplatBlock(bx, by, bw, bh, block.data(), rasterPos, v))
+            {
+                numBlockSplats++;
+                continue;
+            }
+            film2->Splat(rasterPos, v);
+        }
+        film2->AccumulateBlock(bx, by, bw, bh, block.data());
+        EXPECT_LT(0, numBlockSplats);
+        EXPECT_GT(1000, numBlockSplats);
+
+        // Compare the pixel values
+        const auto ReadData = [](Film* film) -> std::vector<Float>
+        {
+            std::stringstream ss;
+            film->Serialize(ss);
+            int w, h;
+            ss.read(reinterpret_cast<char*>(&w), sizeof(int));
+            ss.read(reinterpret_cast<char*>(&h), sizeof(int));
+            std::vector<Float> data(3 * w * h);
+            ss.read(reinterpret_cast<char*>(data.data()), sizeof(Float) * data.size());
+            return data;
+        };
+        const auto data1 = ReadData(film1.get());
+        const auto data2 = ReadData(film2.get());
+        ASSERT_EQ(data1.size(), data2.size());
+        for (size_t i = 0; i < data1.size(); i++)
+        {
+            EXPECT_NEAR(data1[i], data2[i], 1e-4_f) << filter << " (" << i << ")";
+        }
+    }
+}
+
+/*
+    Checks if the auxiliary layers are averaged over the recorded samples,
+    except for the primitive IDs.
+*/
+TEST(FilmLayerTest, MultiLayer)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | w: 2
+    | h: 1
+    )x")));
+
+    const auto film = ComponentFactory::Create<Film>("film::multilayer");
+    ASSERT_TRUE(film->Load(prop->Root(), nullptr, nullptr));
+    ASSERT_TRUE(film->SplatLayer.Implemented());
+
+    const Vec2 rasterPos(0.25_f, 0.5_f);
+    for (int i = 0; i < 2; i++)
+    {
+        film->Splat(rasterPos, SPD(1_f));
+        film->SplatLayer(FilmLayer::Albedo, rasterPos, Vec3(Float(i)));
+        film->SplatLayer(FilmLayer::Normal, rasterPos, Vec3(0_f, 1_f, 0_f));
+        film->SplatLayer(FilmLayer::Depth, rasterPos, Vec3(3_f));
+        film->SplatLayer(FilmLayer::PrimitiveID, rasterPos, Vec3(Float(i + 1)));
+    }
+    film->Rescale(0.5_f);
+
+    // Read the pixel values of the image, the layers, and the sample counts of the layers
+    std::stringstream ss;
+    ASSERT_TRUE(film->Serialize(ss));
+    int w, h;
+    ss.read(reinterpret_cast<char*>(&w), sizeof(int));
+    ss.read(reinterpret_cast<char*>(&h), sizeof(int));
+    std::vector<Float> data(3 * w * h * (1 + FilmLayer::NumLayers));
+    std::vector<Float> counts(w * h * FilmLayer::NumLayers);
+    ss.read(reinterpret_cast<char*>(data.data()), sizeof(Float) * data.size());
+    ss.read(reinterpret_cast<char*>(counts.data()), sizeof(Float) * counts.size());
+    ASSERT_FALSE(ss.fail());
+
+    const auto Value = [&](int layer, int pixel, int component) { return data[3 * w * h * (layer + 1) + 3 * pixel + component]; };
+    const auto Count = [&](int layer, int pixel) { return counts[w * h * layer + pixel]; };
+    EXPECT_EQ(1_f, Value(-1, 0, 0));
+    EXPECT_EQ(0.5_f, Value(FilmLayer::Albedo, 0, 1) / Count(FilmLayer::Albedo, 0));
+    EXPECT_EQ(1_f, Value(FilmLayer::Normal, 0, 1) / Count(FilmLayer::Normal, 0));
+    EXPECT_EQ(3_f, Value(FilmLayer::Depth, 0, 0) / Count(FilmLayer::Depth, 0));
+    EXPECT_EQ(2_f, Value(FilmLayer::PrimitiveID, 0, 0));
+    EXPECT_EQ(0_f, Value(FilmLayer::PrimitiveID, 1, 0));
+    EXPECT_EQ(0_f, Count(FilmLayer::Depth, 1));
+}
+
+/*
+    Checks if the table lookup of the gamma encoding
+    agrees with the direct evaluation.
+*/
+TEST(ToneMapperTest, Encode)
+{
+    ToneMapper toneMapper;
+    ASSERT_TRUE(toneMapper.Initialize("none", 1_f, 2.2_f));
+    ASSERT_FALSE(ToneMapper().Initialize("unknown", 1_f, 2.2_f));
+
+    const auto Expected = [](Float v) -> int
+    {
+        return Math::Clamp((int)(Math::Pow((double)v, 1.0 / 2.2) * 255_f), 0, 255);
+    };
+
+    const int N = 100000;
+    for (int i = 0; i <= N; i++)
+    {
+        // Dense near zero where the encoding is steep
+        const Float v = Math::Pow(Float(i) / N, 3_f) * 1.2_f;
+        unsigned char rgb[3];
+        toneMapper.Encode(Vec3(v, v * 0.5_f, v * 0.25_f), rgb);
+        ASSERT_EQ(Expected(v), (int)rgb[0]);
+        ASSERT_EQ(Expected(v * 0.5_f), (int)rgb[1]);
+        ASSERT_EQ(Expected(v * 0.25_f), (int)rgb[2]);
+    }
+
+    // Negative values and NaN are mapped to zero
+    unsigned char rgb[3];
+    toneMapper.Encode(Vec3(-1_f, std::numeric_limits<Float>::quiet_NaN(), 100_f), rgb);
+    EXPECT_EQ(0, (int)rgb[0]);
+    EXPECT_EQ(0, (int)rgb[1]);
+    EXPECT_EQ(255, (int)rgb[2]);
+
+    // Reinhard operator with exposure
+    ASSERT_TRUE(toneMapper.Initialize("reinhard", 2_f, 2.2_f));
+    toneMapper.Encode(Vec3(0.5_f), rgb);
+    EXPECT_EQ(Expected(0.5_f), (int)rgb[0]);
+}
+
+/*
+    Checks if the scanline and tiled OpenEXR images
+    have the pixels at the locations given by the offset tables.
+    The chunks compressed with ZIP are decoded by reverting the predictor and the interleaving.
+*/
+TEST(EXRWriterTest, Save)
+{
+    const int W = 40;
+    const int H = 20;
+    const std::vector<std::string> channelNames{ "G", "A" };
+    const auto Value = [](int x, int y, int c) -> float { return float(100 * c + 10 * y + x); };
+
+    for (const auto compression : { EXRCompression::None, EXRCompression::ZIPS, EXRCompression::ZIP })
+    {
+        for (int tileSize : { 0, 2, 16 })
+        {
+            const auto path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("%%%%-%%%%.exr");
+            ASSERT_TRUE(EXRWriter::Save(path.string(), W, H, channelNames, [&](int y, int c, float* row) -> void
+            {
+                for (int x = 0; x < W; x++) row[x] = Value(x, y, c);
+            }, tileSize, compression));
+
+            std::ifstream in(path.string(), std::ios::binary);
+            std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            in.close();
+            boost::filesystem::remove(path);
+
+            const auto Read = [&](size_t offset) -> std::int32_t { std::int32_t v; std::memcpy(&v, &data[offset], 4); return v; };
+            ASSERT_EQ(20000630, Read(0));
+            EXPECT_EQ(tileSize > 0 ? 0x202 : 2, Read(4));
+
+            // Skip the attributes (name, type, size, value)
+            size_t p = 8;
+            while (data[p] != 0)
+            {
+                p += std::strlen(&data[p]) + 1;
+                p += std::strlen(&data[p]) + 1;
+                p += 4 + Read(p);
+            }
+            p++;
+
+            // Channels are sorted by the names, i.e., A (1) then G (0)
+            const int order[] = { 1, 0 };
+            const int linesPerChunk = tileSize == 0 && compression == EXRCompression::ZIP ? 16 : 1;
+            const int tileW = tileSize > 0 ? tileSize : W;
+            const int tileH = tileSize > 0 ? tileSize : linesPerChunk;
+            const int numTilesX = (W + tileW - 1) / tileW;
+            const int numChunksY = (H + tileH - 1) / tileH;
+            int numCompressedChunks = 0;
+            for (int ty = 0; ty < numChunksY; ty++)
+            {
+                for (int tx = 0; tx < numTilesX; tx++)
+                {
+                    std::uint64_t offset;
+                    std::memcpy(&offset, &data[p + 8 * (ty * numTilesX + tx)], 8);
+                    const int x0 = tx * tileW;
+                    const int y0 = ty * tileH;
+                    const int w = std::min(tileW, W - x0);
+                    const int h = std::min(tileH, H - y0);
+
+                    // Chunk header followed by the pixels
+                    const size_t headerSize = tileSize > 0 ? 20 : 8;
+                    const size_t size = sizeof(float) * w * h * 2;
+                    const int dataSize = Read((size_t)(offset) + headerSize - 4);
+                    ASSERT_LE(dataSize, int(size));
+                    ASSERT_LE((size_t)(offset) + headerSize + dataSize, data.size());
+                    std::vector<char> pixels(&data[(size_t)(offset) + headerSize], &data[(size_t)(offset) + headerSize] + dataSize);
+                    if (dataSize < int(size))
+                    {
+                        ASSERT_NE(EXRCompression::None, compression);
+                        numCompressedChunks++;
+
+                        // Decompress and revert the predictor and the interleaving
+                        std::vector<unsigned char> t(size);
+                        uLongf n = (uLongf)(size);
+                        ASSERT_EQ(Z_OK, uncompress(t.data(), &n, reinterpret_cast<const Bytef*>(pixels.data()), dataSize));
+                        ASSERT_EQ(size, n);
+                        for (size_t i = 1; i < size; i++) t[i] = (unsigned char)(t[i - 1] + t[i] - 128);
+                        pixels.resize(size);
+                        for (size_t i = 0; i < size; i++) pixels[i] = (char)(t[(i & 1) == 0 ? i / 2 : (size + 1) / 2 + i / 2]);
+                    }
+
+                    size_t q = 0;
+                    for (int y = y0; y < y0 + h; y++)
+                    {
+                        for (int c : order)
+                        {
+                            for (int x = x0; x < x0 + w; x++)
+                            {
+                                float v;
+                                std::memcpy(&v, &pixels[q], 4);
+                                EXPECT_EQ(Value(x, y, c), v);
+                                q += 4;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (compression != EXRCompression::None && tileSize != 2)
+            {
+                EXPECT_LT(0, numCompressedChunks);
+            }
+        }
+    }
+}
+
+/*
+    Checks the storage types of the pixels.
+    The Kahan summation must keep the small contributions
+    which are lost in the naive summation in single precision.
+*/
+TEST(FilmStorageTest, Accumulate)
+{
+    FilmStorage storage;
+    ASSERT_FALSE(storage.Initialize("unknown", 1));
+
+    for (const std::string type : { "native", "float", "kahan" })
+    {
+        ASSERT_TRUE(storage.Initialize(type, 2));
+        storage.Set(0, Vec3(1_f, 2_f, 3_f));
+        storage.Add(0, Vec3(1_f));
+        storage.Scale(2_f);
+        EXPECT_TRUE(ExpectVecNear(Vec3(4_f, 6_f, 8_f), storage.Get(0)));
+        EXPECT_TRUE(ExpectVecNear(Vec3(), storage.Get(1)));
+
+        // Merge the copy of itself
+        const auto copy = storage;
+        storage.Accumulate(copy);
+        EXPECT_TRUE(ExpectVecNear(Vec3(8_f, 12_f, 16_f), storage.Get(0)));
+    }
+
+    // 2^24 + 1 is not representable in single precision
+    const int N = 1000;
+    FilmStorage kahan;
+    FilmStorage naive;
+    ASSERT_TRUE(kahan.Initialize("kahan", 1));
+    ASSERT_TRUE(naive.Initialize("float", 1));
+    kahan.Set(0, Vec3(16777216_f));
+    naive.Set(0, Vec3(16777216_f));
+    for (int i = 0; i < N; i++)
+    {
+        kahan.Add(0, Vec3(1_f));
+        naive.Add(0, Vec3(1_f));
+    }
+    EXPECT_EQ(16777216.0 + N, (double)(kahan.Get(0).x));
+    EXPECT_EQ(16777216.0, (double)(naive.Get(0).x));
+}
+
 #pragma endregion
 
 LM_TEST_NAMESPACE_END
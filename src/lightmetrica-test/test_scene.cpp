@@ -279,6 +279,95 @@ TEST_F(SceneTest, Transform)
 
 // --------------------------------------------------------------------------------
 
+// Single triangle on the xy plane
+struct Stub_TriangleMesh_Triangle : public TriangleMesh
+{
+    LM_IMPL_CLASS(Stub_TriangleMesh_Triangle, TriangleMesh);
+    LM_IMPL_F(Load) = [this](const PropertyNode* prop, Assets* assets, const Primitive* primitive) -> bool { return true; };
+    LM_IMPL_F(NumVertices) = [this]() -> int { return 3; };
+    LM_IMPL_F(NumFaces) = [this]() -> int { return 1; };
+    LM_IMPL_F(Positions) = [this]() -> const Float* { return ps; };
+    LM_IMPL_F(Normals) = [this]() -> const Float* { return ns; };
+    LM_IMPL_F(Texcoords) = [this]() -> const Float* { return nullptr; };
+    LM_IMPL_F(Faces) = [this]() -> const unsigned int* { return fs; };
+    const Float ps[9] = { 0,0,0, 1,0,0, 0,1,0 };
+    const Float ns[9] = { 0,0,1, 0,0,1, 0,0,1 };
+    const unsigned int fs[3] = { 0,1,2 };
+};
+
+LM_COMPONENT_REGISTER_IMPL(Stub_TriangleMesh_Triangle, "trianglemesh::stub_trianglemesh_triangle");
+
+// Precomputed world-space geometry
+TEST_F(SceneTest, WorldGeometry)
+{
+    const auto WorldGeometry_Input = TestUtils::MultiLineLiteral(R"x(
+    | assets:
+    |   mesh_1:
+    |     interface: trianglemesh
+    |     type: stub_trianglemesh_triangle
+    |
+    |   mesh_2:
+    |     interface: trianglemesh
+    |     type: stub_trianglemesh_triangle
+    |
+    | scene:
+    |   sensor: n1
+    |   nodes:
+    |     - id: n1
+    |       mesh: mesh_1
+    |       transform:
+    |         translate: 1 2 3
+    |         rotate:
+    |           axis: 1 0 0
+    |           angle: 90
+    |
+    |     # Instanced meshes
+    |     - id: n2
+    |       mesh: mesh_2
+    |     - id: n3
+    |       mesh: mesh_2
+    )x");
+
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(WorldGeometry_Input));
+
+    const auto assets = ComponentFactory::Create<Assets>();
+    EXPECT_TRUE(assets->Initialize(prop->Root()->Child("assets")));
+
+    const auto accel = ComponentFactory::Create<Accel>("Stub_Accel");
+    const auto scene = ComponentFactory::Create<Scene>();
+    ASSERT_TRUE(scene->Initialize(prop->Root()->Child("scene"), assets.get(), accel.get()));
+
+    // Buffers are created for the primitive with non-instanced mesh
+    const auto* n1 = scene->PrimitiveByID("n1");
+    ASSERT_NE(nullptr, n1->worldPositions);
+    ASSERT_NE(nullptr, n1->worldNormals);
+    ASSERT_NE(nullptr, n1->worldFaceNormals);
+    const auto CheckBuffers = [&](const Primitive* primitive) -> void
+    {
+        const auto* mesh = primitive->mesh;
+        for (int i = 0; i < 3; i++)
+        {
+            const auto* p = mesh->Positions() + 3 * i;
+            const auto* n = mesh->Normals() + 3 * i;
+            EXPECT_TRUE(ExpectVecNear(Vec3(primitive->transform * Vec4(p[0], p[1], p[2], 1_f)), Vec3(primitive->worldPositions[3 * i], primitive->worldPositions[3 * i + 1], primitive->worldPositions[3 * i + 2]), Math::EpsLarge()));
+            EXPECT_TRUE(ExpectVecNear(primitive->normalTransform * Vec3(n[0], n[1], n[2]), Vec3(primitive->worldNormals[3 * i], primitive->worldNormals[3 * i + 1], primitive->worldNormals[3 * i + 2]), Math::EpsLarge()));
+        }
+        EXPECT_TRUE(ExpectVecNear(Math::Normalize(primitive->normalTransform * Vec3(0_f, 0_f, 1_f)), Vec3(primitive->worldFaceNormals[0], primitive->worldFaceNormals[1], primitive->worldFaceNormals[2]), Math::EpsLarge()));
+    };
+    CheckBuffers(n1);
+
+    // Buffers are updated with the transform
+    scene->SetPrimitiveTransform((int)(n1->index), Math::Scale(Vec3(2_f)));
+    CheckBuffers(n1);
+
+    // Buffers are not created for the instanced meshes
+    EXPECT_EQ(nullptr, scene->PrimitiveByID("n2")->worldPositions);
+    EXPECT_EQ(nullptr, scene->PrimitiveByID("n3")->worldPositions);
+}
+
+// --------------------------------------------------------------------------------
+
 // Sensor nodes
 TEST_F(SceneTest, SensorNode)
 {
@@ -0,0 +1,428 @@
+/*
+    Lightmetrica - A modern, research-oriented renderer
+
+    Copyright (c) 2015 Hisanari Otsu
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <pch_test.h>
+#include <lightmetrica/scheduler.h>
+#include <lightmetrica/film.h>
+#include <lightmetrica/random.h>
+#include <lightmetrica/property.h>
+#include <lightmetrica/logger.h>
+#include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
+#include <lightmetrica-test/utils.h>
+
+LM_TEST_NAMESPACE_BEGIN
+
+#pragma region Fixture
+
+struct SchedulerTest : public ::testing::Test
+{
+    virtual auto SetUp() -> void override { Logger::SetVerboseLevel(2); Logger::Run(); }
+    virtual auto TearDown() -> void override { Logger::Stop(); }
+};
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region Stub film
+
+class Stub_Film_Scheduler final : public Film
+{
+public:
+
+    LM_IMPL_CLASS(Stub_Film_Scheduler, Film);
+
+public:
+
+    LM_IMPL_F(Clone) = [this](Clonable* o) -> void
+    {
+        static_cast<Stub_Film_Scheduler*>(o)->data = data;
+    };
+    LM_IMPL_F(Width) = [this]() -> int { return W; };
+    LM_IMPL_F(Height) = [this]() -> int { return H; };
+    LM_IMPL_F(Splat) = [this](const Vec2& rasterPos, const SPD& v) -> void
+    {
+        const int pX = std::min((int)(rasterPos.x * W), W - 1);
+        const int pY = std::min((int)(rasterPos.y * H), H - 1);
+        data[pY * W + pX] += v.ToRGB().x;
+        centerDist += Math::Abs(rasterPos.x * W - (Float(pX) + 0.5_f));
+    };
+    LM_IMPL_F(SplatLayer) = [this](int layer, const Vec2& rasterPos, const Vec3& v) -> void
+    {
+        numLayerSplats++;
+    };
+    LM_IMPL_F(SetPixel) = [this](int x, int y, const SPD& v) -> void
+    {
+        data[y * W + x] = v.ToRGB().x;
+    };
+    LM_IMPL_F(Accumulate) = [this](const Film* film) -> void
+    {
+        const auto& d = static_cast<const Stub_Film_Scheduler*>(film)->data;
+        for (size_t i = 0; i < data.size(); i++) { data[i] += d[i]; }
+    };
+    LM_IMPL_F(Rescale) = [this](Float w) -> void { for (auto& v : data) { v *= w; } };
+    LM_IMPL_F(Clear) = [this]() -> void { data.assign(W * H, 0_f); };
+    LM_IMPL_F(Serialize) = [this](std::ostream& stream) -> bool
+    {
+        stream.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(Float));
+        return !stream.fail();
+    };
+    LM_IMPL_F(Deserialize) = [this](std::istream& stream) -> bool
+    {
+        stream.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(Float));
+        return !stream.fail();
+    };
+
+public:
+
+    static const int W = 8;
+    static const int H = 8;
+    std::vector<Float> data = std::vector<Float>(W * H, 0_f);
+    Float centerDist = 0_f;         // Sum of the distances of the splats from the pixel centers
+    long long numLayerSplats = 0;
+
+};
+
+LM_COMPONENT_REGISTER_IMPL(Stub_Film_Scheduler, "film::stub_film_scheduler");
+
+#pragma endregion
+
+// --------------------------------------------------------------------------------
+
+#pragma region Tests
+
+/*
+    Checks if the deterministic mode produces the identical image
+    irrespective of the number of threads.
+*/
+TEST_F(SchedulerTest, Deterministic)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | grain_size: 10
+    | num_samples: 10000
+    | deterministic: 1
+    | num_streams: 7
+    )x")));
+
+    const auto Render = [&](int numThreads) -> std::vector<Float>
+    {
+        Parallel::SetNumThreads(numThreads);
+
+        const auto sched = ComponentFactory::Create<Scheduler>();
+        sched->Load(prop->Root());
+
+        Random initRng;
+        initRng.SetSeed(42);
+
+        const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+        const auto processed = sched->Process(nullptr, film.get(), &initRng, [](Film* film, Random* rng) -> void
+        {
+            const auto rasterPos = rng->Next2D();
+            film->Splat(rasterPos, SPD(rng->Next()));
+        });
+        EXPECT_EQ(10000, processed);
+
+        return static_cast<Stub_Film_Scheduler*>(film.get())->data;
+    };
+
+    const auto origNumThreads = Parallel::GetNumThreads();
+    const auto expected = Render(1);
+    for (int numThreads : { 2, 4, 7 })
+    {
+        const auto result = Render(numThreads);
+        ASSERT_EQ(expected.size(), result.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(expected[i], result[i]) << "numThreads = " << numThreads << ", i = " << i;
+        }
+    }
+    Parallel::SetNumThreads(origNumThreads);
+}
+
+/*
+    Checks if `ProcessKernel` processes the same samples as `Process`.
+*/
+TEST_F(SchedulerTest, ProcessKernel)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | grain_size: 10
+    | num_samples: 10000
+    | deterministic: 1
+    | num_streams: 7
+    )x")));
+
+    const auto ProcessSample = [](Film* film, Random* rng) -> void
+    {
+        const auto rasterPos = rng->Next2D();
+        film->Splat(rasterPos, SPD(rng->Next()));
+    };
+
+    const auto Render = [&](bool kernel) -> std::vector<Float>
+    {
+        const auto sched = ComponentFactory::Create<Scheduler>();
+        sched->Load(prop->Root());
+
+        Random initRng;
+        initRng.SetSeed(42);
+
+        const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+        const auto processed = kernel
+            ? sched->ProcessKernel(nullptr, film.get(), &initRng, ProcessSample)
+            : sched->Process(nullptr, film.get(), &initRng, ProcessSample);
+        EXPECT_EQ(10000, processed);
+
+        return static_cast<Stub_Film_Scheduler*>(film.get())->data;
+    };
+
+    const auto expected = Render(false);
+    const auto result = Render(true);
+    ASSERT_EQ(expected.size(), result.size());
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        EXPECT_EQ(expected[i], result[i]) << "i = " << i;
+    }
+}
+
+/*
+    Checks if the adaptive scheduler assigns more samples to the noisy pixels
+    and stops sampling the converged pixels.
+*/
+TEST_F(SchedulerTest, Adaptive)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | num_samples: 6400
+    | initial_samples: 16
+    | samples_per_pass: 16
+    | threshold: 0.01
+    | block_size: 4
+    )x")));
+
+    const auto sched = ComponentFactory::Create<Scheduler>("scheduler::adaptive");
+    ASSERT_NE(nullptr, sched);
+    ASSERT_TRUE(sched->ProcessRaster.Implemented());
+    sched->Load(prop->Root());
+
+    Random initRng;
+    initRng.SetSeed(42);
+
+    // Left half of the pixels are constant, right half are noisy
+    const int W = Stub_Film_Scheduler::W;
+    const int H = Stub_Film_Scheduler::H;
+    std::vector<std::atomic<long long>> counts(W * H);
+    for (auto& c : counts) { c = 0; }
+    const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+    const auto processed = sched->ProcessRaster(nullptr, film.get(), &initRng, [&](Film* film, Random* rng, const Vec2& rasterPos) -> void
+    {
+        const int x = (int)(rasterPos.x * W);
+        const int y = (int)(rasterPos.y * H);
+        counts[y * W + x]++;
+        film->Splat(rasterPos, SPD(x < W / 2 ? 1_f : 2_f * rng->Next()));
+        film->SplatLayer(FilmLayer::Normal, rasterPos, Vec3(0_f, 1_f, 0_f));
+    });
+    EXPECT_LE(processed, 6400 + W * H);
+    EXPECT_EQ(processed, static_cast<Stub_Film_Scheduler*>(film.get())->numLayerSplats);
+
+    const auto& data = static_cast<Stub_Film_Scheduler*>(film.get())->data;
+    for (int y = 0; y < H; y++)
+    {
+        for (int x = 0; x < W; x++)
+        {
+            if (x < W / 2)
+            {
+                EXPECT_EQ(16, counts[y * W + x]);
+                EXPECT_EQ(1_f, data[y * W + x]);
+            }
+            else
+            {
+                EXPECT_LT(16, counts[y * W + x]);
+                EXPECT_NEAR(1_f, data[y * W + x], 0.2_f);
+            }
+        }
+    }
+}
+
+/*
+    Checks if the adaptive scheduler falls back to the default scheduler
+    if the contributions are splatted outside of the pixels of the samples.
+*/
+TEST_F(SchedulerTest, AdaptiveOffPixel)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | num_samples: 6400
+    | initial_samples: 16
+    )x")));
+
+    const auto sched = ComponentFactory::Create<Scheduler>("scheduler::adaptive");
+    sched->Load(prop->Root());
+
+    Random initRng;
+    initRng.SetSeed(42);
+
+    // Splat to the mirrored position
+    const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+    const auto processed = sched->ProcessRaster(nullptr, film.get(), &initRng, [&](Film* film, Random* rng, const Vec2& rasterPos) -> void
+    {
+        film->Splat(Vec2(1_f - rasterPos.x, rasterPos.y), SPD(1_f));
+    });
+    EXPECT_EQ(6400, processed);
+
+    // The image is rescaled by the default scheduler
+    const auto& data = static_cast<Stub_Film_Scheduler*>(film.get())->data;
+    EXPECT_NEAR(Float(Stub_Film_Scheduler::W * Stub_Film_Scheduler::H), std::accumulate(data.begin(), data.end(), 0_f), 1e-3_f);
+}
+
+/*
+    Checks if the tile scheduler forwards the splats at the sample positions
+    and the layers to the film, and the image does not depend on the number of threads.
+*/
+TEST_F(SchedulerTest, Tile)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | tile_size: 3
+    | num_samples: 640
+    )x")));
+
+    const auto Render = [&](int numThreads) -> std::vector<Float>
+    {
+        Parallel::SetNumThreads(numThreads);
+
+        const auto sched = ComponentFactory::Create<Scheduler>("scheduler::tile");
+        sched->Load(prop->Root());
+
+        Random initRng;
+        initRng.SetSeed(42);
+
+        const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+        const auto processed = sched->ProcessRaster(nullptr, film.get(), &initRng, [](Film* film, Random* rng, const Vec2& rasterPos) -> void
+        {
+            film->Splat(rasterPos, SPD(rng->Next()));
+            film->SplatLayer(0, rasterPos, Vec3(1_f));
+        });
+        EXPECT_EQ(640, processed);
+
+        const auto* stub = static_cast<Stub_Film_Scheduler*>(film.get());
+        EXPECT_EQ(640, stub->numLayerSplats);
+        EXPECT_LT(0_f, stub->centerDist);
+        return stub->data;
+    };
+
+    const auto origNumThreads = Parallel::GetNumThreads();
+    const auto expected = Render(1);
+    for (int numThreads : { 2, 4 })
+    {
+        const auto result = Render(numThreads);
+        ASSERT_EQ(expected.size(), result.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            EXPECT_EQ(expected[i], result[i]) << "numThreads = " << numThreads << ", i = " << i;
+        }
+    }
+    Parallel::SetNumThreads(origNumThreads);
+}
+
+/*
+    Checks if the periodic checkpoints contain the samples rendered so far
+    when progress images are disabled.
+*/
+TEST_F(SchedulerTest, Checkpoint)
+{
+    const auto prop = ComponentFactory::Create<PropertyTree>();
+    ASSERT_TRUE(prop->LoadFromString(TestUtils::MultiLineLiteral(R"x(
+    | grain_size: 100
+    | render_time: 1
+    )x")));
+
+    const auto path = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+    Checkpoint::SetPath(path);
+    Checkpoint::SetInterval(0.1);
+
+    const auto sched = ComponentFactory::Create<Scheduler>();
+    sched->Load(prop->Root());
+
+    Random initRng;
+    initRng.SetSeed(42);
+
+    // Read the checkpoint in the middle of the rendering,
+    // which is saved by the periodic update and not by the final one
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::atomic<bool> checked(false);
+    long long checkpointSamples = -1;
+    const auto film = ComponentFactory::Create<Film>("film::stub_film_scheduler");
+    sched->Process(nullptr, film.get(), &initRng, [&](Film* film, Random* rng) -> void
+    {
+        film->Splat(rng->Next2D(), SPD(1_f));
+        if (!checked && std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() > 0.5)
+        {
+            if (!checked.exchange(true))
+            {
+                Checkpoint::Load("scheduler::default", [&](std::istream& in) -> bool
+                {
+                    return Checkpoint::Read(in, checkpointSamples);
+                });
+            }
+        }
+    });
+
+    Checkpoint::SetPath("");
+    Checkpoint::SetInterval(-1);
+    boost::filesystem::remove(path);
+
+    EXPECT_TRUE(checked);
+    EXPECT_GT(checkpointSamples, 0);
+}
+
+/*
+    Checks if the thread IDs given by `Parallel::For` are bounded by the number of threads,
+    which are used as indices of the per-thread data by the renderers.
+*/
+TEST_F(SchedulerTest, ParallelForThreadID)
+{
+    const auto origNumThreads = Parallel::GetNumThreads();
+    for (int numThreads : { 1, 2, 4 })
+    {
+        Parallel::SetNumThreads(numThreads);
+        std::atomic<int> maxThreadID(-1);
+        std::atomic<long long> count(0);
+        Parallel::For(1000000, [&](long long index, int threadid, bool init) -> void
+        {
+            int prev = maxThreadID;
+            while (prev < threadid && !maxThreadID.compare_exchange_weak(prev, threadid)) {}
+            count++;
+        });
+        EXPECT_LE(0, maxThreadID.load());
+        EXPECT_GT(numThreads, maxThreadID.load());
+        EXPECT_EQ(1000000, count.load());
+    }
+    Parallel::SetNumThreads(origNumThreads);
+}
+
+#pragma endregion
+
+LM_TEST_NAMESPACE_END
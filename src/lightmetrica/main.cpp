@@ -35,6 +35,7 @@
 #include <lightmetrica/detail/propertyutils.h>
 #include <lightmetrica/detail/version.h>
 #include <lightmetrica/detail/parallel.h>
+#include <lightmetrica/detail/checkpoint.h>
 #include <lightmetrica/fp.h>
 #include <lightmetrica/random.h>
 
@@ -93,6 +94,7 @@ enum class SubcommandType
 {
     Help,
     Render,
+    Merge,
     //Verify,
 };
 
@@ -111,6 +113,17 @@ struct ProgramOption
         bool Interactive;
         int Seed;
     } Render;
+    struct
+    {
+        bool Help = false;
+        std::string HelpDetail;
+        std::string SceneFile;
+        std::string OutputPath;
+        std::string BasePath;
+        std::string FilmID;
+        std::vector<std::string> Inputs;
+        bool Verbose;
+    } Merge;
 
 public:
 
@@ -187,10 +200,17 @@ public:
                         ("scene,s", po::value<std::string>(), "Scene configuration file")
                         ("output,o", po::value<std::string>()->default_value("result"), "Output image")
                         ("num-threads,j", po::value<int>(), "Number of threads")
+                        ("pin-threads", po::bool_switch()->default_value(false), "Pin the worker threads to the CPUs")
+                        ("numa", po::bool_switch()->default_value(false), "Pin the worker threads per NUMA node. The qbvh and obvh accels also replicate their data per node")
                         ("verbose,v", po::bool_switch()->default_value(false), "Adds detailed information on the output")
                         ("interactive,i", po::bool_switch(&Render.Interactive), "Interactive mode")
                         ("base,b", po::value<std::string>(), "Base path of the asset loading")
-                        ("seed", po::value<int>()->default_value(-1), "Initial seed for random number generators (-1 : default)");
+                        ("seed", po::value<int>()->default_value(-1), "Initial seed for random number generators (-1 : default)")
+                        ("checkpoint", po::value<std::string>(), "Checkpoint file (default : <output>.checkpoint). Suffixed by the worker index with --num-workers")
+                        ("checkpoint-interval", po::value<double>()->default_value(-1), "Interval of checkpoints in seconds (-1 : disabled)")
+                        ("resume", po::bool_switch()->default_value(false), "Resume rendering from the checkpoint")
+                        ("worker-index", po::value<int>()->default_value(0), "Index of the worker process (see --num-workers)")
+                        ("num-workers", po::value<int>()->default_value(1), "Number of the worker processes rendering the same image. The partial results are combined by `lightmetrica merge`. Requires --seed");
 
                     auto opts = po::collect_unrecognized(parsed.options, po::include_positional);
                     opts.erase(opts.begin());
@@ -252,6 +272,100 @@ public:
                     {
                         Parallel::SetNumThreads(vm["num-threads"].as<int>());
                     }
+                    Parallel::SetPinThreads(vm["pin-threads"].as<bool>());
+                    Parallel::SetNumaAware(vm["numa"].as<bool>());
+
+                    const int workerIndex = vm["worker-index"].as<int>();
+                    const int numWorkers = vm["num-workers"].as<int>();
+                    if (numWorkers < 1 || workerIndex < 0 || workerIndex >= numWorkers)
+                    {
+                        LM_LOG_ERROR_SIMPLE("Invalid arguments : '--worker-index' must be in [0, --num-workers)");
+                        return false;
+                    }
+                    if (numWorkers > 1 && Render.Seed == -1)
+                    {
+                        // The worker processes must share the initial seed to split the same sequence of samples
+                        LM_LOG_ERROR_SIMPLE("Invalid arguments : '--seed' is required with '--num-workers'");
+                        return false;
+                    }
+
+                    // Each worker writes the image and the partial result to its own path,
+                    // i.e., <output>.<index>.checkpoint by default or <checkpoint>.<index> if specified
+                    const std::string workerSuffix = numWorkers > 1 ? "." + std::to_string(workerIndex) : "";
+                    if (numWorkers > 1)
+                    {
+                        Parallel::SetWorkerProcess(workerIndex, numWorkers);
+                        Render.OutputPath += workerSuffix;
+                    }
+                    const std::string checkpointPath = vm.count("checkpoint") ? vm["checkpoint"].as<std::string>() + workerSuffix : Render.OutputPath + ".checkpoint";
+
+                    Checkpoint::SetPath(checkpointPath);
+                    Checkpoint::SetInterval(vm["checkpoint-interval"].as<double>());
+                    Checkpoint::SetResume(vm["resume"].as<bool>());
+
+                    return true;
+                }
+
+                #pragma endregion
+
+                // --------------------------------------------------------------------------------
+
+                #pragma region Process merge subcommand
+
+                if (subcmd == "merge")
+                {
+                    Type = SubcommandType::Merge;
+
+                    po::options_description mergeOpt("Options");
+                    mergeOpt.add_options()
+                        ("help", "Display help message (this message)")
+                        ("scene,s", po::value<std::string>(), "Scene configuration file used for the rendering")
+                        ("output,o", po::value<std::string>()->default_value("result"), "Output image")
+                        ("verbose,v", po::bool_switch()->default_value(false), "Adds detailed information on the output")
+                        ("base,b", po::value<std::string>(), "Base path of the asset loading")
+                        ("film", po::value<std::string>(), "ID of the film asset (default : film of the sensor)")
+                        ("input", po::value<std::vector<std::string>>(), "Partial results written by the worker processes");
+
+                    po::positional_options_description mergePos;
+                    mergePos.add("input", -1);
+
+                    auto opts = po::collect_unrecognized(parsed.options, po::include_positional);
+                    opts.erase(opts.begin());
+
+                    po::store(po::command_line_parser(opts).options(mergeOpt).positional(mergePos).run(), vm);
+                    if (vm.count("help") || opts.empty())
+                    {
+                        std::stringstream ss;
+                        ss << mergeOpt;
+                        Merge.Help = true;
+                        Merge.HelpDetail = ss.str();
+                        return true;
+                    }
+
+                    po::notify(vm);
+
+                    Merge.OutputPath = vm["output"].as<std::string>();
+                    Merge.Verbose    = vm["verbose"].as<bool>();
+
+                    if (!vm.count("scene"))
+                    {
+                        LM_LOG_ERROR_SIMPLE("Missing arguments : '--scene,-s'");
+                        return false;
+                    }
+                    Merge.SceneFile = vm["scene"].as<std::string>();
+                    Merge.BasePath = vm.count("base") ? vm["base"].as<std::string>() : boost::filesystem::path(Merge.SceneFile).parent_path().string();
+
+                    if (vm.count("film"))
+                    {
+                        Merge.FilmID = vm["film"].as<std::string>();
+                    }
+
+                    if (!vm.count("input"))
+                    {
+                        LM_LOG_ERROR_SIMPLE("Missing arguments : partial results to merge");
+                        return false;
+                    }
+                    Merge.Inputs = vm["input"].as<std::vector<std::string>>();
 
                     return true;
                 }
@@ -319,6 +433,7 @@ public:
         {
             case SubcommandType::Help:   { return ProcessCommand_Help(opt);   }
             case SubcommandType::Render: { return ProcessCommand_Render(opt); }
+            case SubcommandType::Merge:  { return ProcessCommand_Merge(opt);  }
         }
 
         return false;
@@ -346,6 +461,10 @@ private:
         |   Render the image.
         |   `lightmetrica render --help` for more detailed help.
         |
+        | - lightmetrica merge
+        |   Merge the partial results of the worker processes.
+        |   `lightmetrica merge --help` for more detailed help.
+        |
         )x"));
         return true;
     }
@@ -462,6 +581,345 @@ private:
         
         // --------------------------------------------------------------------------------
 
+        if (!LoadPlugins())
+        {
+            return false;
+        }
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Load configuration files
+
+        const auto sceneConf = ComponentFactory::Create<PropertyTree>();
+        const auto* root = LoadSceneConfiguration(sceneConf.get(), opt.Render.SceneFile, opt.Render.BasePath, opt.Render.Interactive);
+        if (!root)
+        {
+            return false;
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Initialize asset manager
+
+        const auto assets = ComponentFactory::Create<Assets>();
+        {
+            LM_LOG_INFO("Initializing asset manager");
+            LM_LOG_INDENTER();
+
+            const auto* n = root->Child("assets");
+            if (!n)
+            {
+                return false;
+            }
+            if (!assets->Initialize(n))
+            {
+                return false;
+            }
+        }
+        
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Initialize accel
+        
+        const auto accel = InitializeConfigurable<Accel>(root, "accel", { "qbvh", "obvh", "bvh_sahbin" });
+        if (!accel)
+        {
+            return false;
+        }
+
+        // Only some of the accels replicate their data per NUMA node
+        if (Parallel::GetNumaAware())
+        {
+            const std::string implName = (*accel)->implName;
+            if (implName != "Accel_QBVH" && implName != "Accel_OBVH")
+            {
+                LM_LOG_INFO("The accel '" + implName + "' does not replicate its data per NUMA node. Only the threads are pinned.");
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Initialize scene
+
+        const auto scene = ComponentFactory::Create<Scene>();
+        {
+            LM_LOG_INFO("Initializing scene");
+            LM_LOG_INDENTER();
+
+            const auto* n = root->Child("scene");
+            if (!n)
+            {
+                return false;
+            }
+            if (!scene->Initialize(n, assets.get(), accel->get()))
+            {
+                return false;
+            }
+        }
+
+        #pragma endregion
+
+        // ---------------------------------------- ----------------------------------------
+
+        #pragma region Initialize renderer
+
+        const auto renderer = InitializeConfigurable<Renderer>(root, "renderer");
+        if (!renderer)
+        {
+            return false;
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Process rendering
+
+        {
+            LM_LOG_INFO("Rendering");
+            LM_LOG_INDENTER();
+
+            // Film
+            const auto* sensor = static_cast<const Sensor*>(scene.get()->GetSensor()->emitter);
+            auto* film = sensor->GetFilm();
+            
+            // Initial random number generator
+            Random initRng;
+            unsigned int seed;
+            if (opt.Render.Seed == -1)
+            {
+                #if LM_DEBUG_MODE
+                seed = 1008556906;
+                #else
+                seed = static_cast<unsigned int>(std::time(nullptr));
+                #endif
+            }
+            else
+            {
+                seed = opt.Render.Seed;
+            }
+            LM_LOG_INFO("Initial seed: " + std::to_string(seed));
+            initRng.SetSeed(seed);
+            
+            // Print thread info
+            LM_LOG_INFO("Number of threads: " + std::to_string(Parallel::GetNumThreads()));
+
+            // Dispatch renderer
+            FPUtils::EnableFPControl();
+            renderer.get()->Render(scene.get(), &initRng, film);
+            FPUtils::DisableFPControl();
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save image
+
+        {
+            LM_LOG_INFO("Saving image");
+            LM_LOG_INDENTER();
+            auto* film = static_cast<const Sensor*>(scene.get()->GetSensor()->emitter)->GetFilm();
+            if (!film->Save(opt.Render.OutputPath))
+            {
+                return false;
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return true;
+    }
+
+    auto ProcessCommand_Merge(const ProgramOption& opt) -> bool
+    {
+        #pragma region Configure logger
+
+        Logger::SetVerboseLevel(opt.Merge.Verbose ? 2 : 0);
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Handle help message
+
+        if (opt.Merge.Help)
+        {
+            LM_LOG_INFO_SIMPLE("");
+            LM_LOG_INFO_SIMPLE("Usage: lightmetrica merge [options] partial1 partial2 ...");
+            LM_LOG_INFO_SIMPLE("");
+            LM_LOG_INFO_SIMPLE(opt.Merge.HelpDetail);
+            return true;
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        if (!LoadPlugins())
+        {
+            return false;
+        }
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Load configuration files
+
+        const auto sceneConf = ComponentFactory::Create<PropertyTree>();
+        const auto* root = LoadSceneConfiguration(sceneConf.get(), opt.Merge.SceneFile, opt.Merge.BasePath, false);
+        if (!root)
+        {
+            return false;
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Load film
+
+        // Only the film asset is loaded, since the scene is not necessary for merging
+        const auto assets = ComponentFactory::Create<Assets>();
+        Film* film = nullptr;
+        {
+            LM_LOG_INFO("Loading film");
+            LM_LOG_INDENTER();
+
+            const auto* n = root->Child("assets");
+            if (!n)
+            {
+                LM_LOG_ERROR("Missing 'assets' node");
+                PropertyUtils::PrintPrettyError(root);
+                return false;
+            }
+            if (!assets->Initialize(n))
+            {
+                return false;
+            }
+
+            // Find the film of the sensor if not specified (scene/sensor -> scene/nodes -> assets/<sensor>/params/film)
+            auto filmID = opt.Merge.FilmID;
+            if (filmID.empty())
+            {
+                const auto* sceneNode = root->Child("scene");
+                const auto* sensorNode = sceneNode ? sceneNode->Child("sensor") : nullptr;
+                const auto* nodesNode = sceneNode ? sceneNode->Child("nodes") : nullptr;
+                if (sensorNode && nodesNode)
+                {
+                    for (int i = 0; i < nodesNode->Size(); i++)
+                    {
+                        const auto* idNode = nodesNode->At(i)->Child("id");
+                        const auto* sensorAssetNode = nodesNode->At(i)->Child("sensor");
+                        if (!idNode || !sensorAssetNode || idNode->As<std::string>() != sensorNode->As<std::string>())
+                        {
+                            continue;
+                        }
+                        const auto* assetNode = n->Child(sensorAssetNode->As<std::string>());
+                        const auto* paramsNode = assetNode ? assetNode->Child("params") : nullptr;
+                        const auto* filmNode = paramsNode ? paramsNode->Child("film") : nullptr;
+                        if (filmNode)
+                        {
+                            filmID = filmNode->As<std::string>();
+                        }
+                        break;
+                    }
+                }
+                if (filmID.empty())
+                {
+                    LM_LOG_ERROR("Failed to find the film of the sensor. Specify the film with '--film'.");
+                    return false;
+                }
+            }
+
+            film = static_cast<Film*>(assets->AssetByIDAndType(filmID, "film", nullptr));
+            if (!film)
+            {
+                LM_LOG_ERROR("Failed to load film '" + filmID + "'");
+                return false;
+            }
+            if (!film->Deserialize.Implemented())
+            {
+                LM_LOG_ERROR("The film does not support merging");
+                return false;
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Merge partial results
+
+        {
+            LM_LOG_INFO("Merging partial results");
+            LM_LOG_INDENTER();
+
+            film->Clear();
+            const auto partialFilm = ComponentFactory::Clone<Film>(film);
+            long long totalSamples = 0;
+            for (const auto& input : opt.Merge.Inputs)
+            {
+                long long samples;
+                double elapsed;
+                Checkpoint::SetPath(input);
+                if (!Checkpoint::Load("scheduler::default", [&](std::istream& in) -> bool
+                {
+                    return Checkpoint::Read(in, samples) && Checkpoint::Read(in, elapsed) && partialFilm->Deserialize(in);
+                }))
+                {
+                    return false;
+                }
+
+                LM_LOG_INFO(boost::str(boost::format("%s : %d samples") % input % samples));
+                film->Accumulate(partialFilm.get());
+                totalSamples += samples;
+            }
+
+            if (totalSamples == 0)
+            {
+                LM_LOG_ERROR("No samples in the partial results");
+                return false;
+            }
+
+            LM_LOG_INFO(boost::str(boost::format("# of samples: %d") % totalSamples));
+            film->Rescale((Float)(film->Width() * film->Height()) / totalSamples);
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        #pragma region Save image
+
+        {
+            LM_LOG_INFO("Saving image");
+            LM_LOG_INDENTER();
+            if (!film->Save(opt.Merge.OutputPath))
+            {
+                return false;
+            }
+        }
+
+        #pragma endregion
+
+        // --------------------------------------------------------------------------------
+
+        return true;
+    }
+
+private:
+
+    // Load plugins in the `plugin` directory next to the executable
+    auto LoadPlugins() -> bool
+    {
         #pragma region Load plugins
 
         // TODO: Make configurable plugin directory
@@ -510,21 +968,24 @@ private:
 
         #pragma endregion
 
-        // --------------------------------------------------------------------------------
+        return true;
+    }
 
+    // Load and validate the scene configuration file. Returns `lightmetrica` node.
+    auto LoadSceneConfiguration(PropertyTree* sceneConf, const std::string& sceneFile, const std::string& basePath, bool interactive) -> const PropertyNode*
+    {
         #pragma region Load configuration files
 
         // Scene configuration
-        const auto sceneConf = ComponentFactory::Create<PropertyTree>();
         {
             LM_LOG_INFO("Loading scene file");
             LM_LOG_INDENTER();
-            LM_LOG_INFO("Loading '" + opt.Render.SceneFile + "'");
+            LM_LOG_INFO("Loading '" + sceneFile + "'");
 
             // Load configuration file
             std::string content;
             
-            if (opt.Render.Interactive)
+            if (interactive)
             {
                 // Load from standard input
                 int c;
@@ -536,11 +997,11 @@ private:
             else
             {
                 // Load from file
-                std::ifstream t(opt.Render.SceneFile);
+                std::ifstream t(sceneFile);
                 if (!t.is_open())
                 {
-                    LM_LOG_ERROR("Failed to open: " + opt.Render.SceneFile);
-                    return false;
+                    LM_LOG_ERROR("Failed to open: " + sceneFile);
+                    return nullptr;
                 }
                 std::stringstream ss;
                 ss << t.rdbuf();
@@ -548,9 +1009,9 @@ private:
             }
 
             // Expand template & load scene file
-            if (!sceneConf->LoadFromStringWithFilename(content, opt.Render.SceneFile, opt.Render.BasePath))
+            if (!sceneConf->LoadFromStringWithFilename(content, sceneFile, basePath))
             {
-                return false;
+                return nullptr;
             }
         }
 
@@ -566,7 +1027,7 @@ private:
         {
             // TODO: Improve error messages
             LM_LOG_ERROR("Missing 'lightmetrica' node");
-            return false;
+            return nullptr;
         }
 
         #pragma endregion
@@ -586,7 +1047,7 @@ private:
             {
                 LM_LOG_ERROR("Missing 'version' node");
                 PropertyUtils::PrintPrettyError(root);
-                return false;
+                return nullptr;
             }
 
             // Parse version string
@@ -598,7 +1059,7 @@ private:
             {
                 LM_LOG_ERROR("Invalid version string: " + versionStr);
                 PropertyUtils::PrintPrettyError(versionNode);
-                return false;
+                return nullptr;
             }
 
             // Check version
@@ -615,140 +1076,13 @@ private:
                         % std::get<0>(version) % std::get<1>(version) % std::get<2>(version)));
                 }
                 PropertyUtils::PrintPrettyError(versionNode);
-                return false;
-            }
-        }
-
-        #pragma endregion
-
-        // --------------------------------------------------------------------------------
-
-        #pragma region Initialize asset manager
-
-        const auto assets = ComponentFactory::Create<Assets>();
-        {
-            LM_LOG_INFO("Initializing asset manager");
-            LM_LOG_INDENTER();
-
-            const auto* n = root->Child("assets");
-            if (!n)
-            {
-                return false;
+                return nullptr;
             }
-            if (!assets->Initialize(n))
-            {
-                return false;
-            }
-        }
-        
-        #pragma endregion
-
-        // --------------------------------------------------------------------------------
-
-        #pragma region Initialize accel
-        
-        const auto accel = InitializeConfigurable<Accel>(root, "accel", { "qbvh" });
-        if (!accel)
-        {
-            return false;
         }
 
         #pragma endregion
 
-        // --------------------------------------------------------------------------------
-
-        #pragma region Initialize scene
-
-        const auto scene = ComponentFactory::Create<Scene>();
-        {
-            LM_LOG_INFO("Initializing scene");
-            LM_LOG_INDENTER();
-
-            const auto* n = root->Child("scene");
-            if (!n)
-            {
-                return false;
-            }
-            if (!scene->Initialize(n, assets.get(), accel->get()))
-            {
-                return false;
-            }
-        }
-
-        #pragma endregion
-
-        // ---------------------------------------- ----------------------------------------
-
-        #pragma region Initialize renderer
-
-        const auto renderer = InitializeConfigurable<Renderer>(root, "renderer");
-        if (!renderer)
-        {
-            return false;
-        }
-
-        #pragma endregion
-
-        // --------------------------------------------------------------------------------
-
-        #pragma region Process rendering
-
-        {
-            LM_LOG_INFO("Rendering");
-            LM_LOG_INDENTER();
-
-            // Film
-            const auto* sensor = static_cast<const Sensor*>(scene.get()->GetSensor()->emitter);
-            auto* film = sensor->GetFilm();
-            
-            // Initial random number generator
-            Random initRng;
-            unsigned int seed;
-            if (opt.Render.Seed == -1)
-            {
-                #if LM_DEBUG_MODE
-                seed = 1008556906;
-                #else
-                seed = static_cast<unsigned int>(std::time(nullptr));
-                #endif
-            }
-            else
-            {
-                seed = opt.Render.Seed;
-            }
-            LM_LOG_INFO("Initial seed: " + std::to_string(seed));
-            initRng.SetSeed(seed);
-            
-            // Print thread info
-            LM_LOG_INFO("Number of threads: " + std::to_string(Parallel::GetNumThreads()));
-
-            // Dispatch renderer
-            FPUtils::EnableFPControl();
-            renderer.get()->Render(scene.get(), &initRng, film);
-            FPUtils::DisableFPControl();
-        }
-
-        #pragma endregion
-
-        // --------------------------------------------------------------------------------
-
-        #pragma region Save image
-
-        {
-            LM_LOG_INFO("Saving image");
-            LM_LOG_INDENTER();
-            auto* film = static_cast<const Sensor*>(scene.get()->GetSensor()->emitter)->GetFilm();
-            if (!film->Save(opt.Render.OutputPath))
-            {
-                return false;
-            }
-        }
-
-        #pragma endregion
-
-        // --------------------------------------------------------------------------------
-
-        return true;
+        return root;
     }
 
 private: